@@ -1,7 +1,8 @@
 
 #define MAX_ROOT_STEPS 256
 #define MAX_TREE_STEPS 512
-#define MAX_TWIG_STEPS 64
+// The most cells a ray can cross in a twig
+#define MAX_TWIG_STEPS (3 * TWIG_SIZE - 2)
 #define MAX_DEPTH 32
 
 #define EMPTY  0
@@ -9,10 +10,18 @@
 #define BRANCH 2
 #define TWIG   3
 
-#define TWIG_SIZE 4
-#define TWIG_DEPTH 2
-#define TWIG_WORDS 64
-#define TWIG_DWORDS 32
+#define CHUNK_SPARSE 1
+// Chunks far away are coarser copies with shallower trees, see World::pickdetail
+#define CHUNK_DEPTH_SHIFT 8
+#define SPARSE_OFFSET_BITS 21
+#define SPARSE_EMPTY 1
+#define DAG_SHARED (1u << 29)
+// The dag shared by all chunks comes after them
+#define DAG_ROOT (csw * csh * csd)
+
+// TWIG_DEPTH, TWIG_SIZE, TWIG_WORDS, TWIG_PALETTE and the twig layout in dwords (TWIG_DWORDS,
+// TWIG_MASK_DWORD, TWIG_PALETTE_DWORD, TWIG_INDEX_DWORD) are defined by defineTwigLayout() to
+// match the C++ build
 
 #define EPS (1.0 / 4096.0)
 #define BIGEPS (1.0 / 16.0)
@@ -27,7 +36,7 @@ struct Root
     uint tr_offset;
     uint tw_region;
     uint tw_offset;
-    uint _align;
+    uint flags;
 };
 
 struct Leaf
@@ -72,14 +81,26 @@ uint Tree_type(uint t)
     return t >> 30;
 }
 
-uint Twig_shift(uint t)
+uint Tree_offset(uint t)
 {
-    return (t % 2 != 0) ? 16 : 0;
+    return t & ~(3 << 30);
 }
 
-uint Tree_offset(uint t)
+bool Tree_shared(uint t)
 {
-    return t & ~(3 << 30);
+    return (t & DAG_SHARED) != 0;
+}
+
+// Sparse branches: 8-bit mask of stored children, then the offset of the first one
+uint Tree_child(uint t, uint branch, bool sparse)
+{
+    if (!sparse)
+        return Tree_offset(t) + branch;
+    uint mask = (Tree_offset(t) >> SPARSE_OFFSET_BITS) & 0xff;
+    if ((mask & (1u << branch)) == 0)
+        return SPARSE_EMPTY;
+    uint first = t & ((1u << SPARSE_OFFSET_BITS) - 1);
+    return first + bitCount(mask & ((1u << branch) - 1));
 }
 
 uint Tree_branch(bool xg, bool yg, bool zg)
@@ -89,12 +110,24 @@ uint Tree_branch(bool xg, bool yg, bool zg)
 
 uint Twig_offset(uint t)
 {
-    return Tree_offset(t) * TWIG_DWORDS;
+    return (Tree_offset(t) & ~DAG_SHARED) * TWIG_DWORDS;
+}
+
+uint Twig_word(uint x, uint y, uint z)
+{
+    return (z * TWIG_SIZE + y) * TWIG_SIZE + x;
+}
+
+// Twig layout in dwords: occupancy mask, 4 16-bit palette entries, 2-bit indices
+bool Twig_solid(uint reg, uint i, uint w)
+{
+    return ((Twig(reg, i + TWIG_MASK_DWORD + w / 32) >> (w % 32)) & 1) != 0;
 }
 
-uint Twig_dword(uint x, uint y, uint z)
+uint Twig_leaf(uint reg, uint i, uint w)
 {
-    return (z * 16 + y * 4 + x) / 2;
+    uint k = (Twig(reg, i + TWIG_INDEX_DWORD + w / 16) >> (w % 16 * 2)) & 3;
+    return (Twig(reg, i + TWIG_PALETTE_DWORD + k / 2) >> (k % 2 * 16)) & 0xffff;
 }
 
 bool isInsideCube(vec3 p, vec3 cmin, vec3 cmax)
@@ -166,14 +199,19 @@ int chunkIndex(vec3 p)
     return i + j + k;
 }
 
-Leaf descend(vec3 p, int root)
+// The offset of the returned leaf is where its word is in the tree buffer, which is in the
+// dag once the descent has gone through a shared branch. reg is the region of that buffer.
+Leaf descend(vec3 p, int root, out uint reg)
 {
-    Leaf leaf = Leaf(Chunk[root].bmin, chunksize, 0);
-    uint reg = Chunk[root].tr_region;
+    reg = Chunk[root].tr_region;
     uint off = Chunk[root].tr_offset;
-    for (int _step = 0; _step < MAX_DEPTH; ++_step)
+    uint dag = Chunk[DAG_ROOT].tr_offset;
+    bool sparse = (Chunk[root].flags & CHUNK_SPARSE) != 0;
+    int depth = min(int(Chunk[root].flags >> CHUNK_DEPTH_SHIFT), MAX_DEPTH);
+    Leaf leaf = Leaf(Chunk[root].bmin, chunksize, off);
+    for (int _step = 0; _step < depth; ++_step)
     {
-        uint value = Tree(reg, off + leaf.offset);
+        uint value = Tree(reg, leaf.offset);
         uint type = Tree_type(value);
         if (type != BRANCH)
             break;
@@ -182,55 +220,55 @@ Leaf descend(vec3 p, int root)
         bvec3 geq = greaterThanEqual(p, mid);
         uint branch = Tree_branch(geq.x, geq.y, geq.z);
         vec3 nextpos = leaf.bmin + vec3(geq) * halfsize;
-        leaf = Leaf(nextpos, halfsize, Tree_offset(value) + branch);
+        uint next = Tree_shared(value) 
+            ? dag + (Tree_offset(value) & ~DAG_SHARED) + branch 
+            : off + Tree_child(value, branch, sparse);
+        if (Tree_shared(value))
+            reg = Chunk[DAG_ROOT].tr_region;
+        leaf = Leaf(nextpos, halfsize, next);
     }
     return leaf;
 }
 
-bool twigmarch(uint i, uint ignore,
+// A 3D-DDA over the cells of the twig at i of the twig region reg, the next face of each axis
+// is kept as the distance to it and the nearest one is crossed at every step, so each cell is
+// looked at once at most
+bool twigmarch(uint reg, uint i, uint ignore,
     vec3 a, vec3 b, vec3 g,
-    vec3 cmin, float size, float leafsize, int root,
+    vec3 cmin, float size, float leafsize,
     out float s, out Leaf hit, inout int steps)
 {
-    vec3 cmax = cmin + size;
-    vec3 imin = vec3(0);
-    vec3 imax = vec3(TWIG_SIZE - 1);
-
-    float inv_leafsize = 1.0 / leafsize;
 
-    uint reg = Chunk[root].tw_region;
-    uint off = Chunk[root].tw_offset;
+    // On a face between cells, the cell is the one the ray goes into
+    vec3 u = (a - cmin) / leafsize;
+    bvec3 down = lessThan(b, vec3(0));
+    ivec3 cell = ivec3(mix(floor(u), ceil(u) - 1.0, down));
+    ivec3 dir = ivec3(mix(vec3(1), vec3(-1), down));
+    // Rays parallel to an axis never cross its faces
+    bvec3 parallel = equal(b, vec3(0));
+    vec3 next = mix((vec3(cell) + vec3(not(down)) - u) * leafsize * g, vec3(FAR), parallel);
+    vec3 delta = mix(abs(g) * leafsize, vec3(FAR), parallel);
 
     float t = 0;
     int _step;
     for (_step = 0; _step < MAX_TWIG_STEPS; ++_step)
     {
-        vec3 p = a + b * t;
-        if (!isInsideCube(p, cmin, cmax))
-            break;
-
-        ivec3 offset = ivec3((p - cmin) * inv_leafsize);
-
-        if (!isInsideCube(offset, imin, imax))
+        if (any(lessThan(cell, ivec3(0))) || any(greaterThanEqual(cell, ivec3(TWIG_SIZE))))
             break;
 
-        vec3 leafmin = cmin + offset * leafsize;
-        vec3 leafmax = leafmin + leafsize;
-
-        uint word = Twig_dword(offset.x, offset.y, offset.z);
-        uint shift = Twig_shift(offset.x);
-        uint mask = 0xffff;
-
-        uint bark = (Twig(reg, off + i + word) >> shift) & mask;
-        if (bark != 0)
+        uint word = Twig_word(cell.x, cell.y, cell.z);
+        if (Twig_solid(reg, i, word))
         {
             s = t;
-            hit = Leaf(leafmin, leafsize, bark);
+            hit = Leaf(cmin + vec3(cell) * leafsize, leafsize, Twig_leaf(reg, i, word));
             steps += _step;
             return true;
         }
-        float escape = cubeEscapeDistance(p, g, leafmin, leafmax) + EPS;
-        t += escape;
+
+        int k = next.x < next.y ? (next.x < next.z ? 0 : 2) : (next.y < next.z ? 1 : 2);
+        t = next[k];
+        next[k] += delta[k];
+        cell[k] += dir[k];
     }
     steps += _step;
     s = t;
@@ -243,8 +281,6 @@ bool treemarch(vec3 a, vec3 b, vec3 g,
 {
     vec3 rmin = Chunk[root].bmin;
     vec3 rmax = rmin + chunksize;
-    uint reg = Chunk[root].tr_region;
-    uint off = Chunk[root].tr_offset;
 
     float t = 0;
     int _step;
@@ -254,10 +290,11 @@ bool treemarch(vec3 a, vec3 b, vec3 g,
         if (!isInsideCube(p, rmin, rmax))
             break;
 
-        Leaf leaf = descend(p, root);
+        uint reg;
+        Leaf leaf = descend(p, root, reg);
         vec3 leafmin = leaf.bmin;
         vec3 leafmax = leafmin + leaf.size;
-        uint value = Tree(reg, off + leaf.offset);
+        uint value = Tree(reg, leaf.offset);
         uint type = Tree_type(value);
 
         if (type == LEAF)
@@ -277,9 +314,12 @@ bool treemarch(vec3 a, vec3 b, vec3 g,
                 float leafsize = leaf.size / (1 << TWIG_DEPTH);
 
                 float u = 0;
-                if (twigmarch(Twig_offset(value), ignore,
+                // Twigs of shared branches are in the dag's twig buffer
+                int owner = Tree_shared(value) ? DAG_ROOT : root;
+                uint twig = Chunk[owner].tw_offset + Twig_offset(value);
+                if (twigmarch(Chunk[owner].tw_region, twig, ignore,
                     p, b, g,
-                    leafmin, leaf.size, leafsize, root,
+                    leafmin, leaf.size, leafsize,
                     u, hit, steps))
                 {
                     s = t + u;
@@ -4,14 +4,11 @@
 #define BRANCH 2
 #define TWIG   3
 
-#define TWIG_SIZE 4
-#define TWIG_LEVELS 2
-#define TWIG_WORDS 64
-#define TWIG_DWORDS 32
+// The twig layout is defined by defineTwigLayout() to match the C++ build, see Chunkmarch.glsl
 
 #define MAX_DEPTH 32
 #define MAX_STEPS 512
-#define MAX_TWIG_STEPS 64
+#define MAX_TWIG_STEPS (16 * TWIG_SIZE)
 #define MAX_DIST 4096.0
 
 #define NEAR 0.125
@@ -70,12 +67,15 @@ uint Twig_offset(uint t) {
     return Tree_offset(t) * TWIG_DWORDS;
 }
 
-uint Twig_dword(uint x, uint y, uint z) {
-    return (z * 16 + y * 4 + x) / 2;
+uint Twig_word(uint x, uint y, uint z) {
+    return (z * TWIG_SIZE + y) * TWIG_SIZE + x;
 }
 
-uint Twig_shift(uint i) {
-    return i % 2 != 0 ? 16 : 0;
+// Same twig layout as Chunkmarch.glsl: mask, palette, indices
+uint Twig_leaf(uint i, uint w) {
+    if (((Twig(i + TWIG_MASK_DWORD + w / 32) >> (w % 32)) & 1) == 0) return 0;
+    uint k = (Twig(i + TWIG_INDEX_DWORD + w / 16) >> (w % 16 * 2)) & 3;
+    return (Twig(i + TWIG_PALETTE_DWORD + k / 2) >> (k % 2 * 16)) & 0xffff;
 }
 
 bool isInsideCube(vec3 p, vec3 cmin, vec3 cmax) {
@@ -139,11 +139,8 @@ bool twigmarch(uint index, uint ignore,
         vec3 leafmin = cmin + off * leafsize;
         vec3 leafmax = leafmin + leafsize;
 
-        uint word = Twig_dword(off.x, off.y, off.z);
-        uint shift = Twig_shift(word);
-        uint mask = 0xffff;
-
-        uint bark = (Twig(index + word) >> shift) & mask;
+        uint word = Twig_word(off.x, off.y, off.z);
+        uint bark = Twig_leaf(index, word);
         if (bark != 0 && bark != ignore) {
             // Hit!
             s = t;
@@ -185,7 +182,7 @@ float treemarch(vec3 a, vec3 b, vec3 g, uint ignore, out Leaf hit) {
                 t += escape;
             }
         } else if (type == TWIG) {
-            float leafsize = tree.size / (1 << TWIG_LEVELS);
+            float leafsize = tree.size / (1 << TWIG_DEPTH);
             float s = 0.0;
             if (twigmarch(Twig_offset(value), ignore, p, b, g, tree.pos, tree.size, leafsize, s, hit)) {
                 return t + s;
@@ -0,0 +1,98 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "Arena.h"
+#include "Util.h"
+
+SlabArena ocarena;
+
+int SlabArena::classof(size_t bytes)
+{
+    int c = MIN_CLASS;
+    while (((size_t)1 << c) < bytes)
+        ++c;
+    assert(c <= MAX_CLASS);
+    return c;
+}
+
+void SlabArena::deinit()
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    for (void *s : slab)
+        free(s);
+    slab.clear();
+    for (int c = 0; c <= MAX_CLASS; ++c)
+        sizeclass[c] = Class();
+    reserved = used = 0;
+}
+
+void *SlabArena::alloc(size_t bytes, size_t *capacity)
+{
+    int c = classof(bytes);
+    size_t size = (size_t)1 << c;
+    *capacity = size;
+
+    std::unique_lock<std::mutex> lock(mutex);
+    Class *k = &sizeclass[c];
+    used += size;
+
+    if (k->free)
+    {
+        // Recycle a block some other chunk gave back
+        Block *b = k->free;
+        k->free = b->next;
+        return b;
+    }
+
+    if (k->cursor == k->end)
+    {
+        // Start a new slab for this class, aligned to the block size up to a cache line
+        size_t slabsize = size * BLOCKS_PER_SLAB < MIN_SLAB ? MIN_SLAB : size * BLOCKS_PER_SLAB;
+        char *s = (char *)malloc(slabsize + 64);
+        if (!s)
+            die("SlabArena: out of memory allocating %zu bytes\n", slabsize);
+        slab.push_back(s);
+        reserved += slabsize;
+        k->cursor = (char *)(((uintptr_t)s + 63) & ~(uintptr_t)63);
+        k->end = k->cursor + slabsize;
+    }
+
+    void *p = k->cursor;
+    k->cursor += size;
+    return p;
+}
+
+// Moves p to a block of at least bytes, copying only the first keep bytes that are in use
+void *SlabArena::grow(void *p, size_t capacity, size_t keep, size_t bytes, size_t *newcapacity)
+{
+    assert(keep <= capacity && keep <= bytes);
+    if (p && bytes <= capacity)
+    {
+        *newcapacity = capacity;
+        return p;
+    }
+
+    void *q = alloc(bytes, newcapacity);
+    if (p)
+    {
+        memcpy(q, p, keep);
+        release(p, capacity);
+    }
+    return q;
+}
+
+void SlabArena::release(void *p, size_t capacity)
+{
+    if (!p)
+        return;
+
+    // Element counts that do not divide the block size still round up to the same class
+    int c = classof(capacity);
+
+    std::unique_lock<std::mutex> lock(mutex);
+    Block *b = (Block *)p;
+    b->next = sizeclass[c].free;
+    sizeclass[c].free = b;
+    used -= (size_t)1 << c;
+}
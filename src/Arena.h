@@ -0,0 +1,44 @@
+#pragma once
+
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+#include <mutex>
+#include <vector>
+
+// Pooled storage for the tree and twig arrays of chunks. Blocks come in power of two size
+// classes carved out of slabs, a released block goes on the free list of its class and is
+// handed out again to the next chunk needing that class. Nothing is returned to the system
+// before deinit, so regenerating chunks over and over settles at a constant footprint.
+struct SlabArena
+{
+    static constexpr int MIN_CLASS = 6;  // 64 bytes, one cache line
+    static constexpr int MAX_CLASS = 40;
+    static constexpr size_t MIN_SLAB = (size_t)1 << 16;
+    static constexpr int BLOCKS_PER_SLAB = 4;
+
+    struct Block { Block *next; };
+
+    struct Class
+    {
+        Block *free = nullptr;
+        char *cursor = nullptr, *end = nullptr;
+    };
+
+    std::mutex mutex;
+    Class sizeclass[MAX_CLASS+1];
+    std::vector<void *> slab;
+    size_t reserved = 0, used = 0;
+
+    void deinit();
+    void *alloc(size_t bytes, size_t *capacity);
+    void *grow(void *p, size_t capacity, size_t keep, size_t bytes, size_t *newcapacity);
+    void release(void *p, size_t capacity);
+
+    static int classof(size_t bytes);
+};
+
+extern SlabArena ocarena;
+
+#endif
@@ -0,0 +1,1688 @@
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <filesystem>
+#include <thread>
+#include <vector>
+#include <glm/vec3.hpp>
+#include <glm/geometric.hpp>
+#include <glm/gtc/noise.hpp>
+#include "Benchmark.h"
+#include "Octree.h"
+#include "BoundsPyramid.h"
+#include "Traverse.h"
+#include "World.h"
+#include "Util.h"
+#include "Debug.h"
+#include "Dag.h"
+#include "Stats.h"
+#include "Noise.h"
+#include "Density.h"
+#include "ChunkStore.h"
+#include "Journal.h"
+#include "Codec.h"
+#include "Packet.h"
+#include "Render.h"
+#include "Query.h"
+
+using glm::vec3;
+using glm::bvec3;
+using glm::ivec3;
+
+#define EPS (1.0f / 8192.0f)
+
+// Deterministic so that every run measures the same rays
+struct Random
+{
+    uint64_t state;
+
+    Random(uint64_t seed = 0x9e3779b97f4a7c15ull) : state(seed) { }
+
+    uint64_t next()
+    {
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+        return state;
+    }
+
+    float uniform()
+    {
+        return (float)(next() >> 40) / (float)(1 << 24);
+    }
+
+    vec3 direction()
+    {
+        for ( ; ; )
+        {
+            vec3 d = vec3(uniform(), uniform(), uniform()) * 2.0f - 1.0f;
+            float l = glm::length(d);
+            if (l > 0.01f && l <= 1.0f)
+                return d / l;
+        }
+    }
+};
+
+// Set associative LRU cache model, 32 KiB like a typical L1d.
+// Hardware counters are not portable, so the traversals report misses against this instead.
+struct CacheModel
+{
+    static constexpr int LINE = 64, WAYS = 8, SETS = 64;
+
+    uintptr_t tag[SETS][WAYS];
+    uint64_t used[SETS][WAYS];
+    uint64_t accesses, misses;
+
+    void reset()
+    {
+        memset(tag, 0, sizeof(tag));
+        memset(used, 0, sizeof(used));
+        accesses = misses = 0;
+    }
+
+    void touch(const void *p)
+    {
+        uintptr_t line = (uintptr_t)p / LINE;
+        int set = (int)(line % SETS);
+        ++accesses;
+
+        int lru = 0;
+        for (int w = 0; w < WAYS; ++w)
+        {
+            if (tag[set][w] == line + 1)
+            {
+                used[set][w] = accesses;
+                return;
+            }
+            if (used[set][w] < used[set][lru])
+                lru = w;
+        }
+
+        ++misses;
+        tag[set][lru] = line + 1;
+        used[set][lru] = accesses;
+    }
+};
+
+// Where the word at offset is, in the chunk or in the dag
+static const Octree *word(const Ocroot *root, uint64_t offset)
+{
+    if (offset & DAG_SHARED)
+        return &ocdag.store.tree[offset & ~(uint64_t)DAG_SHARED];
+    return &root->tree[offset];
+}
+
+// Same descent as traverse(), touching every word it reads
+static Tree traverse(vec3 p, const Ocroot *root, CacheModel *cache)
+{
+    Tree t = Tree(root->position, root->size, 0);
+    for ( ; ; )
+    {
+        cache->touch(word(root, t.offset));
+        if (root->node(t.offset).type() != BRANCH) return t;
+        float halfsize = t.size * 0.5f;
+        vec3 mid = t.bmin + halfsize;
+        bvec3 ge = greaterThanEqual(p, mid);
+        vec3 bmin = t.bmin + (vec3)ge * halfsize;
+        uint64_t i = Octree::branch(ge.x, ge.y, ge.z);
+        t = Tree(bmin, halfsize, root->child(t.offset, i));
+    }
+}
+
+// Steps through a chunk like treemarch, but only reports what the cache model saw
+static void treemarch(vec3 a, vec3 b, const Ocroot *root, CacheModel *cache)
+{
+    vec3 rmin = root->position;
+    vec3 rmax = root->position + root->size;
+    float t = 0.0;
+    for (int i = 0; i < 1000; ++i)
+    {
+        vec3 p = a + b * t;
+        if (!isInsideCube(p, rmin, rmax)) return;
+
+        Tree tree = traverse(p, root, cache);
+        uint32_t type = root->node(tree.offset).type();
+        if (type == LEAF)
+            return;
+        if (type == TWIG)
+            cache->touch(root->brick(root->node(tree.offset)));
+        t += cubeEscapeDistance(p, b, tree.bmin, tree.bmin + tree.size) + EPS;
+    }
+}
+
+static uint16_t material(const Ocroot *root, vec3 p)
+{
+    Tree t = traverse(p, root);
+    Octree node = root->node(t.offset);
+    if (node.type() == LEAF)
+        return (uint16_t)node.offset();
+    if (node.type() != TWIG)
+        return 0;
+
+    float leafsize = t.size / TWIG_SIZE;
+    ivec3 i = glm::clamp(ivec3((p - t.bmin) / leafsize), ivec3(0), ivec3(TWIG_SIZE - 1));
+    return root->brick(node)->get(Octwig::word(i.x, i.y, i.z));
+}
+
+struct RaySet
+{
+    static constexpr int COUNT = 4096;
+
+    vec3 origin[COUNT], direction[COUNT];
+
+    void init(const Ocroot *root, Random *random)
+    {
+        for (int i = 0; i < COUNT; ++i)
+        {
+            origin[i] = root->position + vec3(random->uniform(), random->uniform(), random->uniform()) * root->size;
+            direction[i] = random->direction();
+        }
+    }
+};
+
+static void benchGrow(World *world)
+{
+    Counter sw;
+    double bfstime = 0, dfstime = 0, bfsrays = 0, dfsrays = 0;
+    uint64_t bfsmisses = 0, dfsmisses = 0, accesses = 0, trees = 0, twigs = 0;
+    int mismatches = 0;
+
+    Random random;
+    CacheModel cache;
+    RaySet *rays = new RaySet;
+
+    for (int i = 0; i < world->volume; ++i)
+    {
+        const Ocroot *c = &world->chunk[i];
+        ivec3 q = world->index_float(c->position + 0.5f);
+        const BoundsPyramid *pyr = &world->heightmap[world->index(q.x, q.z)];
+
+        Ocroot bfs, dfs;
+        sw.start();
+        growbfs(&bfs, c->position, c->size, c->depth, pyr);
+        bfstime += sw.elapsed();
+
+        sw.start();
+        grow(&dfs, c->position, c->size, c->depth, pyr);
+        dfstime += sw.elapsed();
+
+        trees += dfs.trees;
+        twigs += dfs.twigs;
+        if (bfs.trees != dfs.trees || bfs.twigs != dfs.twigs)
+            ++mismatches;
+
+        rays->init(c, &random);
+        for (int r = 0; r < RaySet::COUNT; ++r)
+            if (material(&bfs, rays->origin[r]) != material(&dfs, rays->origin[r]))
+                ++mismatches;
+
+        float s;
+        sw.start();
+        for (int r = 0; r < RaySet::COUNT; ++r)
+            treemarch(rays->origin[r], rays->direction[r], &bfs, &s);
+        bfsrays += sw.elapsed();
+
+        sw.start();
+        for (int r = 0; r < RaySet::COUNT; ++r)
+            treemarch(rays->origin[r], rays->direction[r], &dfs, &s);
+        dfsrays += sw.elapsed();
+
+        cache.reset();
+        for (int r = 0; r < RaySet::COUNT; ++r)
+            treemarch(rays->origin[r], rays->direction[r], &bfs, &cache);
+        bfsmisses += cache.misses;
+        accesses += cache.accesses;
+
+        cache.reset();
+        for (int r = 0; r < RaySet::COUNT; ++r)
+            treemarch(rays->origin[r], rays->direction[r], &dfs, &cache);
+        dfsmisses += cache.misses;
+
+        bfs.release();
+        dfs.release();
+    }
+
+    delete rays;
+
+    double n = (double)world->volume * RaySet::COUNT;
+    printf("%d chunks, %llu trees, %llu twigs, %d mismatches\n", world->volume,
+        (unsigned long long)trees, (unsigned long long)twigs, mismatches);
+    printf("%-8s %14s %14s %14s\n", "builder", "build ms/chunk", "Mrays/s", "misses/access");
+    printf("%-8s %14.3f %14.3f %14.4f\n", "bfs", bfstime * 1000 / world->volume, n / bfsrays / 1e6, (double)bfsmisses / accesses);
+    printf("%-8s %14.3f %14.3f %14.4f\n", "dfs", dfstime * 1000 / world->volume, n / dfsrays / 1e6, (double)dfsmisses / accesses);
+}
+
+// Memory of the generated chunks with palette twigs against the 64 x 16-bit twigs they replaced
+static void benchTwig(World *world)
+{
+    const size_t OLD_TWIG_SIZE = TWIG_WORDS * sizeof(uint16_t);
+
+    uint64_t trees = 0, twigs = 0, solid = 0;
+    uint64_t materials[TWIG_PALETTE + 1] = { 0 };
+    for (int i = 0; i < world->volume; ++i)
+    {
+        // Counted as if every chunk had its own copy of the dag nodes it uses
+        Ocroot flat;
+        const Ocroot *c = &flat;
+        if (!sparsify(&world->chunk[i], &flat))
+            die("Chunk %d is too large for sparse branches\n", i);
+        trees += c->trees;
+        twigs += c->twigs;
+        for (uint64_t j = 0; j < c->twigs; ++j)
+        {
+            const Octwig *w = &c->twig[j];
+            int n = 0;
+            while (n < TWIG_PALETTE && w->palette[n])
+                ++n;
+            ++materials[n];
+            for (unsigned k = 0; k < TWIG_WORDS; ++k)
+                solid += w->solid(k);
+        }
+        flat.release();
+    }
+
+    double n = (double)world->volume;
+    double treebytes = (double)trees * sizeof(Octree);
+    double oldbytes = treebytes + (double)twigs * OLD_TWIG_SIZE;
+    double newbytes = treebytes + (double)twigs * sizeof(Octwig);
+
+    printf("%d chunks, %llu trees, %llu twigs, %.1f%% of twig voxels solid\n", world->volume,
+        (unsigned long long)trees, (unsigned long long)twigs, twigs ? 100.0 * solid / (twigs * TWIG_WORDS) : 0.0);
+    printf("twigs by material count:");
+    for (int m = 0; m <= TWIG_PALETTE; ++m)
+        printf(" %d: %llu", m, (unsigned long long)materials[m]);
+    printf("\n");
+    printf("%-8s %12s %14s %14s\n", "format", "twig bytes", "KiB/chunk", "twig share");
+    printf("%-8s %12zu %14.1f %13.1f%%\n", "old", OLD_TWIG_SIZE, oldbytes / n / 1024, 100.0 * (oldbytes - treebytes) / oldbytes);
+    printf("%-8s %12zu %14.1f %13.1f%%\n", "palette", sizeof(Octwig), newbytes / n / 1024, 100.0 * (newbytes - treebytes) / newbytes);
+    printf("palette chunks are %.1f%% of the old size\n", 100.0 * newbytes / oldbytes);
+}
+
+// Build time, memory and rays/s at the brick size of this build, compare builds with
+// different TWIG_DEPTH against each other
+static void benchBricks(World *world)
+{
+    Counter sw;
+    double buildtime = 0, raytime = 0, bytes = 0;
+    uint64_t trees = 0, twigs = 0, hits = 0;
+
+    Random random;
+    RaySet *rays = new RaySet;
+
+    for (int i = 0; i < world->volume; ++i)
+    {
+        const Ocroot *c = &world->chunk[i];
+        ivec3 q = world->index_float(c->position + 0.5f);
+        const BoundsPyramid *pyr = &world->heightmap[world->index(q.x, q.z)];
+
+        Ocroot root;
+        sw.start();
+        grow(&root, c->position, c->size, c->depth, pyr);
+        buildtime += sw.elapsed();
+
+        trees += root.trees;
+        twigs += root.twigs;
+        bytes += (double)root.trees * sizeof(Octree) + (double)root.twigs * sizeof(Octwig);
+
+        rays->init(c, &random);
+        float s;
+        sw.start();
+        for (int r = 0; r < RaySet::COUNT; ++r)
+            hits += treemarch(rays->origin[r], rays->direction[r], &root, &s);
+        raytime += sw.elapsed();
+
+        root.release();
+    }
+
+    delete rays;
+
+    double n = (double)world->volume;
+    printf("%d chunks, %llu trees, %llu twigs, %llu hits\n", world->volume,
+        (unsigned long long)trees, (unsigned long long)twigs, (unsigned long long)hits);
+    char brick[16];
+    snprintf(brick, sizeof(brick), "%d^3", TWIG_SIZE);
+    printf("%-8s %12s %14s %14s %14s\n", "brick", "twig bytes", "build ms/chunk", "KiB/chunk", "Mrays/s");
+    printf("%-8s %12zu %14.3f %14.1f %14.3f\n", brick, sizeof(Octwig), 
+        buildtime * 1000 / n, bytes / n / 1024, n * RaySet::COUNT / raytime / 1e6);
+}
+
+// Memory and rays/s of the world's chunks with dense and with sparse branches
+static void benchSparse(World *world)
+{
+    Counter sw;
+    double densetime = 0, sparsetime = 0, densebytes = 0, sparsebytes = 0;
+    uint64_t densetrees = 0, sparsetrees = 0;
+    int mismatches = 0;
+
+    Random random;
+    RaySet *rays = new RaySet;
+
+    for (int i = 0; i < world->volume; ++i)
+    {
+        Ocroot dense, sparse;
+        densify(&world->chunk[i], &dense);
+        if (!sparsify(&dense, &sparse))
+            die("Chunk %d is too large for sparse branches\n", i);
+
+        densetrees += dense.trees;
+        sparsetrees += sparse.trees;
+        densebytes += (double)dense.trees * sizeof(Octree) + (double)dense.twigs * sizeof(Octwig);
+        sparsebytes += (double)sparse.trees * sizeof(Octree) + (double)sparse.twigs * sizeof(Octwig);
+
+        rays->init(&dense, &random);
+        for (int r = 0; r < RaySet::COUNT; ++r)
+            if (material(&dense, rays->origin[r]) != material(&sparse, rays->origin[r]))
+                ++mismatches;
+
+        float s;
+        sw.start();
+        for (int r = 0; r < RaySet::COUNT; ++r)
+            treemarch(rays->origin[r], rays->direction[r], &dense, &s);
+        densetime += sw.elapsed();
+
+        sw.start();
+        for (int r = 0; r < RaySet::COUNT; ++r)
+            treemarch(rays->origin[r], rays->direction[r], &sparse, &s);
+        sparsetime += sw.elapsed();
+
+        dense.release();
+        sparse.release();
+    }
+
+    delete rays;
+
+    double n = (double)world->volume;
+    printf("%d chunks, %d mismatches\n", world->volume, mismatches);
+    printf("%-8s %14s %14s %14s\n", "branches", "trees/chunk", "KiB/chunk", "Mrays/s");
+    printf("%-8s %14.0f %14.1f %14.3f\n", "dense", densetrees / n, densebytes / n / 1024, n * RaySet::COUNT / densetime / 1e6);
+    printf("%-8s %14.0f %14.1f %14.3f\n", "sparse", sparsetrees / n, sparsebytes / n / 1024, n * RaySet::COUNT / sparsetime / 1e6);
+}
+
+// Memory and rays/s of the world's chunks interned into the dag against their own sparse copies
+static void benchDag(World *world)
+{
+    Counter sw;
+    double sparsetime = 0, dagtime = 0, sparsebytes = 0, localbytes = 0;
+    int mismatches = 0;
+
+    Random random;
+    RaySet *rays = new RaySet;
+
+    for (int i = 0; i < world->volume; ++i)
+    {
+        const Ocroot *c = &world->chunk[i];
+        Ocroot sparse;
+        if (!sparsify(c, &sparse))
+            die("Chunk %d is too large for sparse branches\n", i);
+
+        sparsebytes += (double)sparse.trees * sizeof(Octree) + (double)sparse.twigs * sizeof(Octwig);
+        localbytes += (double)c->trees * sizeof(Octree) + (double)c->twigs * sizeof(Octwig);
+
+        rays->init(c, &random);
+        for (int r = 0; r < RaySet::COUNT; ++r)
+            if (material(c, rays->origin[r]) != material(&sparse, rays->origin[r]))
+                ++mismatches;
+
+        float s;
+        sw.start();
+        for (int r = 0; r < RaySet::COUNT; ++r)
+            treemarch(rays->origin[r], rays->direction[r], &sparse, &s);
+        sparsetime += sw.elapsed();
+
+        sw.start();
+        for (int r = 0; r < RaySet::COUNT; ++r)
+            treemarch(rays->origin[r], rays->direction[r], c, &s);
+        dagtime += sw.elapsed();
+
+        sparse.release();
+    }
+
+    delete rays;
+
+    const Ocroot *store = &ocdag.store;
+    double dagbytes = localbytes + (double)store->trees * sizeof(Octree) + (double)store->twigs * sizeof(Octwig);
+    double n = (double)world->volume;
+    printf("%d chunks, %d mismatches, dag has %zu branches and %zu twigs\n", world->volume, mismatches,
+        ocdag.groups.size(), ocdag.twigs.size());
+    printf("%-8s %14s %14s\n", "storage", "KiB/chunk", "Mrays/s");
+    printf("%-8s %14.1f %14.3f\n", "sparse", sparsebytes / n / 1024, n * RaySet::COUNT / sparsetime / 1e6);
+    printf("%-8s %14.1f %14.3f\n", "dag", dagbytes / n / 1024, n * RaySet::COUNT / dagtime / 1e6);
+    printf("the dag takes %.1f%% of the sparse size\n", 100.0 * dagbytes / sparsebytes);
+}
+
+// Build time and memory of the world's heightmaps, and the time spent reducing them into levels
+static void benchPyramid(World *world)
+{
+    const int REPEAT = 8;
+    Counter sw;
+    double buildtime = 0, reducetime = 0;
+    size_t bytes = 0;
+    int count = 0;
+
+    for (int i = 0; i < world->plane; ++i)
+    {
+        const BoundsPyramid *h = &world->heightmap[i];
+        for (int r = 0; r < REPEAT; ++r)
+        {
+            BoundsPyramid pyr = BoundsPyramid();
+            sw.start();
+            pyr.init(h->size, 1.0f, 1.0f / h->size, (float)(i * h->size), 0.0f, (float)(r * h->size));
+            buildtime += sw.elapsed();
+
+            // Rows handed over in order rebuild every level above the base
+            sw.start();
+            for (size_t z = 0; z < pyr.size / 2; ++z)
+                pyr.computeBoundsAbove(pyr.levels, z);
+            reducetime += sw.elapsed();
+
+            bytes = pyr.bytes();
+            pyr.deinit();
+            ++count;
+        }
+    }
+
+    printf("%d pyramids of %zux%zu, %.1f KiB each\n", count, world->heightmap[0].size, world->heightmap[0].size, bytes / 1024.0);
+    printf("%-8s %14s %14s\n", "", "build ms", "reduce ms");
+    printf("%-8s %14.3f %14.3f\n", "pyramid", buildtime * 1000 / count, reducetime * 1000 / count);
+}
+
+// Heightmap texels per second of glm's simplex noise against the batched one, alone and in
+// whole pyramids built on one thread or split into bands of rows over the world's jobs
+static void benchNoise(World *world)
+{
+    const int REPEAT = 4;
+    const size_t size = world->heightmap[0].size;
+    const float period = 1.0f / size;
+    Counter sw;
+    double glmtime = 0, batchtime = 0, serialtime = 0, bandtime = 0, texels = 0;
+    float deviation = 0;
+    std::vector<float> px(size), pz(size), expect(size), noise(size);
+
+    for (int i = 0; i < world->plane; ++i)
+    {
+        for (int r = 0; r < REPEAT; ++r)
+        {
+            float xshift = (float)(i * size), zshift = (float)(r * size);
+            for (size_t z = 0; z < size; ++z)
+            {
+                for (size_t x = 0; x < size; ++x)
+                {
+                    px[x] = ((float)x + xshift) * period;
+                    pz[x] = ((float)z + zshift) * period;
+                }
+
+                sw.start();
+                for (size_t x = 0; x < size; ++x)
+                    expect[x] = glm::simplex(glm::vec2(px[x], pz[x]));
+                glmtime += sw.elapsed();
+
+                sw.start();
+                simplex(px.data(), pz.data(), noise.data(), size);
+                batchtime += sw.elapsed();
+
+                for (size_t x = 0; x < size; ++x)
+                    deviation = glm::max(deviation, glm::abs(noise[x] - expect[x]));
+            }
+
+            BoundsPyramid serial = BoundsPyramid(), banded = BoundsPyramid();
+            sw.start();
+            serial.init(size, 1.0f, period, xshift, 0.0f, zshift);
+            serialtime += sw.elapsed();
+
+            sw.start();
+            banded.init(size, 1.0f, period, xshift, 0.0f, zshift, &world->jobs);
+            bandtime += sw.elapsed();
+
+            if (memcmp(serial.basequad, banded.basequad, serial.bytes()))
+                die("Pyramids built by bands differ from the ones built on one thread\n");
+            serial.deinit();
+            banded.deinit();
+            texels += (double)size * size;
+        }
+    }
+
+    printf("%.0f texels, largest deviation from glm %g (tolerance %g)\n", texels, deviation, NOISE_TOLERANCE);
+    printf("%-10s %14s\n", "", "Mtexels/s");
+    printf("%-10s %14.3f\n", "glm", texels / glmtime / 1e6);
+    printf("%-10s %14.3f\n", "batched", texels / batchtime / 1e6);
+    printf("%-10s %14.3f\n", "pyramid", texels / serialtime / 1e6);
+    printf("%-10s %14.3f\n", "banded", texels / bandtime / 1e6);
+}
+
+// Cave terrain grown with density bounds against sampling every voxel: build time, samples per
+// voxel and whether both agree on which voxels are solid
+static void benchDensity(World *world)
+{
+    const int CHUNKS = 8;
+    Counter sw;
+    double prunedtime = 0, brutetime = 0, voxels = 0;
+    uint64_t prunedsamples = 0, brutesamples = 0, trees = 0, twigs = 0;
+    int mismatches = 0, count = 0;
+
+    Random random;
+    RaySet *rays = new RaySet;
+
+    for (int i = 0; i < world->volume && count < CHUNKS; ++i, ++count)
+    {
+        const Ocroot *c = &world->chunk[i];
+        ivec3 q = world->index_float(c->position + 0.5f);
+        const BoundsPyramid *pyr = &world->heightmap[world->index(q.x, q.z)];
+        Density f = caves(pyr, c->position, c->size);
+        Density g = bruteforce(f);
+
+        Ocroot pruned, brute;
+        sw.start();
+        prunedsamples += growdensity(&pruned, c->position, c->size, c->depth, &f);
+        prunedtime += sw.elapsed();
+
+        sw.start();
+        brutesamples += growdensity(&brute, c->position, c->size, c->depth, &g);
+        brutetime += sw.elapsed();
+
+        voxels += pow(8.0, c->depth);
+        trees += pruned.trees;
+        twigs += pruned.twigs;
+
+        rays->init(c, &random);
+        for (int r = 0; r < RaySet::COUNT; ++r)
+            if (!material(&pruned, rays->origin[r]) != !material(&brute, rays->origin[r]))
+                ++mismatches;
+
+        pruned.release();
+        brute.release();
+    }
+
+    delete rays;
+
+    printf("%d chunks, %llu trees, %llu twigs, %d mismatches\n", count,
+        (unsigned long long)trees, (unsigned long long)twigs, mismatches);
+    printf("%-8s %14s %14s\n", "", "build ms/chunk", "samples/voxel");
+    printf("%-8s %14.3f %14.5f\n", "bounded", prunedtime * 1000 / count, prunedsamples / voxels);
+    printf("%-8s %14.3f %14.5f\n", "brute", brutetime * 1000 / count, brutesamples / voxels);
+}
+
+// Memory, rays/s and words read per ray of each level of detail of the world's chunks
+static void benchLod(World *world)
+{
+    Counter sw;
+    double bytes[LOD_LEVELS] = {}, time[LOD_LEVELS] = {};
+    uint64_t accesses[LOD_LEVELS] = {}, agree[LOD_LEVELS] = {}, rayc[LOD_LEVELS] = {};
+
+    Random random;
+    CacheModel cache;
+    RaySet *rays = new RaySet;
+
+    for (int i = 0; i < world->volume; ++i)
+    {
+        const ChunkLod *lod = &world->lod[i];
+        Ocroot full;
+        if (!sparsify(&world->chunk[i], &full))
+            die("Chunk %d is too large for sparse branches\n", i);
+        rays->init(&full, &random);
+
+        for (uint32_t k = 0; k <= lod->levels; ++k)
+        {
+            const Ocroot *r = k ? &lod->coarse[k - 1] : &full;
+            bytes[k] += (double)r->trees * sizeof(Octree) + (double)r->twigs * sizeof(Octwig);
+            rayc[k] += RaySet::COUNT;
+
+            for (int j = 0; j < RaySet::COUNT; ++j)
+                if ((material(&full, rays->origin[j]) != 0) == (material(r, rays->origin[j]) != 0))
+                    ++agree[k];
+
+            cache.reset();
+            for (int j = 0; j < RaySet::COUNT; ++j)
+                treemarch(rays->origin[j], rays->direction[j], r, &cache);
+            accesses[k] += cache.accesses;
+
+            float s;
+            sw.start();
+            for (int j = 0; j < RaySet::COUNT; ++j)
+                treemarch(rays->origin[j], rays->direction[j], r, &s);
+            time[k] += sw.elapsed();
+        }
+
+        full.release();
+    }
+
+    delete rays;
+
+    printf("%d chunks, sparse copies\n", world->volume);
+    printf("%-6s %8s %12s %12s %14s %12s\n", "level", "chunks", "KiB/chunk", "Mrays/s", "words/ray", "occupancy");
+    for (int k = 0; k < LOD_LEVELS; ++k)
+    {
+        if (!rayc[k])
+            continue;
+        double n = (double)rayc[k] / RaySet::COUNT;
+        printf("%-6d %8.0f %12.1f %12.3f %14.1f %11.1f%%\n", k, n, bytes[k] / n / 1024, rayc[k] / time[k] / 1e6,
+            (double)accesses[k] / rayc[k], 100.0 * agree[k] / rayc[k]);
+    }
+}
+
+// Reads every word of root, as interning or drawing it does
+static uint32_t touch(const Ocroot *root)
+{
+    uint32_t h = 0;
+    for (uint64_t i = 0; i < root->trees; ++i)
+        h ^= root->tree[i].value;
+    const uint32_t *w = (const uint32_t *)root->twig;
+    for (uint64_t i = 0; i < root->twigs * sizeof(Octwig) / sizeof(uint32_t); ++i)
+        h ^= w[i];
+    return h;
+}
+
+// Chunks paged in from region files against generating them again, both with their coarse
+// copies, from a store of plain arrays and from one compressing them. Cold is the first load
+// after opening a store, which maps the files and faults their pages in, warm loads them again
+// through the same views. The files are still in the OS cache, so cold does not wait for the
+// disk.
+static void benchRegion(World *world)
+{
+    const char *DIRECTORY[2] = { "bench.region", "bench.region.z" };
+    Counter sw;
+    double growtime = 0, savetime[2] = {}, coldtime[2] = {}, warmtime[2] = {};
+    uint64_t bytes = 0, filebytes[2] = {};
+    int mismatches = 0;
+
+    ChunkStore store[2];
+    for (int z = 0; z < 2; ++z)
+    {
+        std::filesystem::remove_all(DIRECTORY[z]);
+        store[z].init(DIRECTORY[z], world->chunksize, world->chunk[0].depth, z);
+    }
+
+    std::vector<uint32_t> sums(world->volume);
+    for (int i = 0; i < world->volume; ++i)
+    {
+        const Ocroot *c = &world->chunk[i];
+        ivec3 q = world->index_float(c->position + 0.5f);
+
+        Ocroot root;
+        ChunkLod lod;
+        sw.start();
+        world->g_root(&root, &lod, q, &world->heightmap[world->index(q.x, q.z)]);
+        growtime += sw.elapsed();
+
+        const Ocroot *roots[LOD_LEVELS] = { &root };
+        for (uint32_t k = 0; k < lod.levels; ++k)
+            roots[k + 1] = &lod.coarse[k];
+        sums[i] = 0;
+        for (uint32_t k = 0; k <= lod.levels; ++k)
+            sums[i] ^= touch(roots[k]);
+
+        for (int z = 0; z < 2; ++z)
+        {
+            sw.start();
+            store[z].save(q, roots, lod.levels + 1);
+            savetime[z] += sw.elapsed();
+        }
+        for (uint32_t k = 0; k <= lod.levels; ++k)
+            bytes += roots[k]->trees * sizeof(Octree) + roots[k]->twigs * sizeof(Octwig);
+
+        root.release();
+        lod.release();
+    }
+
+    for (int z = 0; z < 2; ++z)
+    {
+        for (const RegionFile *f : store[z].regions)
+            filebytes[z] += f->header.end - sizeof(RegionHeader);
+        store[z].deinit();
+        store[z].init(DIRECTORY[z], world->chunksize, world->chunk[0].depth, z);
+    }
+
+    for (int z = 0; z < 2; ++z)
+    {
+        for (int pass = 0; pass < 2; ++pass)
+        {
+            for (int i = 0; i < world->volume; ++i)
+            {
+                ivec3 q = world->index_float(world->chunk[i].position + 0.5f);
+                Ocroot loaded[LOD_LEVELS];
+                Ocroot *roots[LOD_LEVELS];
+                for (int k = 0; k < LOD_LEVELS; ++k)
+                    roots[k] = &loaded[k];
+
+                sw.start();
+                uint32_t n = store[z].load(q, roots, LOD_LEVELS);
+                uint32_t sum = 0;
+                for (uint32_t k = 0; k < n; ++k)
+                    sum ^= touch(roots[k]);
+                (pass ? warmtime : coldtime)[z] += sw.elapsed();
+
+                if (!n || sum != sums[i])
+                    ++mismatches;
+                for (uint32_t k = 0; k < n; ++k)
+                    roots[k]->abandon();
+            }
+        }
+        store[z].deinit();
+        std::filesystem::remove_all(DIRECTORY[z]);
+    }
+
+    printf("%d chunks, %.1f KiB/chunk with coarse copies, grown in %.3f ms/chunk, %d mismatches\n", world->volume,
+        bytes / 1024.0 / world->volume, growtime * 1000 / world->volume, mismatches);
+    printf("%-8s %14s %14s %14s %14s\n", "", "file KiB/chunk", "save ms/chunk", "cold ms/chunk", "warm ms/chunk");
+    for (int z = 0; z < 2; ++z)
+        printf("%-8s %14.1f %14.3f %14.3f %14.3f\n", z ? "encoded" : "plain", filebytes[z] / 1024.0 / world->volume,
+            savetime[z] * 1000 / world->volume, coldtime[z] * 1000 / world->volume, warmtime[z] * 1000 / world->volume);
+}
+
+// Compression of the chunks and their coarse copies by the codec of Codec.h, against their
+// sparse copies, which is what a store of plain arrays writes. Decode throughput is counted
+// in bytes of those copies made per second.
+static void benchCodec(World *world)
+{
+    Counter sw;
+    double encodetime[LOD_LEVELS] = {}, decodetime[LOD_LEVELS] = {};
+    uint64_t plain[LOD_LEVELS] = {}, encoded[LOD_LEVELS] = {}, count[LOD_LEVELS] = {};
+    int mismatches = 0;
+
+    std::vector<uint8_t> bytes;
+    for (int i = 0; i < world->volume; ++i)
+    {
+        const Ocroot *roots[LOD_LEVELS] = { &world->chunk[i] };
+        for (uint32_t k = 0; k < world->lod[i].levels; ++k)
+            roots[k + 1] = &world->lod[i].coarse[k];
+
+        for (uint32_t k = 0; k <= world->lod[i].levels; ++k)
+        {
+            Ocroot copy, decoded;
+            if (!sparsify(roots[k], &copy))
+                densify(roots[k], &copy);
+
+            bytes.clear();
+            sw.start();
+            encode(roots[k], &bytes);
+            encodetime[k] += sw.elapsed();
+
+            decoded.position = copy.position;
+            decoded.size = copy.size;
+            decoded.depth = copy.depth;
+            sw.start();
+            bool ok = decode(bytes.data(), bytes.size(), &decoded);
+            decodetime[k] += sw.elapsed();
+
+            if (!ok || decoded.sparse != copy.sparse || decoded.trees != copy.trees || decoded.twigs != copy.twigs
+                || memcmp(decoded.tree, copy.tree, copy.trees * sizeof(Octree))
+                || memcmp(decoded.twig, copy.twig, copy.twigs * sizeof(Octwig)))
+                ++mismatches;
+
+            plain[k] += copy.trees * sizeof(Octree) + copy.twigs * sizeof(Octwig);
+            encoded[k] += bytes.size();
+            ++count[k];
+            copy.release();
+            if (ok)
+                decoded.release();
+        }
+    }
+
+    printf("%d chunks, %d mismatches\n", world->volume, mismatches);
+    printf("%-6s %8s %12s %12s %8s %12s %12s\n", "level", "chunks", "KiB/chunk", "encoded", "ratio", "encode MB/s", "decode MB/s");
+    for (int k = 0; k < LOD_LEVELS; ++k)
+    {
+        if (!count[k])
+            continue;
+        printf("%-6d %8llu %12.1f %12.1f %8.2f %12.1f %12.1f\n", k, (unsigned long long)count[k],
+            plain[k] / 1024.0 / count[k], encoded[k] / 1024.0 / count[k], (double)plain[k] / encoded[k],
+            plain[k] / encodetime[k] / 1e6, plain[k] / decodetime[k] / 1e6);
+    }
+}
+
+// What keeping an edit costs: appending it to the journal, synced a batch at a time, against
+// saving the whole chunk after it. Replay is the time to apply it again on load.
+static void benchJournal(World *world)
+{
+    const char *DIRECTORY = "bench.journal";
+    const int CHUNKS = 8, EDITS = 32, BATCH = 16;
+    Counter sw;
+    double journaltime = 0, snapshottime = 0, replaytime = 0;
+    uint64_t snapshotbytes = 0;
+    int count = 0;
+
+    std::filesystem::remove_all(DIRECTORY);
+    ChunkStore store;
+    store.init(DIRECTORY, world->chunksize, world->chunk[0].depth);
+    EditJournal journal;
+    std::vector<JournalEdit> journaled;
+    journal.init((std::string(DIRECTORY) + "/journal").c_str(), &journaled);
+
+    Random random;
+    for (int i = 0; i < world->volume && i < CHUNKS; ++i)
+    {
+        // Edited copies, the world is left as it is for the other benchmarks
+        Ocroot edited, replayed;
+        if (!sparsify(&world->chunk[i], &edited) || !sparsify(&world->chunk[i], &replayed))
+            die("Chunk %d is too large for sparse branches\n", i);
+        ivec3 q = world->index_float(edited.position + 0.5f);
+
+        std::vector<JournalEdit> edits;
+        for (int k = 0; k < EDITS; ++k, ++count)
+        {
+            vec3 cmin = edited.position + vec3(random.uniform(), random.uniform(), random.uniform()) * edited.size * 0.9f;
+            vec3 cmax = cmin + 1.0f + vec3(random.uniform(), random.uniform(), random.uniform()) * 8.0f;
+            JournalEdit e = { q, cmin, cmax, (uint16_t)(1 + k % 8), (uint16_t)(k % 3), 0 };
+            edits.push_back(e);
+
+            Ocdelta tree, twig;
+            apply(&edited, &e, &tree, &twig);
+
+            sw.start();
+            journal.append(e);
+            if (count % BATCH == BATCH - 1)
+                journal.sync(0);
+            journaltime += sw.elapsed();
+
+            const Ocroot *roots[] = { &edited };
+            sw.start();
+            store.save(q, roots, 1);
+            snapshottime += sw.elapsed();
+        }
+
+        sw.start();
+        for (const JournalEdit& e : edits)
+        {
+            Ocdelta tree, twig;
+            apply(&replayed, &e, &tree, &twig);
+        }
+        replaytime += sw.elapsed();
+
+        edited.release();
+        replayed.release();
+    }
+
+    for (const RegionFile *f : store.regions)
+        snapshotbytes += f->header.end - sizeof(RegionHeader);
+    journal.deinit();
+    store.deinit();
+    std::filesystem::remove_all(DIRECTORY);
+
+    printf("%d edits of %d chunks, synced every %d\n", count, CHUNKS, BATCH);
+    printf("%-10s %14s %14s\n", "", "us/edit", "bytes/edit");
+    printf("%-10s %14.3f %14zu\n", "journal", journaltime * 1e6 / count, sizeof(JournalEdit));
+    printf("%-10s %14.3f %14.0f\n", "snapshot", snapshottime * 1e6 / count, (double)snapshotbytes / count);
+    printf("%-10s %14.3f\n", "replay", replaytime * 1e6 / count);
+}
+
+// A crash between saving a chunk and syncing the journal, checked rather than timed. A build
+// over a destroyed box is saved, with only the destroy synced to the journal beforehand
+// unless World::save syncs it. The crash keeps what is on the disk and loses what is still
+// buffered, so it is modelled by a copy of the directory, which is then recovered like a world
+// starting up. Replaying only the destroy on the saved chunk would leave the box empty.
+static void benchRecovery(World *world)
+{
+    const char *DIRECTORY = "bench.recovery", *CRASHED = "bench.recovery.crashed";
+    std::filesystem::remove_all(DIRECTORY);
+    std::filesystem::remove_all(CRASHED);
+
+    // The world saves and journals into the directory for the duration
+    ChunkStore store;
+    store.init(DIRECTORY, world->chunksize, world->chunk[0].depth);
+    EditJournal journal;
+    std::vector<JournalEdit> journaled;
+    journal.init((std::string(DIRECTORY) + "/journal").c_str(), &journaled);
+    world->store = &store;
+    world->journal = &journal;
+
+    Ocroot edited;
+    if (!sparsify(&world->chunk[0], &edited))
+        die("Chunk 0 is too large for sparse branches\n");
+    ivec3 q = world->index_float(edited.position + 0.5f);
+    vec3 cmin = edited.position + edited.size * 0.25f, cmax = cmin + 8.0f;
+    JournalEdit edits[] = {
+        { q, cmin, cmax, 0, EDIT_DESTROY, 0 },
+        { q, cmin, cmax, 3, EDIT_BUILD, 0 },
+    };
+    for (const JournalEdit& e : edits)
+    {
+        Ocdelta tree, twig;
+        apply(&edited, &e, &tree, &twig);
+        journal.append(e);
+        world->edits[q].push_back(e);
+        if (e.op == EDIT_DESTROY)
+            journal.sync(0);
+    }
+    edited.modified = true;
+    ChunkLod lod = {};
+    world->save(&edited, &lod, true);
+    std::filesystem::copy(DIRECTORY, CRASHED);
+
+    world->store = nullptr;
+    world->journal = nullptr;
+    world->edits.clear();
+    journal.deinit();
+    store.deinit();
+
+    ChunkStore crashed;
+    crashed.init(CRASHED, world->chunksize, world->chunk[0].depth);
+    EditJournal recovered;
+    recovered.init((std::string(CRASHED) + "/journal").c_str(), &journaled);
+    Ocroot loaded;
+    Ocroot *roots[] = { &loaded };
+    if (!crashed.load(q, roots, 1))
+        die("The saved chunk is not in the store\n");
+    for (const JournalEdit& e : journaled)
+    {
+        Ocdelta tree, twig;
+        if (e.chunk == q)
+            apply(&loaded, &e, &tree, &twig);
+    }
+
+    int voxels = 0, wrong = 0;
+    for (float z = cmin.z + 0.5f; z < cmax.z; ++z)
+    {
+        for (float y = cmin.y + 0.5f; y < cmax.y; ++y)
+        {
+            for (float x = cmin.x + 0.5f; x < cmax.x; ++x)
+            {
+                uint16_t a = 0, b = 0;
+                vec3 bmin;
+                float size;
+                bool solid = voxelat(vec3(x, y, z), &edited, &a, &bmin, &size);
+                if (solid != voxelat(vec3(x, y, z), &loaded, &b, &bmin, &size) || a != b)
+                    ++wrong;
+                ++voxels;
+            }
+        }
+    }
+
+    edited.release();
+    loaded.release();
+    recovered.deinit();
+    crashed.deinit();
+    std::filesystem::remove_all(DIRECTORY);
+    std::filesystem::remove_all(CRASHED);
+
+    printf("%zu of %zu edits journaled at the crash, %d of %d voxels recovered wrong\n",
+           journaled.size(), sizeof(edits) / sizeof(edits[0]), wrong, voxels);
+    if (wrong)
+        die("The chunk was saved with edits its journal did not have\n");
+}
+
+// Edits journaled by this thread while workers save chunks with journaled edits, the way
+// streaming workers do, checked rather than timed. Every so often the journal is checkpointed
+// on this thread. A save that found edits of its chunk must have synced every edit journaled
+// before it, which it did not if a worker syncing the journal raced with an append.
+static void benchJournalRace(World *world)
+{
+    const char *DIRECTORY = "bench.journalrace";
+    const int WORKERS = 3, EDITS = 4096, CHECKPOINT = 512;
+    std::filesystem::remove_all(DIRECTORY);
+
+    ChunkStore store;
+    store.init(DIRECTORY, world->chunksize, world->chunk[0].depth);
+    EditJournal journal;
+    std::vector<JournalEdit> journaled;
+    std::string path = std::string(DIRECTORY) + "/journal";
+    journal.init(path.c_str(), &journaled);
+    world->store = &store;
+    world->journal = &journal;
+
+    // Edits in the journal file, and how many checkpoints started and ended, twice each
+    std::atomic<uint64_t> expected(0), rewrites(0), saves(0), checked(0), lost(0);
+    std::atomic<bool> done(false);
+    std::vector<std::thread> workers;
+    for (int w = 0; w < WORKERS; ++w)
+    {
+        workers.emplace_back([&, w]() {
+            Ocroot copy;
+            if (!sparsify(&world->chunk[w], &copy))
+                die("Chunk %d is too large for sparse branches\n", w);
+            ivec3 q = world->index_float(copy.position + 0.5f);
+            ChunkLod lod = {};
+            while (!done)
+            {
+                // Gives the edits time to come in between saves
+                std::this_thread::sleep_for(std::chrono::microseconds(500));
+                uint64_t n = expected, r = rewrites;
+                bool had;
+                {
+                    std::unique_lock<std::mutex> lock(world->editmutex);
+                    had = world->edits.count(q) > 0;
+                }
+                copy.modified = true;
+                world->save(&copy, &lod, true);
+                ++saves;
+                if (!had || r % 2 || rewrites != r)
+                    continue;
+                ++checked;
+                if (std::filesystem::file_size(path) < n * sizeof(JournalEdit))
+                    ++lost;
+            }
+            copy.release();
+        });
+    }
+
+    Random random;
+    for (int k = 0; k < EDITS; ++k)
+    {
+        const Ocroot *c = &world->chunk[k % (WORKERS + 1)];
+        ivec3 q = world->index_float(c->position + 0.5f);
+        vec3 cmin = c->position + vec3(random.uniform(), random.uniform(), random.uniform()) * c->size * 0.9f;
+        JournalEdit e = { q, cmin, cmin + 4.0f, (uint16_t)(1 + k % 8), EDIT_BUILD, 0 };
+        journal.append(e);
+        ++expected;
+        {
+            std::unique_lock<std::mutex> lock(world->editmutex);
+            world->edits[q].push_back(e);
+        }
+        journal.sync(1.0);
+        // Edits come a few at a time, like those of a frame
+        if (k % 8 == 7)
+            std::this_thread::sleep_for(std::chrono::microseconds(200));
+        if (k % CHECKPOINT == CHECKPOINT - 1)
+        {
+            ++rewrites;
+            world->checkpoint();
+            expected = journal.bytes / sizeof(JournalEdit);
+            ++rewrites;
+        }
+    }
+    done = true;
+    for (std::thread& t : workers)
+        t.join();
+
+    world->store = nullptr;
+    world->journal = nullptr;
+    world->edits.clear();
+    journal.deinit();
+    store.deinit();
+    std::filesystem::remove_all(DIRECTORY);
+
+    printf("%d edits, %llu saves by %d workers, %llu checked, %llu ahead of their journal\n", EDITS,
+        (unsigned long long)saves.load(), WORKERS, (unsigned long long)checked.load(), (unsigned long long)lost.load());
+    if (lost)
+        die("Chunks were saved with edits the journal did not have on the disk\n");
+}
+
+// The front to back walk of treecast and chunkcast against the descent from the root at every
+// step of treemarch and chunkmarch, over rays within each chunk and rays across the world.
+// Hits agree if both miss or both hit within HIT_TOLERANCE of each other, the marches step
+// EPS past every boundary and overshoot by about that much.
+static void benchCast(World *world)
+{
+    const float HIT_TOLERANCE = 1.0f / 256.0f;
+    Counter sw;
+    double marchtime[2] = {}, casttime[2] = {};
+    uint64_t marchhits[2] = {}, casthits[2] = {}, agree[2] = {}, rays[2] = {};
+
+    Random random;
+    RaySet *set = new RaySet;
+    std::vector<float> marched(RaySet::COUNT), cast(RaySet::COUNT);
+    std::vector<bool> marchhit(RaySet::COUNT), casthit(RaySet::COUNT);
+
+    for (int i = 0; i < world->volume; ++i)
+    {
+        const Ocroot *c = &world->chunk[i];
+        set->init(c, &random);
+
+        sw.start();
+        for (int r = 0; r < RaySet::COUNT; ++r)
+        {
+            float s = 0;
+            marchhit[r] = treemarch(set->origin[r], set->direction[r], c, &s);
+            marched[r] = s;
+        }
+        marchtime[0] += sw.elapsed();
+
+        sw.start();
+        for (int r = 0; r < RaySet::COUNT; ++r)
+        {
+            float s = 0;
+            casthit[r] = treecast(set->origin[r], set->direction[r], c, &s);
+            cast[r] = s;
+        }
+        casttime[0] += sw.elapsed();
+
+        for (int r = 0; r < RaySet::COUNT; ++r)
+        {
+            marchhits[0] += marchhit[r];
+            casthits[0] += casthit[r];
+            agree[0] += casthit[r] == marchhit[r] && (!casthit[r] || glm::abs(cast[r] - marched[r]) < HIT_TOLERANCE);
+        }
+        rays[0] += RaySet::COUNT;
+    }
+
+    // Rays from anywhere in the world, most of them cross several chunks
+    vec3 lo = vec3(world->chunkcoordmin * world->chunksize);
+    vec3 extent = vec3(world->width, world->height, world->depth) * (float)world->chunksize;
+    for (int i = 0; i < RaySet::COUNT; ++i)
+    {
+        set->origin[i] = lo + vec3(random.uniform(), random.uniform(), random.uniform()) * extent;
+        set->direction[i] = random.direction();
+    }
+    std::vector<vec3> sigma(RaySet::COUNT), hitpoint(RaySet::COUNT);
+    sw.start();
+    for (int r = 0; r < RaySet::COUNT; ++r)
+        marchhit[r] = chunkmarch(set->origin[r], set->direction[r], world, &sigma[r]);
+    marchtime[1] += sw.elapsed();
+
+    sw.start();
+    for (int r = 0; r < RaySet::COUNT; ++r)
+        casthit[r] = chunkcast(set->origin[r], set->direction[r], world, &hitpoint[r]);
+    casttime[1] += sw.elapsed();
+
+    for (int r = 0; r < RaySet::COUNT; ++r)
+    {
+        marchhits[1] += marchhit[r];
+        casthits[1] += casthit[r];
+        agree[1] += casthit[r] == marchhit[r] && (!casthit[r] || glm::distance(hitpoint[r], sigma[r]) < HIT_TOLERANCE);
+    }
+    rays[1] += RaySet::COUNT;
+
+    delete set;
+
+    printf("%d chunks\n", world->volume);
+    printf("%-8s %8s %12s %12s %12s %12s %10s\n", "rays", "count", "march hits", "cast hits", "march Mr/s", "cast Mr/s", "agree");
+    for (int k = 0; k < 2; ++k)
+        printf("%-8s %8llu %12llu %12llu %12.3f %12.3f %9.2f%%\n", k ? "world" : "chunk", (unsigned long long)rays[k],
+            (unsigned long long)marchhits[k], (unsigned long long)casthits[k], rays[k] / marchtime[k] / 1e6,
+            rays[k] / casttime[k] / 1e6, 100.0 * agree[k] / rays[k]);
+}
+
+// twigmarch as it was before its 3D-DDA: the cell is looked up from the point the ray has got
+// to, which then steps past the cell's far face by MARCH_EPS, up to 1000 times
+#define MARCH_EPS (1.0f / 8192.0f)
+
+static bool epsilontwigmarch(vec3 a, vec3 b, vec3 bmin, float size, float leafsize, const Octwig *twig, float *s,
+    uint32_t *steps)
+{
+    vec3 bmax = bmin + size;
+    float t = 0.0;
+    for (int c = 0; c < 1000; ++c)
+    {
+        vec3 p = a + b * t;
+        if (!isInsideCube(p, bmin, bmax)) return false;
+        ivec3 off = ivec3((p - bmin) / leafsize);
+        if (!isInsideCube(off, vec3(0), vec3(TWIG_SIZE-1))) return false;
+        ++*steps;
+        uint32_t word = Octwig::word(off.x, off.y, off.z);
+        if (twig->solid(word))
+        {
+            *s = t;
+            return true;
+        }
+        vec3 leafmin = bmin + vec3(off) * leafsize;
+        vec3 leafmax = leafmin + leafsize;
+        float escape = cubeEscapeDistance(p, b, leafmin, leafmax);
+        t += escape + MARCH_EPS;
+    }
+    return false;
+}
+
+struct TwigSteps
+{
+    uint64_t bricks, cells;
+    uint32_t most;
+};
+
+// chunkmarch and treemarch with the twig walk to measure in place of twigmarch
+template <typename Walk>
+static bool pathmarch(vec3 alpha, vec3 beta, const World *world, Walk walk, TwigSteps *steps, vec3 *sigma)
+{
+    float chunksize = (float)world->chunksize;
+    vec3 chunkmin = vec3(world->chunkcoordmin * (int)chunksize);
+    vec3 chunkmax = chunkmin + vec3(world->width, world->height, world->depth) * chunksize;
+
+    float t = 0.0f;
+    bool intersect = true;
+    if (!isInsideCube(alpha, chunkmin, chunkmax))
+        t = intersectCube(alpha, beta, chunkmin, chunkmax, &intersect) + MARCH_EPS;
+    if (!intersect)
+        return false;
+
+    for (int c = 0; c < 1000; ++c)
+    {
+        vec3 p = alpha + beta * t;
+        ivec3 q = world->index_float(p);
+        const Ocroot *root = &world->chunk[world->index(q.x, q.y, q.z)];
+        if (!isInsideCube(p, chunkmin, chunkmax) || !isInsideCube(p, root->position, root->position + root->size))
+            return false;
+
+        for (int i = 0; i < 1000 && isInsideCube(p, root->position, root->position + root->size); ++i)
+        {
+            Tree tree = traverse(p, root);
+            Octree node = root->node(tree.offset);
+            if (node.type() == LEAF)
+            {
+                *sigma = p;
+                return true;
+            }
+            if (node.type() == TWIG)
+            {
+                float s;
+                uint32_t cells = 0;
+                bool hit = walk(p, beta, tree.bmin, tree.size, tree.size / TWIG_SIZE, root->brick(node), &s, &cells);
+                ++steps->bricks;
+                steps->cells += cells;
+                steps->most = glm::max(steps->most, cells);
+                if (hit)
+                {
+                    *sigma = p + beta * s;
+                    return true;
+                }
+            }
+            float escape = cubeEscapeDistance(p, beta, tree.bmin, tree.bmin + tree.size) + MARCH_EPS;
+            t += escape;
+            p = alpha + beta * t;
+        }
+    }
+    return false;
+}
+
+// Frames along a camera path marched with the twigs walked by the EPS march twigmarch used
+// to be and by its 3D-DDA, with the cells each looks at in the bricks it enters. Hits agree
+// if both miss or both hit within HIT_TOLERANCE of each other.
+static void benchTwigDda(World *world)
+{
+    const int WIDTH = 160, HEIGHT = 90, FRAMES = 16;
+    const float HIT_TOLERANCE = 1.0f / 256.0f;
+    const char *NAMES[2] = { "eps march", "3d-dda" };
+    Counter sw;
+
+    vec3 lo = vec3(world->chunkcoordmin * world->chunksize);
+    vec3 extent = vec3(world->width, world->height, world->depth) * (float)world->chunksize;
+
+    double seconds[2] = {};
+    TwigSteps steps[2] = {};
+    uint64_t hits[2] = {}, agree = 0;
+    std::vector<vec3> sigma[2] = { std::vector<vec3>(WIDTH * HEIGHT), std::vector<vec3>(WIDTH * HEIGHT) };
+    std::vector<uint8_t> hit[2] = { std::vector<uint8_t>(WIDTH * HEIGHT), std::vector<uint8_t>(WIDTH * HEIGHT) };
+    for (int f = 0; f < FRAMES; ++f)
+    {
+        // Across the world over the terrain, turning as it goes
+        float u = (f + 0.5f) / FRAMES;
+        vec3 eye = lo + extent * vec3(0.2f + 0.6f * u, 0.8f, 0.1f + 0.3f * u);
+        float yaw = (u - 0.5f) * 1.5f;
+        vec3 forward = glm::normalize(vec3(sinf(yaw), -0.6f, cosf(yaw)));
+        vec3 right = glm::normalize(glm::cross(forward, vec3(0, 1, 0)));
+        vec3 up = glm::cross(right, forward);
+
+        for (int k = 0; k < 2; ++k)
+        {
+            sw.start();
+            for (int y = 0, r = 0; y < HEIGHT; ++y)
+            {
+                for (int x = 0; x < WIDTH; ++x, ++r)
+                {
+                    float px = (x + 0.5f) / WIDTH * 2 - 1, py = 1 - (y + 0.5f) / HEIGHT * 2;
+                    vec3 beta = glm::normalize(forward + right * px + up * py * ((float)HEIGHT / WIDTH));
+                    hit[k][r] = k ? pathmarch(eye, beta, world, twigmarch, &steps[k], &sigma[k][r])
+                        : pathmarch(eye, beta, world, epsilontwigmarch, &steps[k], &sigma[k][r]);
+                }
+            }
+            seconds[k] += sw.elapsed();
+        }
+
+        for (int r = 0; r < WIDTH * HEIGHT; ++r)
+        {
+            hits[0] += hit[0][r];
+            hits[1] += hit[1][r];
+            agree += hit[0][r] == hit[1][r] && (!hit[0][r] || glm::distance(sigma[0][r], sigma[1][r]) < HIT_TOLERANCE);
+        }
+    }
+
+    uint64_t rays = (uint64_t)WIDTH * HEIGHT * FRAMES;
+    printf("%d frames of %dx%d, twigs of %d^3\n", FRAMES, WIDTH, HEIGHT, TWIG_SIZE);
+    printf("%-10s %10s %10s %10s %12s %12s %10s\n", "twigs", "ms/frame", "Mrays/s", "hits", "bricks", "cells/brick", "most");
+    for (int k = 0; k < 2; ++k)
+        printf("%-10s %10.3f %10.3f %10llu %12llu %12.3f %10u\n", NAMES[k], seconds[k] * 1e3 / FRAMES, rays / seconds[k] / 1e6,
+            (unsigned long long)hits[k], (unsigned long long)steps[k].bricks,
+            (double)steps[k].cells / glm::max(steps[k].bricks, (uint64_t)1), steps[k].most);
+    printf("speedup %.2fx, %.2f%% of hits agree\n", seconds[0] / seconds[1], 100.0 * agree / rays);
+}
+
+// Batches of gameplay queries answered by the query service on its pool, against answering
+// them one after another on the calling thread. Segments are lines of sight between agents
+// over the terrain, rays are picks looking down, boxes are agents standing somewhere. Rays agree
+// with chunkcast on the world if both miss or both hit within HIT_TOLERANCE of each other,
+// and a small box around each hit has to overlap a voxel.
+static void benchQuery(World *world)
+{
+    const int SEGMENTS = 8192, PICKS = 2048, BOXES = 8192, ROUNDS = 8;
+    const float HIT_TOLERANCE = 1.0f / 256.0f;
+    const vec3 AGENT = vec3(0.6f, 1.8f, 0.6f);
+    Counter sw;
+
+    vec3 lo = vec3(world->chunkcoordmin * world->chunksize);
+    vec3 extent = vec3(world->width, world->height, world->depth) * (float)world->chunksize;
+
+    QueryService service;
+    sw.start();
+    service.init(world);
+    double initms = sw.elapsed() * 1e3;
+
+    Random random;
+    auto somewhere = [&](float ylo, float yhi) {
+        return lo + vec3(random.uniform(), ylo + (yhi - ylo) * random.uniform(), random.uniform()) * extent;
+    };
+    QueryBatch batch;
+    for (int i = 0; i < SEGMENTS; ++i)
+    {
+        vec3 a = somewhere(0.15f, 0.45f), b = somewhere(0.15f, 0.45f);
+        batch.rays.push_back({ a, b - a, 1.0f });
+    }
+    for (int i = 0; i < PICKS; ++i)
+    {
+        vec3 d = random.direction();
+        d.y = -glm::abs(d.y);
+        batch.rays.push_back({ somewhere(0.4f, 0.8f), d, INFINITY });
+    }
+    for (int i = 0; i < BOXES; ++i)
+    {
+        vec3 p = somewhere(0.1f, 0.4f);
+        batch.boxes.push_back({ p - AGENT * vec3(0.5f, 0.0f, 0.5f), p + AGENT * vec3(0.5f, 1.0f, 0.5f) });
+    }
+    size_t count = batch.rays.size() + batch.boxes.size();
+
+    std::vector<RayHit> rayhits(batch.rays.size());
+    std::vector<BoxHit> boxhits(batch.boxes.size());
+    sw.start();
+    for (int k = 0; k < ROUNDS; ++k)
+    {
+        for (size_t r = 0; r < batch.rays.size(); ++r)
+            service.cast(&batch.rays[r], &rayhits[r]);
+        for (size_t b = 0; b < batch.boxes.size(); ++b)
+            service.overlap(&batch.boxes[b], &boxhits[b]);
+    }
+    double serial = sw.elapsed() / ROUNDS;
+
+    sw.start();
+    for (int k = 0; k < ROUNDS; ++k)
+        service.run(&batch);
+    double pooled = sw.elapsed() / ROUNDS;
+
+    uint64_t rayhitcount = 0, boxhitcount = 0, agree = 0, same = 0, touched = 0;
+    for (size_t r = 0; r < batch.rays.size(); ++r)
+    {
+        const RayQuery *q = &batch.rays[r];
+        const RayHit *h = &batch.rayhits[r];
+        vec3 sigma;
+        bool hit = chunkcast(q->origin, q->direction, world, &sigma)
+            && glm::dot(sigma - q->origin, q->direction) <= q->length * glm::dot(q->direction, q->direction);
+        rayhitcount += h->hit;
+        agree += hit == h->hit && (!hit || glm::distance(sigma, h->point) < HIT_TOLERANCE);
+        same += h->hit == rayhits[r].hit && h->t == rayhits[r].t;
+        if (h->hit)
+        {
+            BoxQuery box = { h->point - HIT_TOLERANCE, h->point + HIT_TOLERANCE };
+            BoxHit b;
+            service.overlap(&box, &b);
+            touched += b.hit;
+        }
+    }
+    for (size_t b = 0; b < batch.boxes.size(); ++b)
+    {
+        boxhitcount += batch.boxhits[b].hit;
+        same += batch.boxhits[b].hit == boxhits[b].hit;
+    }
+
+    // As if every chunk had changed, then as if none had
+    for (int i = 0; i < world->volume; ++i)
+        ++world->revision[i];
+    sw.start();
+    service.update(world);
+    double fullms = sw.elapsed() * 1e3;
+    sw.start();
+    service.update(world);
+    double idlems = sw.elapsed() * 1e3;
+
+    printf("%d segments, %d picks, %d boxes, %u workers\n", SEGMENTS, PICKS, BOXES, (unsigned)service.pool.worker.size());
+    printf("%-8s %10s %12s %10s\n", "answered", "ms/batch", "Mqueries/s", "speedup");
+    printf("%-8s %10.3f %12.3f %10s\n", "serial", serial * 1e3, count / serial / 1e6, "");
+    printf("%-8s %10.3f %12.3f %9.2fx\n", "pool", pooled * 1e3, count / pooled / 1e6, serial / pooled);
+    printf("ray hits %llu, box hits %llu, %.2f%% of rays agree with chunkcast, %.2f%% same as serial, %llu of %llu hits overlap their voxel\n",
+        (unsigned long long)rayhitcount, (unsigned long long)boxhitcount, 100.0 * agree / batch.rays.size(),
+        100.0 * same / count, (unsigned long long)touched, (unsigned long long)rayhitcount);
+    printf("snapshot: %.3f ms to take, %.3f ms to copy every chunk again, %.3f ms when nothing changed\n",
+        initms, fullms, idlems);
+
+    service.deinit();
+}
+
+// Packets of rays traced together against one ray at a time with chunkmarch and chunkcast.
+// Coherent rays are those of a camera over the middle of the world looking down at the
+// terrain, a tile of neighbouring pixels to a packet. Incoherent ones start anywhere and go in
+// any direction. Hits agree with chunkcast's within HIT_TOLERANCE.
+static void benchPacket(World *world)
+{
+    const int WIDTH = 256, HEIGHT = 256;
+    const int TILE_X = PACKET_SIZE >= 8 ? 4 : 2, TILE_Y = PACKET_SIZE / TILE_X;
+    const float HIT_TOLERANCE = 1.0f / 256.0f;
+    const int COUNT = WIDTH * HEIGHT;
+    Counter sw;
+
+    vec3 lo = vec3(world->chunkcoordmin * world->chunksize);
+    vec3 extent = vec3(world->width, world->height, world->depth) * (float)world->chunksize;
+
+    std::vector<vec3> origin[2], direction[2];
+    for (int k = 0; k < 2; ++k)
+    {
+        origin[k].resize(COUNT);
+        direction[k].resize(COUNT);
+    }
+
+    // In tile order, so that each packet is PACKET_SIZE consecutive rays
+    vec3 eye = lo + extent * vec3(0.5f, 0.9f, 0.1f);
+    vec3 forward = glm::normalize(vec3(0.0f, -0.5f, 1.0f));
+    vec3 right = glm::normalize(glm::cross(forward, vec3(0, 1, 0)));
+    vec3 up = glm::cross(right, forward);
+    for (int ty = 0, r = 0; ty < HEIGHT; ty += TILE_Y)
+    {
+        for (int tx = 0; tx < WIDTH; tx += TILE_X)
+        {
+            for (int y = ty; y < ty + TILE_Y; ++y)
+            {
+                for (int x = tx; x < tx + TILE_X; ++x, ++r)
+                {
+                    float u = (x + 0.5f) / WIDTH * 2 - 1, v = (y + 0.5f) / HEIGHT * 2 - 1;
+                    origin[0][r] = eye;
+                    direction[0][r] = glm::normalize(forward + right * u * 0.6f + up * v * 0.6f);
+                }
+            }
+        }
+    }
+
+    Random random;
+    for (int r = 0; r < COUNT; ++r)
+    {
+        origin[1][r] = lo + vec3(random.uniform(), random.uniform(), random.uniform()) * extent;
+        direction[1][r] = random.direction();
+    }
+
+    printf("%d rays, packets of %d, %d chunks\n", COUNT, PACKET_SIZE, world->volume);
+    printf("%-11s %8s %12s %12s %12s %10s %10s\n", "rays", "hits", "march Mr/s", "cast Mr/s", "packet Mr/s",
+        "speedup", "agree");
+    for (int k = 0; k < 2; ++k)
+    {
+        std::vector<vec3> marched(COUNT), cast(COUNT);
+        std::vector<uint8_t> casthit(COUNT);
+        std::vector<float> packed(COUNT);
+        double marchtime, casttime, packettime;
+        uint64_t hits = 0, agree = 0;
+
+        sw.start();
+        for (int r = 0; r < COUNT; ++r)
+            chunkmarch(origin[k][r], direction[k][r], world, &marched[r]);
+        marchtime = sw.elapsed();
+
+        sw.start();
+        for (int r = 0; r < COUNT; ++r)
+            casthit[r] = chunkcast(origin[k][r], direction[k][r], world, &cast[r]);
+        casttime = sw.elapsed();
+
+        RayPacket *packet = new RayPacket;
+        sw.start();
+        for (int r = 0; r < COUNT; r += PACKET_SIZE)
+        {
+            packet->count = PACKET_SIZE;
+            for (int i = 0; i < PACKET_SIZE; ++i)
+                packet->set(i, origin[k][r + i], direction[k][r + i]);
+            packetcast(packet, world);
+            for (int i = 0; i < PACKET_SIZE; ++i)
+                packed[r + i] = packet->t[i];
+        }
+        packettime = sw.elapsed();
+        delete packet;
+
+        for (int r = 0; r < COUNT; ++r)
+        {
+            bool hit = packed[r] < INFINITY;
+            hits += hit;
+            agree += hit == (bool)casthit[r]
+                && (!hit || glm::distance(origin[k][r] + direction[k][r] * packed[r], cast[r]) < HIT_TOLERANCE);
+        }
+
+        printf("%-11s %8llu %12.3f %12.3f %12.3f %9.2fx %9.2f%%\n", k ? "incoherent" : "coherent",
+            (unsigned long long)hits, COUNT / marchtime / 1e6, COUNT / casttime / 1e6, COUNT / packettime / 1e6,
+            marchtime / packettime, 100.0 * agree / COUNT);
+    }
+
+    // Slots that do not hold their chunk yet end the rays that reach them as misses, like in
+    // chunkcast. Every third slot is made to look like it waits for a chunk a shift brings in.
+    for (int i = 0; i < world->volume; i += 3)
+        world->chunk[i].position.x += extent.x;
+    uint64_t agree[2] = {};
+    for (int k = 0; k < 2; ++k)
+    {
+        RayPacket *packet = new RayPacket;
+        for (int r = 0; r < COUNT; r += PACKET_SIZE)
+        {
+            packet->count = PACKET_SIZE;
+            for (int i = 0; i < PACKET_SIZE; ++i)
+                packet->set(i, origin[k][r + i], direction[k][r + i]);
+            packetcast(packet, world);
+            for (int i = 0; i < PACKET_SIZE; ++i)
+            {
+                vec3 sigma;
+                bool hit = packet->t[i] < INFINITY;
+                vec3 o = origin[k][r + i], d = direction[k][r + i];
+                bool casthit = chunkcast(o, d, world, &sigma);
+                agree[k] += hit == casthit && (!hit || glm::distance(o + d * packet->t[i], sigma) < HIT_TOLERANCE);
+            }
+        }
+        delete packet;
+    }
+    for (int i = 0; i < world->volume; i += 3)
+        world->chunk[i].position.x -= extent.x;
+    printf("with every third slot not resident: %.2f%% of coherent and %.2f%% of incoherent rays agree\n",
+        100.0 * agree[0] / COUNT, 100.0 * agree[1] / COUNT);
+}
+
+// Frames of the headless renderer on 1 thread up to every core, each has to match the first
+static void benchRender(World *world)
+{
+    const int WIDTH = 640, HEIGHT = 360;
+
+    RenderScene scene;
+    scene.init(world, WIDTH, HEIGHT);
+    unsigned cores = std::thread::hardware_concurrency();
+    if (cores == 0)
+        cores = 1;
+
+    Image first;
+    double base = 0;
+    printf("%dx%d, tiles of %d, %u cores\n", WIDTH, HEIGHT, RENDER_TILE, cores);
+    printf("%-8s %10s %10s %10s %10s %10s\n", "threads", "ms", "Mrays/s", "speedup", "stolen", "same");
+    for (unsigned threads = 1; ; threads = glm::min(threads * 2, cores))
+    {
+        Renderer renderer;
+        renderer.init(threads);
+        Image image;
+        image.init(WIDTH, HEIGHT);
+        renderer.render(world, &scene, &image);
+
+        const RenderStats *s = &renderer.stats;
+        if (threads == 1)
+        {
+            first = image;
+            base = s->seconds;
+        }
+        printf("%-8u %10.3f %10.3f %9.2fx %4llu/%-5llu %10s\n", threads, s->seconds * 1e3, s->rays / s->seconds / 1e6,
+            base / s->seconds, (unsigned long long)s->stolen, (unsigned long long)s->tiles,
+            image.rgb == first.rgb ? "yes" : "no");
+        if (threads == cores)
+            break;
+    }
+}
+
+// The shape and memory use of the generated world, as JSON to compare between builds
+static void benchStats(World *world)
+{
+    writejson(stdout, world);
+}
+
+struct Benchmark
+{
+    const char *name;
+    const char *what;
+    void (*run)(World *world);
+};
+
+static const Benchmark BENCHMARKS[] =
+{
+    { "grow", "breadth-first vs depth-first octree builder: build time, rays/s and cache misses", benchGrow },
+    { "twig", "memory per chunk of palette twigs against plain 16-bit twigs", benchTwig },
+    { "bricks", "build time, memory and rays/s at the brick size chosen by TWIG_DEPTH", benchBricks },
+    { "sparse", "memory and rays/s of chunks with dense branches against child-mask branches", benchSparse },
+    { "dag", "memory and rays/s of chunks sharing subtrees through the dag against sparse copies", benchDag },
+    { "pyramid", "build time, reduction time and memory of the heightmap pyramids", benchPyramid },
+    { "noise", "heightmap texels/s of glm's simplex noise against the batched one", benchNoise },
+    { "density", "build time and samples per voxel of cave terrain, density bounds against brute force", benchDensity },
+    { "lod", "memory, rays/s and words read per ray of each level of detail of the chunks", benchLod },
+    { "region", "chunks paged in from plain and compressed region files, cold and warm, against generating them", benchRegion },
+    { "codec", "compression ratio and encode and decode throughput of the chunks' on-disk codec", benchCodec },
+    { "cast", "rays/s and agreement of the stack-based front to back walk against the marches", benchCast },
+    { "twigdda", "frame time and cells looked at per brick of twigmarch's 3D-DDA against the EPS march it replaced", benchTwigDda },
+    { "packet", "rays/s of packets of rays traced together against single-ray chunkmarch and chunkcast", benchPacket },
+    { "render", "frame time and rays/s of the headless tile renderer from one thread to every core", benchRender },
+    { "query", "batches of segments, rays and boxes answered by the query service on its pool against one at a time", benchQuery },
+    { "journal", "cost per edit of journaling it against saving its chunk, and of replaying it", benchJournal },
+    { "recovery", "checks that a crash right after saving a chunk loses none of its journaled edits", benchRecovery },
+    { "journalrace", "checks that workers saving chunks sync every edit journaled meanwhile by another thread", benchJournalRace },
+    { "stats", "node counts, depth histogram and memory of the world's chunks as JSON", benchStats },
+};
+
+int benchmark(int argc, char **argv)
+{
+    const int count = sizeof(BENCHMARKS) / sizeof(BENCHMARKS[0]);
+
+    if (argc == 0)
+    {
+        printf("usage: octree bench <name>... | all\n");
+        for (int i = 0; i < count; ++i)
+            printf("  %-12s %s\n", BENCHMARKS[i].name, BENCHMARKS[i].what);
+        return 0;
+    }
+
+    Counter sw;
+    World world;
+    SW_START(sw, "Generating world");
+    world.init(4, 2, 4, 128);
+    SW_STOP(sw);
+
+    int status = 0;
+    for (int a = 0; a < argc; ++a)
+    {
+        bool found = false;
+        for (int i = 0; i < count; ++i)
+        {
+            if (strcmp(argv[a], "all") && strcmp(argv[a], BENCHMARKS[i].name))
+                continue;
+            printf("[%s]\n", BENCHMARKS[i].name);
+            BENCHMARKS[i].run(&world);
+            printf("\n");
+            found = true;
+        }
+        if (!found)
+        {
+            fprintf(stderr, "No such benchmark: %s\n", argv[a]);
+            status = 1;
+        }
+    }
+
+    world.deinit();
+    return status;
+}
@@ -0,0 +1,9 @@
+#pragma once
+
+#ifndef BENCHMARK_H
+#define BENCHMARK_H
+
+// Runs the named benchmarks, or lists them if none are named. Needs no window or GL context.
+int benchmark(int argc, char **argv);
+
+#endif
@@ -1,9 +1,14 @@
 #include <assert.h>
 #include <float.h>
-#include <glm/vec2.hpp>
+#include <string.h>
 #include <glm/common.hpp>
-#include <glm/gtc/noise.hpp>
+#include <vector>
 #include "BoundsPyramid.h"
+#include "Jobs.h"
+#include "Noise.h"
+
+// Rows generated by each job when computeBase is given a pool
+#define PYRAMID_BAND 32
 
 static inline bool ispowof2(size_t i)
 {
@@ -13,6 +18,14 @@ static inline bool ispowof2(size_t i)
 #ifdef _MSC_VER
 # include <intrin.h>
 #endif
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+# include <emmintrin.h>
+# define PYRAMID_SSE2
+#endif
+#if defined(__F16C__) || defined(__AVX2__)
+# include <immintrin.h>
+# define PYRAMID_F16C
+#endif
 static inline size_t log2(size_t i)
 {
 #ifdef _MSC_VER
@@ -44,7 +57,69 @@ static inline float blerp(float yx00, float yx01, float yx10, float yx11, float
     return lerp(y0, y1, s);
 }
 
-void BoundsPyramid::init(size_t size, float ampl, float period, float xshift, float yshift, float zshift)
+// The min/max reduction compares halves as 16-bit integers: flipping the magnitude bits of
+// negative values orders them like the floats they stand for, and flipping them back is the
+// same operation
+static inline int16_t key(BoundsPyramid::half h)
+{
+    return (int16_t)(h ^ ((h & 0x8000) ? 0x7fff : 0));
+}
+
+float halftofloat(BoundsPyramid::half h)
+{
+#ifdef PYRAMID_F16C
+    return _cvtsh_ss(h);
+#else
+    uint32_t sign = (uint32_t)(h & 0x8000) << 16;
+    uint32_t exponent = (h >> 10) & 0x1f;
+    uint32_t mantissa = h & 0x3ff;
+    float f;
+    if (exponent == 0)
+    {
+        // Subnormal, exactly mantissa * 2^-24
+        f = (float)mantissa * 5.9604645e-8f;
+        return sign ? -f : f;
+    }
+    uint32_t bits = sign | (exponent == 0x1f ? 0x7f800000 : (exponent + 112) << 23) | (mantissa << 13);
+    memcpy(&f, &bits, sizeof(f));
+    return f;
+#endif
+}
+
+BoundsPyramid::half floattohalf(float f)
+{
+#ifdef PYRAMID_F16C
+    return _cvtss_sh(f, _MM_FROUND_TO_NEAREST_INT);
+#else
+    uint32_t bits;
+    memcpy(&bits, &f, sizeof(bits));
+    uint32_t sign = (bits >> 16) & 0x8000;
+    uint32_t magnitude = bits & 0x7fffffff;
+
+    if (magnitude >= 0x47800000)
+        return (BoundsPyramid::half)(sign | (magnitude > 0x7f800000 ? 0x7e00 : 0x7c00));
+    if (magnitude >= 0x38800000)
+    {
+        // Rebias the exponent and round the 13 bits dropped from the mantissa to nearest
+        // even without branching, a carry into the exponent gives the right result as well
+        uint32_t odd = (magnitude >> 13) & 1;
+        return (BoundsPyramid::half)(sign | ((magnitude - 0x38000000 + 0xfff + odd) >> 13));
+    }
+    if (magnitude < 0x33000000)
+        return (BoundsPyramid::half)sign;
+
+    // Subnormal, the mantissa with its implicit bit shifted down to a multiple of 2^-24
+    uint32_t h = (magnitude & 0x7fffff) | 0x800000;
+    uint32_t shift = 126 - (magnitude >> 23);
+    uint32_t rest = h & ((1u << shift) - 1), tie = 1u << (shift - 1);
+    h >>= shift;
+    if (rest > tie || (rest == tie && (h & 1)))
+        ++h;
+    return (BoundsPyramid::half)(sign | h);
+#endif
+}
+
+void BoundsPyramid::init(size_t size, float ampl, float period, float xshift, float yshift, float zshift, JobPool *jobs)
 {
     assert(ispowof2(size));
 
@@ -52,87 +127,143 @@ void BoundsPyramid::init(size_t size, float ampl, float period, float xshift, fl
     this->levels = log2(size);
     this->amplitude = ampl;
     this->shift = yshift;
+    assert(this->levels <= MAX_LEVELS);
 
-    this->basequad = new half[this->size*this->size];
-    this->minquad = new half*[this->levels+1];
-    this->maxquad = new half*[this->levels+1];
-
+    half *q = new half[this->bytes() / sizeof(half)];
+    this->basequad = q;
+    q += size * size;
     for (size_t i = 0, s = 1; i < levels; ++i, s *= 2)
     {
-        this->minquad[i] = new half[s*s];
-        for (size_t j = 0; j < s*s; ++j)
-            this->minquad[i][j] = 1.0;
-
-        this->maxquad[i] = new half[s*s];
-        for (size_t j = 0; j < s*s; ++j)
-            this->maxquad[i][j] = -1.0;
+        this->minquad[i] = q;
+        this->maxquad[i] = q + s*s;
+        q += 2*s*s;
     }
     this->minquad[this->levels] = this->maxquad[this->levels] = this->basequad;
 
-    this->computeBase(period, xshift, zshift);
+    // Builds the levels above as it goes
+    this->computeBase(period, xshift, zshift, jobs);
+}
 
-    for (size_t i = 0; i < levels; ++i)
+void BoundsPyramid::deinit()
+{
+    delete[] this->basequad;
+    this->basequad = nullptr;
+}
+
+// The same pyramid in an allocation of its own, for jobs that outlive the original
+BoundsPyramid BoundsPyramid::copy() const
+{
+    BoundsPyramid p = *this;
+    p.basequad = new half[this->bytes() / sizeof(half)];
+    memcpy(p.basequad, this->basequad, this->bytes());
+    for (size_t i = 0; i <= this->levels; ++i)
     {
-        this->computeBoundsAbove(levels - i);
+        p.minquad[i] = p.basequad + (this->minquad[i] - this->basequad);
+        p.maxquad[i] = p.basequad + (this->maxquad[i] - this->basequad);
     }
+    return p;
 }
 
-void BoundsPyramid::deinit()
+size_t BoundsPyramid::bytes() const
 {
-    delete[] this->basequad;
-    for (size_t i = 0; i < levels; ++i)
+    size_t n = size * size;
+    for (size_t s = 1; s < size; s *= 2)
+        n += 2 * s * s;
+    return n * sizeof(half);
+}
+
+void BoundsPyramid::computeBase(float period, float xshift, float zshift, JobPool *jobs)
+{
+    if (!jobs || this->size <= PYRAMID_BAND)
     {
-        delete[] this->minquad[i];
-        delete[] this->maxquad[i];
+        this->computeRows(period, xshift, zshift, 0, this->size, 0);
+        return;
     }
-    delete[] this->minquad;
-    delete[] this->maxquad;
+
+    // Bands of rows only depend on each other above the level where each one is down to a
+    // single row, that part is reduced once they are all done
+    size_t top = this->levels - log2((size_t)PYRAMID_BAND);
+    for (size_t z = 0; z < this->size; z += PYRAMID_BAND)
+        jobs->submit([=, this]() { this->computeRows(period, xshift, zshift, z, PYRAMID_BAND, top); });
+    jobs->wait();
+
+    for (size_t z = 0; z < pow2(top) / 2; ++z)
+        this->computeBoundsAbove(top, z, 0);
 }
 
-void BoundsPyramid::computeBase(float period, float xshift, float zshift)
+// Generates rows z0 to z0+rows of the base and reduces them up to level top
+void BoundsPyramid::computeRows(float period, float xshift, float zshift, size_t z0, size_t rows, size_t top)
 {
-    for (size_t z = 0, i = 0; z < this->size; ++z)
+    std::vector<float> row(3 * this->size);
+    float *px = &row[0], *pz = &row[this->size], *noise = &row[2 * this->size];
+    for (size_t x = 0; x < this->size; ++x)
+        px[x] = ((float)x + xshift) * period;
+
+    for (size_t z = z0; z < z0 + rows; ++z)
     {
-        for (size_t x = 0; x < this->size; ++x, ++i)
+        float y = ((float)z + zshift) * period;
+        for (size_t x = 0; x < this->size; ++x)
+            pz[x] = y;
+        simplex(px, pz, noise, this->size);
+
+        half *q = &this->basequad[index(0, z, this->size)];
+        for (size_t x = 0; x < this->size; ++x)
         {
-            auto point = glm::vec2((float)x + xshift, (float)z + zshift) * period;
-            float noise = glm::simplex(point);
-            assert(noise >= -1.0 && noise <= +1.0);
-            this->basequad[i] = noise;
+            assert(noise[x] >= -1.0 && noise[x] <= +1.0);
+            q[x] = floattohalf(noise[x]);
         }
+
+        // Every second row completes a row of the level above, still in cache
+        if (z & 1 && this->levels > top)
+            this->computeBoundsAbove(this->levels, z / 2, top);
     }
 }
 
-void BoundsPyramid::computeBoundsAbove(size_t lv)
+// Reduces each 2x2 square of rows a and b, s halves long, into one half of out
+template <bool MAX>
+static void reduce(const BoundsPyramid::half *a, const BoundsPyramid::half *b, BoundsPyramid::half *out, size_t s)
 {
-    using glm::min;
-    using glm::max;
+    size_t x = 0;
+#ifdef PYRAMID_SSE2
+    const __m128i flip = _mm_set1_epi16(0x7fff);
+    auto tokey = [flip](__m128i h) { return _mm_xor_si128(h, _mm_and_si128(_mm_srai_epi16(h, 15), flip)); };
+    auto op = [](__m128i u, __m128i v) { return MAX ? _mm_max_epi16(u, v) : _mm_min_epi16(u, v); };
+    for (; x + 16 <= s; x += 16)
+    {
+        __m128i v0 = op(tokey(_mm_loadu_si128((const __m128i *)(a + x))), tokey(_mm_loadu_si128((const __m128i *)(b + x))));
+        __m128i v1 = op(tokey(_mm_loadu_si128((const __m128i *)(a + x + 8))), tokey(_mm_loadu_si128((const __m128i *)(b + x + 8))));
+        // Neighbours share a 32-bit lane, the result ends up in its low half
+        v0 = op(v0, _mm_srli_epi32(v0, 16));
+        v1 = op(v1, _mm_srli_epi32(v1, 16));
+        v0 = _mm_srai_epi32(_mm_slli_epi32(v0, 16), 16);
+        v1 = _mm_srai_epi32(_mm_slli_epi32(v1, 16), 16);
+        _mm_storeu_si128((__m128i *)(out + x / 2), tokey(_mm_packs_epi32(v0, v1)));
+    }
+#endif
+    for (; x < s; x += 2)
+    {
+        int16_t k0 = key(a[x]), k1 = key(a[x + 1]), k2 = key(b[x]), k3 = key(b[x + 1]);
+        int16_t k = MAX ? glm::max(glm::max(k0, k1), glm::max(k2, k3)) : glm::min(glm::min(k0, k1), glm::min(k2, k3));
+        out[x / 2] = (BoundsPyramid::half)key((BoundsPyramid::half)k);
+    }
+}
 
+// Reduces rows 2z and 2z+1 of level lv into row z of the level above, and carries on up
+// to level top once that completes a pair of rows there too
+void BoundsPyramid::computeBoundsAbove(size_t lv, size_t z, size_t top)
+{
     assert(0 < lv && lv <= this->levels);
     size_t above = lv-1;
     size_t s = pow2(lv);
+    assert(z < s / 2);
 
-    for (size_t z = 0; z < s; ++z)
-    {
-        for (size_t x = 0; x < s; x += 2)
-        {
-            size_t i = index(x+0, z, s);
-            size_t j = index(x+1, z, s);
-            size_t k = index(x / 2, z / 2, s / 2);
-
-            float min0 = this->minquad[above][k];
-            float min1 = this->minquad[lv][i];
-            float min2 = this->minquad[lv][j];
-
-            float max0 = this->maxquad[above][k];
-            float max1 = this->maxquad[lv][i];
-            float max2 = this->maxquad[lv][j];
+    reduce<false>(&this->minquad[lv][index(0, 2*z, s)], &this->minquad[lv][index(0, 2*z+1, s)], &this->minquad[above][index(0, z, s/2)], s);
+    reduce<true>(&this->maxquad[lv][index(0, 2*z, s)], &this->maxquad[lv][index(0, 2*z+1, s)], &this->maxquad[above][index(0, z, s/2)], s);
 
-            this->minquad[above][k] = glm::min(min0, glm::min(min1, min2));
-            this->maxquad[above][k] = glm::max(max0, glm::max(max1, max2));
-        }
-    }
+    if (z & 1 && above > top)
+        this->computeBoundsAbove(above, z / 2, top);
 }
+
 float BoundsPyramid::min(float x, float z, size_t lv) const
 {
     return this->bound(x, z, lv, this->minquad[lv]);
@@ -157,7 +288,7 @@ float BoundsPyramid::bound(float x, float z, size_t lv, const half *q) const
         // Within bounds => simply compute the index for the level and return
         size_t d = pow2(this->levels - lv);
         size_t i = index(a / d, b / d, this->size / d);
-        return q[i] * this->amplitude + this->shift;
+        return halftofloat(q[i]) * this->amplitude + this->shift;
     }
 
     // Out of bounds => interpolate values from the base
@@ -166,9 +297,9 @@ float BoundsPyramid::bound(float x, float z, size_t lv, const half *q) const
     size_t b0 = b, b1 = (b0 + 1) & mask;
     float t = (float)(x * this->size) - a0;
     float s = (float)(z * this->size) - b0;
-    float ba00 = this->basequad[index(a0, b0, this->size)];
-    float ba01 = this->basequad[index(a1, b0, this->size)];
-    float ba10 = this->basequad[index(a0, b1, this->size)];
-    float ba11 = this->basequad[index(a1, b1, this->size)];
+    float ba00 = halftofloat(this->basequad[index(a0, b0, this->size)]);
+    float ba01 = halftofloat(this->basequad[index(a1, b0, this->size)]);
+    float ba10 = halftofloat(this->basequad[index(a0, b1, this->size)]);
+    float ba11 = halftofloat(this->basequad[index(a1, b1, this->size)]);
     return blerp(ba00, ba01, ba10, ba11, t, s) * this->amplitude + this->shift;
 }
@@ -3,23 +3,36 @@
 #ifndef BOUNDSPYRAMID_H
 #define BOUNDSPYRAMID_H
 
+#include <stddef.h>
+#include <stdint.h>
+
+struct JobPool;
+
 struct BoundsPyramid
 {
-    // using half = __fp16;
-    using half = float;
+    // IEEE half floats, all in one allocation: the base first, then the min and the max of
+    // every level from the 1x1 one down
+    using half = uint16_t;
+    static constexpr size_t MAX_LEVELS = 16;
 
-    half *basequad, **minquad, **maxquad;
+    half *basequad, *minquad[MAX_LEVELS + 1], *maxquad[MAX_LEVELS + 1];
     size_t size, levels;
     float amplitude, shift;
 
-    void init(size_t size, float ampl, float period, float xshift, float yshift, float zshift);
+    // With a pool, the base is generated by bands of rows in parallel
+    void init(size_t size, float ampl, float period, float xshift, float yshift, float zshift, JobPool *jobs = nullptr);
     void deinit();
-    void computeBase(float period, float xshift, float zshift);
-    void computeBoundsAbove(size_t lv);
+    BoundsPyramid copy() const;
+    size_t bytes() const;
+    void computeBase(float period, float xshift, float zshift, JobPool *jobs = nullptr);
+    void computeRows(float period, float xshift, float zshift, size_t z0, size_t rows, size_t top);
+    void computeBoundsAbove(size_t lv, size_t z, size_t top = 0);
     float min(float x, float z, size_t lv) const;
     float max(float x, float z, size_t lv) const;
     float bound(float x, float z, size_t lv, const half *q) const;
 };
 
+float halftofloat(BoundsPyramid::half h);
+BoundsPyramid::half floattohalf(float f);
 
-#endif
\ No newline at end of file
+#endif
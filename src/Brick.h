@@ -0,0 +1,130 @@
+#pragma once
+
+#ifndef BRICK_H
+#define BRICK_H
+
+#include <assert.h>
+#include <stdint.h>
+#include <string.h>
+
+// A brick of (2^D)^3 voxels, used for the twigs at the bottom D levels of a tree. Bit w of
+// mask says whether voxel w is solid, in which case its material is palette[i] with i the
+// 2-bit index at position w. Bricks with more than PALETTE materials do not fit and are
+// stored as branches down to single voxels instead.
+template <unsigned D>
+struct Brick
+{
+    static_assert(D > 0 && D <= 4);
+
+    static constexpr unsigned DEPTH = D;
+    static constexpr unsigned SIZE = 1 << D;
+    static constexpr unsigned WORDS = SIZE * SIZE * SIZE;
+    static constexpr unsigned PALETTE = 4;
+    static constexpr unsigned INDEX_BITS = 2;
+    static constexpr unsigned MASK_WORDS = (WORDS + 63) / 64;
+    static constexpr unsigned INDEX_WORDS = (WORDS * INDEX_BITS + 31) / 32;
+
+    uint64_t mask[MASK_WORDS];
+    uint16_t palette[PALETTE];
+    uint32_t index[INDEX_WORDS];
+
+    static unsigned word(unsigned x, unsigned y, unsigned z);
+
+    Brick() = default;
+    explicit Brick(uint16_t v);
+
+    bool solid(unsigned w) const;
+    uint16_t get(unsigned w) const;
+    void unpack(uint16_t leaf[WORDS]) const;
+    bool pack(const uint16_t leaf[WORDS]);
+    int mono() const;
+};
+
+template <unsigned D>
+unsigned Brick<D>::word(unsigned x, unsigned y, unsigned z)
+{
+    assert(x < SIZE);
+    assert(y < SIZE);
+    assert(z < SIZE);
+    unsigned i = (z * SIZE * SIZE) + (y * SIZE) + x;
+    assert(i < WORDS);
+    return i;
+}
+
+template <unsigned D>
+Brick<D>::Brick(uint16_t v)
+{
+    memset(mask, 0, sizeof(mask));
+    memset(palette, 0, sizeof(palette));
+    memset(index, 0, sizeof(index));
+    palette[0] = v;
+    if (v)
+        for (unsigned w = 0; w < WORDS; ++w)
+            mask[w / 64] |= (uint64_t)1 << (w % 64);
+}
+
+template <unsigned D>
+bool Brick<D>::solid(unsigned w) const
+{
+    assert(w < WORDS);
+    return (mask[w / 64] >> (w % 64)) & 1;
+}
+
+template <unsigned D>
+uint16_t Brick<D>::get(unsigned w) const
+{
+    if (!solid(w))
+        return 0;
+    unsigned i = (index[w / 16] >> (w % 16 * INDEX_BITS)) & (PALETTE - 1);
+    return palette[i];
+}
+
+template <unsigned D>
+void Brick<D>::unpack(uint16_t leaf[WORDS]) const
+{
+    for (unsigned w = 0; w < WORDS; ++w)
+        leaf[w] = get(w);
+}
+
+// Rebuilds the palette from scratch, returns false and leaves the brick as is if the
+// voxels have more materials than fit
+template <unsigned D>
+bool Brick<D>::pack(const uint16_t leaf[WORDS])
+{
+    Brick brick = Brick(0);
+    unsigned n = 0;
+    for (unsigned w = 0; w < WORDS; ++w)
+    {
+        if (!leaf[w])
+            continue;
+
+        unsigned i = 0;
+        while (i < n && brick.palette[i] != leaf[w])
+            ++i;
+        if (i == n)
+        {
+            if (n == PALETTE)
+                return false;
+            brick.palette[n++] = leaf[w];
+        }
+
+        brick.mask[w / 64] |= (uint64_t)1 << (w % 64);
+        brick.index[w / 16] |= i << (w % 16 * INDEX_BITS);
+    }
+
+    *this = brick;
+    return true;
+}
+
+// Returns -1 if more than one material is found, otherwise returns the material
+template <unsigned D>
+int Brick<D>::mono() const
+{
+    uint16_t x = get(0);
+    for (unsigned w = 1; w < WORDS; ++w)
+        if (get(w) != x)
+            return -1;
+    return x;
+}
+
+#endif
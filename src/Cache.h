@@ -0,0 +1,106 @@
+#pragma once
+
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <assert.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <functional>
+#include <list>
+#include <unordered_map>
+
+// Keeps values that would otherwise be thrown away, up to limit bytes: once there are more,
+// the least recently put ones are handed to discard. Values move in and out, whoever takes
+// one owns it again.
+template <typename K, typename V, typename Hash>
+struct LruCache
+{
+    struct Entry
+    {
+        K key;
+        V value;
+        size_t bytes;
+    };
+
+    // Most recent first
+    std::list<Entry> order;
+    std::unordered_map<K, typename std::list<Entry>::iterator, Hash> map;
+    std::function<void(V *value)> discard;
+    size_t bytes, limit;
+    uint64_t hits, misses, evictions;
+
+    void init(size_t limit, std::function<void(V *value)> discard);
+    void deinit();
+    void put(const K& key, const V& value, size_t bytes);
+    bool take(const K& key, V *value);
+    V *peek(const K& key);
+    void trim(size_t limit);
+};
+
+template <typename K, typename V, typename Hash>
+void LruCache<K, V, Hash>::init(size_t limit, std::function<void(V *value)> discard)
+{
+    this->limit = limit;
+    this->discard = discard;
+    bytes = 0;
+    hits = misses = evictions = 0;
+}
+
+template <typename K, typename V, typename Hash>
+void LruCache<K, V, Hash>::deinit()
+{
+    trim(0);
+}
+
+template <typename K, typename V, typename Hash>
+void LruCache<K, V, Hash>::put(const K& key, const V& value, size_t size)
+{
+    assert(map.find(key) == map.end());
+    order.push_front(Entry { key, value, size });
+    map[key] = order.begin();
+    bytes += size;
+    trim(limit);
+}
+
+template <typename K, typename V, typename Hash>
+bool LruCache<K, V, Hash>::take(const K& key, V *value)
+{
+    auto found = map.find(key);
+    if (found == map.end())
+    {
+        ++misses;
+        return false;
+    }
+
+    ++hits;
+    *value = found->second->value;
+    bytes -= found->second->bytes;
+    order.erase(found->second);
+    map.erase(found);
+    return true;
+}
+
+// The value kept for key, left where it is, or nullptr if there is none
+template <typename K, typename V, typename Hash>
+V *LruCache<K, V, Hash>::peek(const K& key)
+{
+    auto found = map.find(key);
+    return found == map.end() ? nullptr : &found->second->value;
+}
+
+template <typename K, typename V, typename Hash>
+void LruCache<K, V, Hash>::trim(size_t limit)
+{
+    while (bytes > limit)
+    {
+        Entry& e = order.back();
+        discard(&e.value);
+        bytes -= e.bytes;
+        map.erase(e.key);
+        order.pop_back();
+        ++evictions;
+    }
+}
+
+#endif
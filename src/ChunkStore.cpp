@@ -0,0 +1,356 @@
+#include <errno.h>
+#include <stddef.h>
+#include <string.h>
+#include <algorithm>
+#include <filesystem>
+#include <glm/common.hpp>
+#include "ChunkStore.h"
+#include "Codec.h"
+#include "Util.h"
+
+#ifdef _WIN32
+# define WIN32_LEAN_AND_MEAN
+# define NOMINMAX
+# include <windows.h>
+# include <io.h>
+#else
+# include <sys/mman.h>
+# include <unistd.h>
+#endif
+
+using glm::ivec3;
+
+static ivec3 regionof(ivec3 p)
+{
+    ivec3 r;
+    for (int i = 0; i < 3; ++i)
+        r[i] = (p[i] < 0 ? p[i] - (REGION_SIZE - 1) : p[i]) / REGION_SIZE;
+    return r;
+}
+
+static int slotof(ivec3 p)
+{
+    ivec3 s = p - regionof(p) * REGION_SIZE;
+    return (s.y * REGION_SIZE + s.z) * REGION_SIZE + s.x;
+}
+
+static uint64_t align(uint64_t n)
+{
+    return (n + REGION_ALIGN - 1) & ~(uint64_t)(REGION_ALIGN - 1);
+}
+
+static void seek(FILE *fp, uint64_t offset)
+{
+#ifdef _WIN32
+    _fseeki64(fp, (int64_t)offset, SEEK_SET);
+#else
+    fseeko(fp, (off_t)offset, SEEK_SET);
+#endif
+}
+
+// Writes n bytes, then zeros up to the next multiple of REGION_ALIGN
+static void put(FILE *fp, const void *data, size_t n)
+{
+    static const char zero[REGION_ALIGN] = {};
+    if (fwrite(data, 1, n, fp) != n || fwrite(zero, 1, align(n) - n, fp) != align(n) - n)
+        die("Could not write a region file: %s\n", strerror(errno));
+}
+
+static std::string pathof(const std::string& directory, ivec3 r)
+{
+    char name[64];
+    snprintf(name, sizeof(name), "/%d.%d.%d.region", r.x, r.y, r.z);
+    return directory + name;
+}
+
+// True if no word of root refers to the dag
+static bool owned(const Ocroot *root)
+{
+    for (uint64_t i = 0; i < root->trees; ++i)
+        if (root->tree[i].shared())
+            return false;
+    return true;
+}
+
+void ChunkStore::init(const char *directory, uint32_t chunksize, uint32_t depth, bool compress)
+{
+    this->directory = directory;
+    this->chunksize = chunksize;
+    this->depth = depth;
+    this->compress = compress;
+    std::filesystem::create_directories(directory);
+    saved = loaded = clock = 0;
+}
+
+static void unmap(RegionView *v)
+{
+#ifdef _WIN32
+    UnmapViewOfFile(v->data);
+    CloseHandle((HANDLE)v->handle);
+#else
+    munmap(v->data, v->end - v->start);
+#endif
+    delete v;
+}
+
+void ChunkStore::deinit()
+{
+    for (RegionFile *f : regions)
+    {
+        for (RegionView *v : f->views)
+            unmap(v);
+        if (f->fp)
+            fclose(f->fp);
+        delete f;
+    }
+    regions.clear();
+}
+
+// Closes f unless chunks still point into its views, returns false if they do. Takes the
+// lock held.
+bool ChunkStore::close(RegionFile *f)
+{
+    for (const RegionView *v : f->views)
+        if (v->refs)
+            return false;
+
+    for (RegionView *v : f->views)
+        unmap(v);
+    if (f->fp)
+        fclose(f->fp);
+    regions.erase(std::find(regions.begin(), regions.end(), f));
+    delete f;
+    return true;
+}
+
+// The region holding chunk coordinate p, opened if it is on disk. Its file is only created
+// once something is saved to it. Takes the lock held.
+RegionFile *ChunkStore::region(ivec3 p)
+{
+    ivec3 r = regionof(p);
+    for (RegionFile *f : regions)
+    {
+        if (f->coord == r)
+        {
+            f->used = ++clock;
+            return f;
+        }
+    }
+
+    // The index of a closed region is read again from its file, which has all that was saved
+    std::vector<RegionFile *> lru = regions;
+    std::sort(lru.begin(), lru.end(), [](const RegionFile *a, const RegionFile *b) { return a->used < b->used; });
+    for (size_t k = 0; k < lru.size() && regions.size() >= REGION_OPEN; ++k)
+        close(lru[k]);
+
+    std::string path = pathof(directory, r);
+    RegionFile *f = new RegionFile();
+    f->coord = r;
+    f->used = ++clock;
+    f->fp = fopen(path.c_str(), "r+b");
+    if (f->fp)
+    {
+        RegionHeader *h = &f->header;
+        if (fread(h, sizeof(*h), 1, f->fp) != 1 || memcmp(h->magic, "OCRG", 4) || h->version != REGION_VERSION
+            || h->twigbytes != sizeof(Octwig) || h->side != REGION_SIZE)
+            die("%s is not a region file of this build\n", path.c_str());
+        if (h->chunksize != chunksize || h->depth != depth)
+            die("%s has chunks of size %u and depth %u, not %u and %u\n", path.c_str(), h->chunksize, h->depth, chunksize, depth);
+    }
+    regions.push_back(f);
+    return f;
+}
+
+// The view with the record of e, mapping the end of the file again if the views so far do not
+// have it. Older views no chunk points into any more go then.
+RegionView *ChunkStore::view(RegionFile *f, const RegionEntry *e)
+{
+    for (RegionView *v : f->views)
+        if (v->start <= e->offset && e->offset + e->bytes <= v->end)
+            return v;
+
+    std::vector<RegionView *> live;
+    for (RegionView *v : f->views)
+    {
+        if (v->refs)
+            live.push_back(v);
+        else
+            unmap(v);
+    }
+    f->views.swap(live);
+
+    // Records are only ever appended, so the new view starts at the first one it needs
+    fflush(f->fp);
+    RegionView *v = new RegionView();
+    v->start = e->offset & ~(REGION_VIEW_ALIGN - 1);
+    v->end = f->header.end;
+    v->refs = 0;
+#ifdef _WIN32
+    HANDLE file = (HANDLE)_get_osfhandle(_fileno(f->fp));
+    HANDLE mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+    void *data = mapping ? MapViewOfFile(mapping, FILE_MAP_READ, (DWORD)(v->start >> 32), (DWORD)v->start, (SIZE_T)(v->end - v->start)) : NULL;
+    if (!data)
+        die("Could not map region %d %d %d: error %lu\n", f->coord.x, f->coord.y, f->coord.z, GetLastError());
+    v->handle = mapping;
+#else
+    void *data = mmap(NULL, v->end - v->start, PROT_READ, MAP_PRIVATE, fileno(f->fp), (off_t)v->start);
+    if (data == MAP_FAILED)
+        die("Could not map region %d %d %d: %s\n", f->coord.x, f->coord.y, f->coord.z, strerror(errno));
+    v->handle = nullptr;
+#endif
+    v->data = (char *)data;
+    f->views.push_back(v);
+    return v;
+}
+
+// Appends the roots of the chunk at chunk coordinate p to its region, as one record that
+// replaces the one it had unless replace is false. Returns false if that kept the old one,
+// once it returns true the new one is on the disk.
+bool ChunkStore::save(ivec3 p, const Ocroot *const *roots, uint32_t count, bool replace)
+{
+    // Dag offsets mean nothing in a file, so roots using the dag are saved as copies that own
+    // all of their nodes, which leaves out their garbage too. The codec walks the dag itself
+    // and writes no offsets, it needs no copy.
+    std::vector<Ocroot> copies(count);
+    std::vector<std::vector<uint8_t>> encoded(count);
+    std::vector<const Ocroot *> from(roots, roots + count);
+    std::vector<RegionRoot> head(count);
+    uint64_t bytes = align(count * sizeof(RegionRoot));
+    for (uint32_t k = 0; k < count; ++k)
+    {
+        const Ocroot *r = roots[k];
+        if (compress)
+        {
+            encode(r, &encoded[k]);
+            head[k] = { r->position, r->size, r->depth, r->sparse, bytes, 0, 0, 0, encoded[k].size() };
+            bytes += align(encoded[k].size());
+            continue;
+        }
+
+        if (!owned(r) || r->garbagetrees || r->garbagetwigs)
+        {
+            if (!r->sparse || !sparsify(r, &copies[k]))
+                densify(r, &copies[k]);
+            from[k] = r = &copies[k];
+        }
+
+        head[k] = { r->position, r->size, r->depth, r->sparse, 0, r->trees, 0, r->twigs, 0 };
+        head[k].tree = bytes;
+        bytes += align(r->trees * sizeof(Octree));
+        head[k].twig = bytes;
+        bytes += align(r->twigs * sizeof(Octwig));
+    }
+
+    bool written = false;
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        RegionFile *f = region(p);
+        RegionEntry *e = &f->header.index[slotof(p)];
+        if (replace || !e->bytes)
+        {
+            if (!f->fp)
+            {
+                std::string path = pathof(directory, f->coord);
+                f->fp = fopen(path.c_str(), "w+b");
+                if (!f->fp)
+                    die("fopen(\"%s\"): %s\n", path.c_str(), strerror(errno));
+                memcpy(f->header.magic, "OCRG", 4);
+                f->header.version = REGION_VERSION;
+                f->header.twigbytes = sizeof(Octwig);
+                f->header.side = REGION_SIZE;
+                f->header.chunksize = chunksize;
+                f->header.depth = depth;
+                f->header.end = align(sizeof(RegionHeader));
+                put(f->fp, &f->header, sizeof(RegionHeader));
+                syncdirectory(path.c_str());
+            }
+
+            uint64_t offset = f->header.end;
+            seek(f->fp, offset);
+            put(f->fp, head.data(), count * sizeof(RegionRoot));
+            for (uint32_t k = 0; k < count; ++k)
+            {
+                if (head[k].encoded)
+                {
+                    put(f->fp, encoded[k].data(), encoded[k].size());
+                    continue;
+                }
+                put(f->fp, from[k]->tree, from[k]->trees * sizeof(Octree));
+                put(f->fp, from[k]->twig, from[k]->twigs * sizeof(Octwig));
+            }
+
+            // The record is on the disk before anything points to it, and the entry pointing
+            // to it is before the caller lets go of the journaled edits it was saved with
+            syncfile(f->fp);
+            f->header.end = offset + bytes;
+            seek(f->fp, offsetof(RegionHeader, end));
+            fwrite(&f->header.end, sizeof(f->header.end), 1, f->fp);
+            *e = { offset, (uint32_t)bytes, count };
+            seek(f->fp, offsetof(RegionHeader, index) + slotof(p) * sizeof(RegionEntry));
+            fwrite(e, sizeof(*e), 1, f->fp);
+            syncfile(f->fp);
+            ++saved;
+            written = true;
+        }
+    }
+
+    for (uint32_t k = 0; k < count; ++k)
+        if (copies[k].tree)
+            copies[k].release();
+    return written;
+}
+
+// Points up to count roots at the record of the chunk at chunk coordinate p, returns how many
+// it has, none if it was never saved. Compressed roots are decoded into the arena instead.
+uint32_t ChunkStore::load(ivec3 p, Ocroot **roots, uint32_t count)
+{
+    RegionView *v;
+    char *record;
+    uint32_t bytes;
+    {
+        // Every root counts as pointing into the view until it is decoded, so that the view
+        // stays mapped while it is read
+        std::unique_lock<std::mutex> lock(mutex);
+        RegionFile *f = region(p);
+        RegionEntry e = f->header.index[slotof(p)];
+        if (!e.bytes)
+            return 0;
+        v = view(f, &e);
+        record = v->data + (e.offset - v->start);
+        bytes = e.bytes;
+        count = glm::min(count, e.roots);
+        v->refs += count;
+        ++loaded;
+    }
+
+#ifndef _WIN32
+    // Starts reading the pages in now rather than when the trees are first walked
+    uintptr_t page = (uintptr_t)record & ~(uintptr_t)(sysconf(_SC_PAGESIZE) - 1);
+    madvise((void *)page, (uintptr_t)record + bytes - page, MADV_WILLNEED);
+#endif
+
+    // The view stays mapped while roots point into it, the record is read without the lock
+    const RegionRoot *head = (const RegionRoot *)record;
+    for (uint32_t k = 0; k < count; ++k)
+    {
+        Ocroot *r = roots[k];
+        *r = Ocroot();
+        r->position = head[k].position;
+        r->size = head[k].size;
+        r->depth = head[k].depth;
+        r->sparse = head[k].sparse;
+        if (head[k].encoded)
+        {
+            if (!decode((const uint8_t *)record + head[k].tree, head[k].encoded, r))
+                die("The record of chunk %d %d %d is damaged\n", p.x, p.y, p.z);
+            --v->refs;
+            continue;
+        }
+        r->trees = r->treestoragesize = head[k].trees;
+        r->twigs = r->twigstoragesize = head[k].twigs;
+        r->tree = (Octree *)(record + head[k].tree);
+        r->twig = (Octwig *)(record + head[k].twig);
+        r->mapped = &v->refs;
+    }
+    return count;
+}
@@ -0,0 +1,101 @@
+#pragma once
+
+#ifndef CHUNKSTORE_H
+#define CHUNKSTORE_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <glm/vec3.hpp>
+#include "Octree.h"
+
+// Chunks are saved in region files of REGION_SIZE^3 chunks each
+#define REGION_SIZE 8
+#define REGION_VOLUME (REGION_SIZE * REGION_SIZE * REGION_SIZE)
+#define REGION_VERSION 3
+// Regions kept open at once, past this the least recently used one without live views is closed
+#define REGION_OPEN 16
+// Arrays in a region file start at multiples of this
+#define REGION_ALIGN 64
+// Views of a region file start at multiples of this, the allocation granularity of Windows
+#define REGION_VIEW_ALIGN ((uint64_t)1 << 16)
+
+// Where the record of a chunk is in its region file, it has none if bytes is 0
+struct RegionEntry
+{
+    uint64_t offset;
+    uint32_t bytes, roots;
+};
+
+// One root of a record, its arrays are at tree and twig bytes from the start of the record.
+// A root saved compressed instead has the encoded bytes of its arrays at tree (see Codec.h).
+struct RegionRoot
+{
+    glm::vec3 position;
+    float size;
+    uint32_t depth, sparse;
+    uint64_t tree, trees, twig, twigs;
+    uint64_t encoded;
+};
+
+// A region file starts with this, records are appended after it and never written over, so
+// that views of the file stay valid. An entry is only pointed at a record once it is written.
+struct RegionHeader
+{
+    char magic[4];
+    uint32_t version, twigbytes, side;
+    // Of the chunks, a build with other ones cannot load them
+    uint32_t chunksize, depth;
+    uint64_t end;
+    RegionEntry index[REGION_VOLUME];
+};
+
+// A read-only mapping of the bytes from start to end of a region file. Roots loaded from it
+// are counted in refs, it is unmapped once none are left and a newer view has what it has.
+struct RegionView
+{
+    uint64_t start, end;
+    char *data;
+    void *handle;
+    std::atomic<uint32_t> refs;
+};
+
+struct RegionFile
+{
+    glm::ivec3 coord;
+    FILE *fp;
+    RegionHeader header;
+    std::vector<RegionView *> views;
+    // When it was last looked up, the least recently used regions are closed first
+    uint64_t used;
+};
+
+// Chunks saved to disk, to be paged back in instead of generated again. Loading points the
+// roots straight at a view of the region file, so nothing is read or copied before the trees
+// are walked. A view is shared by every chunk loaded from it, edits copy the chunk out first
+// (see Ocroot::own). A store made to compress writes chunks in a fraction of the space but
+// decodes them into the arena as they are loaded. Every call may come from any thread.
+struct ChunkStore
+{
+    std::string directory;
+    std::mutex mutex;
+    // A world spans only a few regions, they are found by looking through them all
+    std::vector<RegionFile *> regions;
+    uint32_t chunksize, depth;
+    bool compress;
+    uint64_t saved, loaded, clock;
+
+    void init(const char *directory, uint32_t chunksize, uint32_t depth, bool compress = false);
+    void deinit();
+    bool save(glm::ivec3 p, const Ocroot *const *roots, uint32_t count, bool replace = true);
+    uint32_t load(glm::ivec3 p, Ocroot **roots, uint32_t count);
+
+    RegionFile *region(glm::ivec3 p);
+    RegionView *view(RegionFile *f, const RegionEntry *e);
+    bool close(RegionFile *f);
+};
+
+#endif
@@ -0,0 +1,347 @@
+#include <stddef.h>
+#include <string.h>
+#include <bit>
+#include "Codec.h"
+#include "Octree.h"
+
+// Streams of an encoding, each run-length coded on its own
+enum CodecStream
+{
+    CODEC_TYPES,    // 2 bits per node, 4 to a byte
+    CODEC_MASKS,    // The child mask of each branch of a sparse root
+    CODEC_LOW,      // Low bytes of the materials of leaves
+    CODEC_HIGH,     // High bytes of the materials of leaves
+    CODEC_TWIGS,    // Byte b of every twig, for each b in turn
+    CODEC_STREAMS,
+};
+
+// Counts are of what the streams decode to, bytes are the lengths of the coded streams
+struct CodecHeader
+{
+    char magic[4];
+    uint32_t sparse;
+    uint64_t nodes, leaves, twigs;
+    uint64_t bytes[CODEC_STREAMS];
+};
+
+// Twigs are coded without the padding at their end, which is never written
+static constexpr size_t TWIG_FIELDS = offsetof(Octwig, index) + sizeof(Octwig::index);
+
+static_assert(offsetof(Octwig, palette) == sizeof(Octwig::mask));
+static_assert(offsetof(Octwig, index) == offsetof(Octwig, palette) + sizeof(Octwig::palette));
+
+// A control byte c below 128 is followed by c + 1 bytes as they are, from 128 on by one byte
+// repeated c - 128 + RLE_MIN times
+#define RLE_MIN 3
+#define RLE_LITERALS 128
+#define RLE_REPEATS (128 + RLE_MIN - 1)
+// The most a coded byte expands to
+#define RLE_EXPANSION (RLE_REPEATS / 2 + 1)
+
+static void rle(const std::vector<uint8_t>& in, std::vector<uint8_t> *out)
+{
+    size_t n = in.size();
+    for (size_t i = 0; i < n; )
+    {
+        size_t run = 1;
+        while (i + run < n && run < RLE_REPEATS && in[i + run] == in[i])
+            ++run;
+        if (run >= RLE_MIN)
+        {
+            out->push_back((uint8_t)(128 + run - RLE_MIN));
+            out->push_back(in[i]);
+            i += run;
+            continue;
+        }
+
+        // Literals last until the next run worth repeating
+        size_t j = i;
+        while (j < n && j - i < RLE_LITERALS && !(j + 2 < n && in[j] == in[j + 1] && in[j] == in[j + 2]))
+            ++j;
+        out->push_back((uint8_t)(j - i - 1));
+        out->insert(out->end(), in.begin() + i, in.begin() + j);
+        i = j;
+    }
+}
+
+// Expands a coded stream a byte at a time, bad is set if it ends too soon
+struct RleReader
+{
+    const uint8_t *in, *end;
+    unsigned left;
+    bool literal;
+    uint8_t value;
+    bool bad;
+
+    void init(const uint8_t *in, uint64_t bytes)
+    {
+        this->in = in;
+        end = in + bytes;
+        left = 0;
+        bad = false;
+    }
+
+    uint8_t get()
+    {
+        if (!left)
+        {
+            if (in == end)
+                return fail();
+            uint8_t c = *in++;
+            literal = c < 128;
+            left = literal ? c + 1 : c - 128 + RLE_MIN;
+            if (!literal)
+            {
+                if (in == end)
+                    return fail();
+                value = *in++;
+            }
+        }
+        --left;
+        if (!literal)
+            return value;
+        if (in == end)
+            return fail();
+        return *in++;
+    }
+
+    uint8_t fail()
+    {
+        bad = true;
+        left = 0;
+        return 0;
+    }
+
+    bool done() const
+    {
+        return !bad && !left && in == end;
+    }
+};
+
+struct Encoder
+{
+    const Ocroot *root;
+    bool sparse;
+    uint64_t nodes, leaves, trees;
+    std::vector<uint8_t> stream[CODEC_STREAMS];
+    std::vector<const Octwig *> bricks;
+
+    void type(uint32_t t)
+    {
+        if (nodes++ % 4 == 0)
+            stream[CODEC_TYPES].push_back(0);
+        stream[CODEC_TYPES].back() |= t << ((nodes - 1) % 4 * 2);
+    }
+
+    // Visits the nodes in the order sparsify and densify copy them
+    void node(uint64_t f)
+    {
+        Octree t = root->node(f);
+        if (t.type() == TWIG)
+        {
+            type(TWIG);
+            bricks.push_back(root->brick(t));
+        }
+        else if (t.type() == LEAF)
+        {
+            assert(t.offset() <= UINT16_MAX);
+            type(LEAF);
+            stream[CODEC_LOW].push_back((uint8_t)t.offset());
+            stream[CODEC_HIGH].push_back((uint8_t)(t.offset() >> 8));
+            ++leaves;
+        }
+        else if (t.type() == EMPTY)
+        {
+            type(EMPTY);
+        }
+        else if (!sparse)
+        {
+            type(BRANCH);
+            trees += 8;
+            for (unsigned i = 0; i < 8; ++i)
+                node(root->child(f, i));
+        }
+        else
+        {
+            uint32_t mask = 0;
+            for (unsigned i = 0; i < 8; ++i)
+                if (root->node(root->child(f, i)).type() != EMPTY)
+                    mask |= 1 << i;
+            if (!mask)
+            {
+                type(EMPTY);
+                return;
+            }
+
+            type(BRANCH);
+            stream[CODEC_MASKS].push_back((uint8_t)mask);
+            trees += std::popcount(mask);
+            for (unsigned i = 0; i < 8; ++i)
+                if (mask & (1 << i))
+                    node(root->child(f, i));
+        }
+    }
+
+    void run(bool sparse)
+    {
+        this->sparse = sparse;
+        nodes = leaves = 0;
+        trees = sparse ? SPARSE_EMPTY + 1 : 1;
+        for (std::vector<uint8_t>& s : stream)
+            s.clear();
+        bricks.clear();
+        node(0);
+    }
+};
+
+void encode(const Ocroot *root, std::vector<uint8_t> *out)
+{
+    Encoder e;
+    e.root = root;
+    e.run(root->sparse);
+    // Like sparsify, fall back to all 8 children when the offsets would not fit
+    if (e.sparse && e.trees > (uint64_t)1 << SPARSE_OFFSET_BITS)
+        e.run(false);
+
+    std::vector<uint8_t>& planes = e.stream[CODEC_TWIGS];
+    planes.resize(e.bricks.size() * TWIG_FIELDS);
+    for (size_t i = 0; i < e.bricks.size(); ++i)
+    {
+        const uint8_t *b = (const uint8_t *)e.bricks[i];
+        for (size_t k = 0; k < TWIG_FIELDS; ++k)
+            planes[k * e.bricks.size() + i] = b[k];
+    }
+
+    CodecHeader h;
+    memcpy(h.magic, "OCZ1", 4);
+    h.sparse = e.sparse;
+    h.nodes = e.nodes;
+    h.leaves = e.leaves;
+    h.twigs = e.bricks.size();
+
+    size_t start = out->size();
+    out->resize(start + sizeof(h));
+    for (int s = 0; s < CODEC_STREAMS; ++s)
+    {
+        size_t before = out->size();
+        rle(e.stream[s], out);
+        h.bytes[s] = out->size() - before;
+    }
+    memcpy(out->data() + start, &h, sizeof(h));
+}
+
+struct Decoder
+{
+    Ocroot *root;
+    const CodecHeader *h;
+    RleReader stream[CODEC_STREAMS];
+    uint64_t nodes, trees;
+    uint8_t types;
+
+    // Reads the node for tree[t] and the subtree below it, false if the streams do not
+    // hold a tree that fits the header
+    bool node(uint64_t t, uint32_t level)
+    {
+        if (nodes == h->nodes || level > root->depth)
+            return false;
+        if (nodes++ % 4 == 0)
+            types = stream[CODEC_TYPES].get();
+        uint32_t type = (types >> ((nodes - 1) % 4 * 2)) & 3;
+
+        if (type == TWIG)
+        {
+            if (root->twigs == h->twigs)
+                return false;
+            root->tree[t] = Octree(TWIG, (uint32_t)root->twigs++);
+        }
+        else if (type == LEAF)
+        {
+            uint32_t low = stream[CODEC_LOW].get();
+            uint32_t high = stream[CODEC_HIGH].get();
+            root->tree[t] = Octree(LEAF, low | high << 8);
+        }
+        else if (type == EMPTY)
+        {
+            root->tree[t] = Octree(EMPTY, 0);
+        }
+        else
+        {
+            uint32_t mask = root->sparse ? stream[CODEC_MASKS].get() : 0xff;
+            unsigned n = std::popcount(mask);
+            uint64_t first = root->trees;
+            if (!mask || first + n > trees)
+                return false;
+            root->trees += n;
+            root->tree[t] = root->sparse ? Octree::sparse(mask, (uint32_t)first) : Octree(BRANCH, (uint32_t)first);
+            for (unsigned k = 0; k < n; ++k)
+                if (!node(first + k, level + 1))
+                    return false;
+        }
+        return true;
+    }
+};
+
+bool decode(const uint8_t *in, size_t size, Ocroot *root)
+{
+    if (size < sizeof(CodecHeader))
+        return false;
+    CodecHeader h;
+    memcpy(&h, in, sizeof(h));
+    if (memcmp(h.magic, "OCZ1", 4))
+        return false;
+
+    // Every count has to fit in what its stream can expand to, so that nothing absurd is
+    // reserved for a damaged file
+    uint64_t bytes = sizeof(h);
+    for (int s = 0; s < CODEC_STREAMS; ++s)
+    {
+        if (h.bytes[s] > size - bytes)
+            return false;
+        bytes += h.bytes[s];
+    }
+    // Offsets have to fit in branches and must not reach the dag bit
+    uint64_t trees = h.nodes + (h.sparse ? SPARSE_EMPTY : 0);
+    if (bytes != size || h.sparse > 1 || !h.nodes || h.twigs > DAG_SHARED
+        || trees > (h.sparse ? (uint64_t)1 << SPARSE_OFFSET_BITS : DAG_SHARED)
+        || (h.nodes + 3) / 4 > h.bytes[CODEC_TYPES] * RLE_EXPANSION
+        || h.leaves > h.bytes[CODEC_LOW] * RLE_EXPANSION
+        || h.twigs * TWIG_FIELDS > h.bytes[CODEC_TWIGS] * RLE_EXPANSION)
+        return false;
+
+    // The counts are exact, the storage is reserved once and filled in place
+    root->sparse = h.sparse;
+    root->reserve(trees, h.twigs);
+    root->trees = h.sparse ? SPARSE_EMPTY + 1 : 1;
+    root->twigs = 0;
+    if (h.sparse)
+        root->tree[SPARSE_EMPTY] = Octree(EMPTY, 0);
+
+    Decoder d;
+    d.root = root;
+    d.h = &h;
+    d.nodes = 0;
+    d.trees = trees;
+    const uint8_t *p = in + sizeof(h);
+    for (int s = 0; s < CODEC_STREAMS; ++s)
+    {
+        d.stream[s].init(p, h.bytes[s]);
+        p += h.bytes[s];
+    }
+
+    bool ok = d.node(0, 0) && root->trees == trees && root->twigs == h.twigs;
+    if (ok)
+    {
+        RleReader *planes = &d.stream[CODEC_TWIGS];
+        for (size_t k = 0; k < TWIG_FIELDS; ++k)
+            for (uint64_t i = 0; i < h.twigs; ++i)
+                ((uint8_t *)&root->twig[i])[k] = planes->get();
+        for (uint64_t i = 0; i < h.twigs; ++i)
+            memset((uint8_t *)&root->twig[i] + TWIG_FIELDS, 0, sizeof(Octwig) - TWIG_FIELDS);
+    }
+    for (const RleReader& s : d.stream)
+        ok = ok && s.done();
+
+    if (!ok)
+        root->abandon();
+    return ok;
+}
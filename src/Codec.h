@@ -0,0 +1,25 @@
+#pragma once
+
+#ifndef CODEC_H
+#define CODEC_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+struct Ocroot;
+
+// Compression of chunks for disk. The tree is written depth first as streams of node types,
+// child masks and leaf materials, and the twigs as planes of the same byte of every twig,
+// each stream run-length coded on its own. Offsets are not written at all: decode lays the
+// nodes out the way sparsify and densify do, as it reads them.
+//
+// Appends the encoding of root, which may refer to the dag, to out
+void encode(const Ocroot *root, std::vector<uint8_t> *out);
+
+// Decodes size bytes made by encode into storage reserved for root, which must already have
+// the position, size, depth and sparseness of the encoded root. Returns false, with root
+// left empty, if the bytes are not a whole encoding.
+bool decode(const uint8_t *in, size_t size, Ocroot *root);
+
+#endif
@@ -0,0 +1,266 @@
+#include <assert.h>
+#include <string.h>
+#include <glm/common.hpp>
+#include "Dag.h"
+
+Ocdag ocdag;
+
+static Octree word(uint32_t value)
+{
+    Octree t = Octree(EMPTY, 0);
+    t.value = value;
+    return t;
+}
+
+static size_t mix(size_t h, uint64_t v)
+{
+    return h ^ (v + 0x9e3779b97f4a7c15ull + (h << 6) + (h >> 2));
+}
+
+bool Ocdag::Group::operator==(const Group& g) const
+{
+    return !memcmp(word, g.word, sizeof(word));
+}
+
+size_t Ocdag::GroupHash::operator()(const Group& g) const
+{
+    size_t h = 0;
+    for (int i = 0; i < 8; ++i)
+        h = mix(h, g.word[i]);
+    return h;
+}
+
+size_t Ocdag::TwigHash::operator()(const Octwig& w) const
+{
+    size_t h = 0;
+    for (unsigned i = 0; i < Octwig::MASK_WORDS; ++i)
+        h = mix(h, w.mask[i]);
+    for (unsigned i = 0; i < Octwig::PALETTE; ++i)
+        h = mix(h, w.palette[i]);
+    for (unsigned i = 0; i < Octwig::INDEX_WORDS; ++i)
+        h = mix(h, w.index[i]);
+    return h;
+}
+
+// Fields one by one, the padding of small bricks is never written
+bool Ocdag::TwigEqual::operator()(const Octwig& a, const Octwig& b) const
+{
+    return !memcmp(a.mask, b.mask, sizeof(a.mask)) 
+        && !memcmp(a.palette, b.palette, sizeof(a.palette)) 
+        && !memcmp(a.index, b.index, sizeof(a.index));
+}
+
+void Ocdag::init()
+{
+    store.position = glm::vec3(0);
+    store.size = 0;
+    store.depth = 0;
+    store.sparse = false;
+    store.reserve(16, 16);
+    store.trees = 0;
+    store.twigs = 0;
+    dtree = dtwig = Ocdelta();
+}
+
+void Ocdag::deinit()
+{
+    store.release();
+    groups.clear();
+    twigs.clear();
+    grouprefs.clear();
+    twigrefs.clear();
+    freegroups.clear();
+    freetwigs.clear();
+    dtree = dtwig = Ocdelta();
+}
+
+// Replaces the nodes of root by dag nodes, leaving the chunk with only its top word
+void Ocdag::intern(Ocroot *root)
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    Octree t = share(root, 0);
+    // Mapped storage is only ever read, the top word goes to storage of the chunk's own
+    if (root->mapped)
+    {
+        root->abandon();
+        root->reserve(SPARSE_EMPTY + 1, 0);
+        root->tree[SPARSE_EMPTY] = Octree(EMPTY, 0);
+    }
+    root->tree[0] = t;
+    root->trees = root->sparse ? SPARSE_EMPTY + 1 : 1;
+    root->twigs = 0;
+    root->garbagetrees = root->garbagetwigs = 0;
+    root->shrink();
+}
+
+// Gives back the references the subtree at offset of root holds
+void Ocdag::drop(const Ocroot *root, uint64_t offset)
+{
+    if (root == &store || !root->trees)
+        return;
+
+    std::unique_lock<std::mutex> lock(mutex);
+    unrefall(root, offset);
+}
+
+// The contents of t were copied into a chunk, which now refers to the children instead
+void Ocdag::unshare(Octree t)
+{
+    assert(t.shared());
+    std::unique_lock<std::mutex> lock(mutex);
+    if (t.type() == BRANCH)
+    {
+        uint64_t o = t.offset() & ~(uint64_t)DAG_SHARED;
+        for (int i = 0; i < 8; ++i)
+            if (store.tree[o + i].shared())
+                ref(store.tree[o + i]);
+    }
+    unref(t);
+}
+
+// Returns the dag node equal to the node at offset of root, which is left as garbage. The
+// references its shared nodes hold move over to the dag.
+Octree Ocdag::share(const Ocroot *root, uint64_t offset)
+{
+    Octree t = root->node(offset);
+    if (t.type() == EMPTY || t.type() == LEAF || t.shared())
+        return t;
+    if (t.type() == TWIG)
+        return addtwig(root->twig[t.offset()]);
+
+    Group g;
+    bool same = true;
+    for (unsigned i = 0; i < 8; ++i)
+    {
+        g.word[i] = share(root, root->child(offset, i)).value;
+        same = same && g.word[i] == g.word[0];
+    }
+
+    // Branches of one leaf material are no different from the leaf
+    if (same && word(g.word[0]).type() <= LEAF)
+        return word(g.word[0]);
+
+    return addgroup(g);
+}
+
+Octree Ocdag::addgroup(const Group& g)
+{
+    using glm::min;
+    using glm::max;
+
+    auto it = groups.find(g);
+    if (it != groups.end())
+    {
+        // The group found already holds a reference to each of the same children
+        ++grouprefs[it->second / 8];
+        for (int i = 0; i < 8; ++i)
+            if (word(g.word[i]).shared())
+                unref(word(g.word[i]));
+        return Octree(BRANCH, DAG_SHARED | it->second);
+    }
+
+    uint32_t o;
+    if (!freegroups.empty())
+    {
+        o = freegroups.back();
+        freegroups.pop_back();
+    }
+    else
+    {
+        if (store.growtrees(8))
+            dtree.realloc = true;
+        o = (uint32_t)store.trees;
+        store.trees += 8;
+        grouprefs.push_back(0);
+    }
+    assert(o < DAG_SHARED);
+
+    memcpy(&store.tree[o], g.word, sizeof(g.word));
+    grouprefs[o / 8] = 1;
+    groups.emplace(g, o);
+    dtree.left = min(dtree.left, (size_t)o);
+    dtree.right = max(dtree.right, (size_t)o + 8);
+    return Octree(BRANCH, DAG_SHARED | o);
+}
+
+Octree Ocdag::addtwig(const Octwig& w)
+{
+    using glm::min;
+    using glm::max;
+
+    auto it = twigs.find(w);
+    if (it != twigs.end())
+    {
+        ++twigrefs[it->second];
+        return Octree(TWIG, DAG_SHARED | it->second);
+    }
+
+    uint32_t o;
+    if (!freetwigs.empty())
+    {
+        o = freetwigs.back();
+        freetwigs.pop_back();
+    }
+    else
+    {
+        if (store.growtwigs(1))
+            dtwig.realloc = true;
+        o = (uint32_t)store.twigs++;
+        twigrefs.push_back(0);
+    }
+    assert(o < DAG_SHARED);
+
+    store.twig[o] = w;
+    twigrefs[o] = 1;
+    twigs.emplace(w, o);
+    dtwig.left = min(dtwig.left, (size_t)o);
+    dtwig.right = max(dtwig.right, (size_t)o + 1);
+    return Octree(TWIG, DAG_SHARED | o);
+}
+
+void Ocdag::ref(Octree t)
+{
+    assert(t.shared());
+    uint32_t o = (uint32_t)(t.offset() & ~(uint64_t)DAG_SHARED);
+    if (t.type() == TWIG)
+        ++twigrefs[o];
+    else
+        ++grouprefs[o / 8];
+}
+
+void Ocdag::unref(Octree t)
+{
+    assert(t.shared());
+    uint32_t o = (uint32_t)(t.offset() & ~(uint64_t)DAG_SHARED);
+    if (t.type() == TWIG)
+    {
+        assert(twigrefs[o] > 0);
+        if (--twigrefs[o])
+            return;
+        twigs.erase(store.twig[o]);
+        freetwigs.push_back(o);
+        return;
+    }
+
+    assert(grouprefs[o / 8] > 0);
+    if (--grouprefs[o / 8])
+        return;
+
+    Group g;
+    memcpy(g.word, &store.tree[o], sizeof(g.word));
+    groups.erase(g);
+    freegroups.push_back(o);
+    for (int i = 0; i < 8; ++i)
+        if (word(g.word[i]).shared())
+            unref(word(g.word[i]));
+}
+
+void Ocdag::unrefall(const Ocroot *root, uint64_t offset)
+{
+    Octree t = root->tree[offset];
+    if (t.shared())
+        unref(t);
+    else if (t.type() == BRANCH)
+        for (unsigned i = 0; i < 8; ++i)
+            unrefall(root, root->child(offset, i));
+}
@@ -0,0 +1,57 @@
+#pragma once
+
+#ifndef DAG_H
+#define DAG_H
+
+#include <stdint.h>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+#include "Octree.h"
+
+// Subtrees shared by all chunks. Interning a chunk replaces each of its branches and twigs
+// by a reference to an identical one in the dag, adding it first if there is none, so that
+// terrain that repeats is stored once however many chunks have it. Dag nodes never change:
+// edits copy the path they go down back into the chunk (see ownbranch), and a node goes on
+// a free list once nothing refers to it anymore.
+struct Ocdag
+{
+    struct Group
+    {
+        uint32_t word[8];
+
+        bool operator==(const Group& g) const;
+    };
+
+    struct GroupHash { size_t operator()(const Group& g) const; };
+    struct TwigHash { size_t operator()(const Octwig& w) const; };
+    struct TwigEqual { bool operator()(const Octwig& a, const Octwig& b) const; };
+
+    std::mutex mutex;
+    // Branches are groups of 8 words at multiples of 8, with the references of each group and
+    // each twig counted from chunks and from the groups above
+    Ocroot store;
+    std::unordered_map<Group, uint32_t, GroupHash> groups;
+    std::unordered_map<Octwig, uint32_t, TwigHash, TwigEqual> twigs;
+    std::vector<uint32_t> grouprefs, twigrefs;
+    std::vector<uint32_t> freegroups, freetwigs;
+    // Changes to the store since the last upload
+    Ocdelta dtree, dtwig;
+
+    void init();
+    void deinit();
+    void intern(Ocroot *root);
+    void drop(const Ocroot *root, uint64_t offset = 0);
+    void unshare(Octree t);
+
+    Octree share(const Ocroot *root, uint64_t offset);
+    Octree addgroup(const Group& g);
+    Octree addtwig(const Octwig& w);
+    void ref(Octree t);
+    void unref(Octree t);
+    void unrefall(const Ocroot *root, uint64_t offset);
+};
+
+extern Ocdag ocdag;
+
+#endif
@@ -68,16 +68,8 @@ void print(const BoundsPyramid *pyr)
     printf("Size: %d\n", (int)pyr->size);
     printf("Levels: %d\n", (int)pyr->levels);
 
-    size_t m = pyr->size * pyr->size * sizeof(float);
-    size_t s = pyr->size / 2;
-    while (s > 0)
-    {
-        m += 2 * s * s * sizeof(float);
-        s /= 2;
-    }
-
     S("Memory: ");
-    printsize(m);
+    printsize(pyr->bytes());
     C('\n');
 
     /*
@@ -111,7 +103,7 @@ static void printTree(const Ocroot *r, uint32_t t)
     if (tp == BRANCH)
     {
         for (int i = 0; i < 8; ++i)
-            printTree(r, (uint32_t)r->tree[t].offset() + i);
+            printTree(r, (uint32_t)r->child(t, i));
     }
 }
 */
@@ -123,9 +115,9 @@ void popMM(MinMax *mm, const Ocroot *root, uint32_t index, int depth)
     if (mm[depth].min == (uint32_t)~0 || mm[depth].min > index) mm[depth].min = index;
     if (mm[depth].max == (uint32_t)~0 || mm[depth].max < index) mm[depth].max = index;
 
-    if (root->tree[index].type() == BRANCH)
+    if (root->node(index).type() == BRANCH)
         for (uint32_t i = 0; i < 8; ++i)
-            popMM(mm, root, (uint32_t)root->tree[index].offset() + i, depth+1);
+            popMM(mm, root, (uint32_t)root->child(index, i), depth+1);
 }
 
 void print(const Ocroot *root)
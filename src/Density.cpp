@@ -0,0 +1,90 @@
+#include <math.h>
+#include <float.h>
+#include <glm/common.hpp>
+#include "Density.h"
+#include "BoundsPyramid.h"
+#include "Noise.h"
+#include "Octree.h"
+
+using glm::vec3;
+
+// Height below the surface, in units, at which the heightfield alone outweighs the noise
+#define SURFACE_FALLOFF 8.0f
+#define OVERHANG_FREQUENCY (1.0f / 16.0f)
+// Tunnels run where two cave noises are both close to 0, the second one is the first moved
+// far away
+#define CAVE_FREQUENCY (1.0f / 24.0f)
+#define CAVE_OFFSET 1000.5f
+#define CAVE_WIDTH 0.06f
+#define CAVE_STEEPNESS 4.0f
+
+static Interval noisebound(vec3 bmin, float size, float frequency, float offset = 0)
+{
+    Interval n;
+    vec3 q = bmin * frequency + offset;
+    valuenoisebound(q.x, q.y, q.z, size * frequency, &n.lo, &n.hi);
+    return n;
+}
+
+// The bound of |n|, which is smallest where n is closest to 0
+static Interval absbound(Interval n)
+{
+    float nearest = n.lo > 0 ? n.lo : n.hi < 0 ? -n.hi : 0.0f;
+    return { nearest, glm::max(fabsf(n.lo), fabsf(n.hi)) };
+}
+
+static float tunnel(float a, float b)
+{
+    return (glm::max(a, b) - CAVE_WIDTH) * CAVE_STEEPNESS;
+}
+
+Density caves(const BoundsPyramid *pyr, vec3 origin, float size)
+{
+    Density f;
+
+    f.sample = [=](vec3 p) {
+        vec3 u = (p - origin) / size;
+        float h = pyr->max(u.x, u.z, pyr->levels);
+        vec3 o = p * OVERHANG_FREQUENCY;
+        float surface = (h - p.y) / SURFACE_FALLOFF + valuenoise(o.x, o.y, o.z);
+        if (surface <= 0)
+            return surface;
+
+        vec3 c = p * CAVE_FREQUENCY, d = c + CAVE_OFFSET;
+        return glm::min(surface, tunnel(fabsf(valuenoise(c.x, c.y, c.z)), fabsf(valuenoise(d.x, d.y, d.z))));
+    };
+
+    f.bound = [=](vec3 bmin, float s) {
+        // The pyramid level whose quadrants are the size of the cell, which bound its heights
+        size_t lv = glm::min((size_t)roundf(log2f(size / s)), pyr->levels);
+        vec3 u = (bmin - origin) / size;
+        float low = pyr->min(u.x, u.z, lv), high = pyr->max(u.x, u.z, lv);
+
+        // Above the surface and its overhangs there is nothing to look for
+        Interval surface = { (low - bmin.y - s) / SURFACE_FALLOFF - 1.0f, (high - bmin.y) / SURFACE_FALLOFF + 1.0f };
+        if (surface.hi <= 0)
+            return surface;
+        Interval n = noisebound(bmin, s, OVERHANG_FREQUENCY);
+        surface.lo = (low - bmin.y - s) / SURFACE_FALLOFF + n.lo;
+        surface.hi = (high - bmin.y) / SURFACE_FALLOFF + n.hi;
+        if (surface.hi <= 0)
+            return surface;
+
+        Interval a = absbound(noisebound(bmin, s, CAVE_FREQUENCY));
+        Interval b = absbound(noisebound(bmin, s, CAVE_FREQUENCY, CAVE_OFFSET));
+        return Interval { glm::min(surface.lo, tunnel(a.lo, b.lo)), glm::min(surface.hi, tunnel(a.hi, b.hi)) };
+    };
+
+    f.material = [=](vec3 p) {
+        return heightMaterial((p.y - origin.y) / size);
+    };
+
+    return f;
+}
+
+Density bruteforce(const Density& f)
+{
+    Density g = f;
+    g.bound = [](vec3, float) { return Interval { -FLT_MAX, FLT_MAX }; };
+    return g;
+}
@@ -0,0 +1,35 @@
+#pragma once
+
+#ifndef DENSITY_H
+#define DENSITY_H
+
+#include <stdint.h>
+#include <functional>
+#include <glm/vec3.hpp>
+
+struct BoundsPyramid;
+
+struct Interval
+{
+    float lo, hi;
+};
+
+// Terrain as a density over world space, solid where it is positive. bound gives an interval
+// holding the density everywhere in the cube at bmin, which lets growdensity decide whole
+// cells without sampling them, and material the material of solid ground at a point.
+// Materials must not change more than TWIG_PALETTE times across a twig.
+struct Density
+{
+    std::function<float(glm::vec3 p)> sample;
+    std::function<Interval(glm::vec3 bmin, float size)> bound;
+    std::function<uint16_t(glm::vec3 p)> material;
+};
+
+// The heightfield of pyr, for the chunk column at origin with the given size, carved by 3D
+// noise into overhangs near the surface and caves below it
+Density caves(const BoundsPyramid *pyr, glm::vec3 origin, float size);
+
+// The same density with a bound that never decides anything, so every voxel gets sampled
+Density bruteforce(const Density& f);
+
+#endif
@@ -0,0 +1,79 @@
+#include <assert.h>
+#include "Jobs.h"
+
+void JobPool::init(unsigned int threads)
+{
+    if (threads == 0)
+        threads = std::thread::hardware_concurrency();
+    if (threads == 0)
+        threads = 1;
+
+    quit = false;
+    busy = 0;
+    for (unsigned int i = 0; i < threads; ++i)
+        worker.emplace_back([this]() { work(); });
+}
+
+void JobPool::deinit()
+{
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        quit = true;
+    }
+    wake.notify_all();
+
+    for (auto& t : worker)
+        t.join();
+    worker.clear();
+
+    assert(queue.empty());
+}
+
+void JobPool::submit(Job job)
+{
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        queue.push_back(std::move(job));
+    }
+    wake.notify_one();
+}
+
+// Runs the next job in the queue with the lock released, returns false if there was none
+bool JobPool::step(std::unique_lock<std::mutex>& lock)
+{
+    if (queue.empty())
+        return false;
+
+    Job job = std::move(queue.front());
+    queue.pop_front();
+    ++busy;
+
+    lock.unlock();
+    job();
+    lock.lock();
+
+    if (--busy == 0 && queue.empty())
+        idle.notify_all();
+    return true;
+}
+
+void JobPool::wait()
+{
+    // The waiting thread helps out instead of sleeping while there is work left
+    std::unique_lock<std::mutex> lock(mutex);
+    while (step(lock))
+        ;
+    idle.wait(lock, [this]() { return queue.empty() && busy == 0; });
+}
+
+void JobPool::work()
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    for ( ; ; )
+    {
+        wake.wait(lock, [this]() { return quit || !queue.empty(); });
+        if (quit && queue.empty())
+            return;
+        step(lock);
+    }
+}
@@ -0,0 +1,34 @@
+#pragma once
+
+#ifndef JOBS_H
+#define JOBS_H
+
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <functional>
+#include <condition_variable>
+
+// A fixed set of worker threads pulling jobs from a shared FIFO queue.
+// Jobs must not touch any GL state, that is left to the thread owning the context.
+struct JobPool
+{
+    using Job = std::function<void()>;
+
+    std::vector<std::thread> worker;
+    std::deque<Job> queue;
+    std::mutex mutex;
+    std::condition_variable wake, idle;
+    size_t busy = 0;
+    bool quit = false;
+
+    void init(unsigned int threads = 0);
+    void deinit();
+    void submit(Job job);
+    void wait();
+    void work();
+    bool step(std::unique_lock<std::mutex>& lock);
+};
+
+#endif
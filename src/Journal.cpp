@@ -0,0 +1,112 @@
+#include <errno.h>
+#include <stddef.h>
+#include <string.h>
+#include <filesystem>
+#include "Journal.h"
+#include "Octree.h"
+
+void apply(Ocroot *root, const JournalEdit *e, Ocdelta *tree, Ocdelta *twig)
+{
+    switch (e->op)
+    {
+    case EDIT_DESTROY: root->destroy(e->cmin, e->cmax, tree, twig); break;
+    case EDIT_BUILD: root->build(e->cmin, e->cmax, e->material, tree, twig); break;
+    case EDIT_REPLACE: root->replace(e->cmin, e->cmax, e->material, tree, twig); break;
+    default: assert(false);
+    }
+}
+
+static uint32_t checksum(const JournalEdit *e)
+{
+    // FNV-1a over everything but the check itself
+    uint32_t h = 0x811c9dc5u;
+    const unsigned char *b = (const unsigned char *)e;
+    for (size_t i = 0; i < offsetof(JournalEdit, check); ++i)
+        h = (h ^ b[i]) * 0x01000193u;
+    return h;
+}
+
+// Opens the journal at path, reading the edits it has into edits. A torn record ends it,
+// whatever follows was never synced and is dropped.
+void EditJournal::init(const char *path, std::vector<JournalEdit> *edits)
+{
+    this->path = path;
+    edits->clear();
+
+    if (FILE *in = fopen(path, "rb"))
+    {
+        JournalEdit e;
+        while (fread(&e, sizeof(e), 1, in) == 1 && e.check == checksum(&e))
+            edits->push_back(e);
+        fclose(in);
+    }
+
+    fp = fopen(path, "ab");
+    if (!fp)
+        die("fopen(\"%s\"): %s\n", path, strerror(errno));
+    bytes = edits->size() * sizeof(JournalEdit);
+    dirty = false;
+    since.start();
+    if (std::filesystem::file_size(path) != bytes)
+        rewrite(*edits);
+}
+
+void EditJournal::deinit()
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    syncfile(fp);
+    fclose(fp);
+}
+
+void EditJournal::append(JournalEdit e)
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    e.check = checksum(&e);
+    if (fwrite(&e, sizeof(e), 1, fp) != 1)
+        die("Could not write to %s: %s\n", path.c_str(), strerror(errno));
+    bytes += sizeof(e);
+    dirty = true;
+}
+
+// Makes the edits appended so far durable, at most once every ms milliseconds
+void EditJournal::sync(double ms)
+{
+    // Held while syncing, so that an edit appended meanwhile leaves the journal dirty
+    std::unique_lock<std::mutex> lock(mutex);
+    if (!dirty || since.elapsed() * 1e3 < ms)
+        return;
+    syncfile(fp);
+    dirty = false;
+    since.start();
+}
+
+// Replaces the journal by one holding only edits. The new one is complete on disk before it
+// takes the place of the old one, and the rename is before it returns, a crash leaves either
+// of them.
+void EditJournal::rewrite(const std::vector<JournalEdit>& edits)
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    fclose(fp);
+    std::string next = path + ".next";
+    FILE *out = fopen(next.c_str(), "wb");
+    if (!out)
+        die("fopen(\"%s\"): %s\n", next.c_str(), strerror(errno));
+    for (JournalEdit e : edits)
+    {
+        e.check = checksum(&e);
+        if (fwrite(&e, sizeof(e), 1, out) != 1)
+            die("Could not write to %s: %s\n", next.c_str(), strerror(errno));
+    }
+    syncfile(out);
+    if (fclose(out))
+        die("Could not write to %s: %s\n", next.c_str(), strerror(errno));
+    std::filesystem::rename(next, path);
+    syncdirectory(path.c_str());
+
+    fp = fopen(path.c_str(), "ab");
+    if (!fp)
+        die("fopen(\"%s\"): %s\n", path.c_str(), strerror(errno));
+    bytes = edits.size() * sizeof(JournalEdit);
+    dirty = false;
+    since.start();
+}
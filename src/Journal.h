@@ -0,0 +1,60 @@
+#pragma once
+
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <glm/vec3.hpp>
+#include "Util.h"
+
+struct Ocroot;
+struct Ocdelta;
+
+enum EditOp
+{
+    EDIT_DESTROY = 0,
+    EDIT_BUILD   = 1,
+    EDIT_REPLACE = 2,
+};
+
+// One edit of one chunk: the box it covered, given to Ocroot::destroy, build or replace.
+// check lets a record torn by a crash be told apart from a whole one.
+struct JournalEdit
+{
+    glm::ivec3 chunk;
+    glm::vec3 cmin, cmax;
+    uint16_t material;
+    uint16_t op;
+    uint32_t check;
+};
+
+static_assert(sizeof(JournalEdit) == 44);
+
+// Makes the edit e of root
+void apply(Ocroot *root, const JournalEdit *e, Ocdelta *tree, Ocdelta *twig);
+
+// Edits appended to a file as they are made, so that keeping one costs the same whatever the
+// size of the chunk. Appends go out to the disk a batch at a time in sync, and rewrite starts
+// the file over once the edits in it were saved with their chunks. Streaming workers sync it
+// while the thread owning the world appends to it, every call takes the journal's lock.
+struct EditJournal
+{
+    std::string path;
+    std::mutex mutex;
+    FILE *fp;
+    size_t bytes;
+    bool dirty;
+    Counter since;
+
+    void init(const char *path, std::vector<JournalEdit> *edits);
+    void deinit();
+    void append(JournalEdit e);
+    void sync(double ms);
+    void rewrite(const std::vector<JournalEdit>& edits);
+};
+
+#endif
@@ -1,5 +1,6 @@
 #include <time.h>
 #include <stdlib.h>
+#include <string.h>
 #include <vector>
 #include <algorithm>
 #include <GL/glew.h>
@@ -28,6 +29,10 @@
 #include "Skybox.h"
 #include "Light.h"
 #include "Camera.h"
+#include "Benchmark.h"
+#include "Render.h"
+#include "Query.h"
+#include "Stats.h"
 
 #define FAR 8192.f
 #define NEAR 0.125f
@@ -47,6 +52,7 @@ Input input;
 ImagCube imag;
 Text text;
 World world;
+QueryService queries;
 GBuffer gbuffer;
 Counter sw;
 PerspectiveCamera camera;
@@ -57,7 +63,7 @@ bool cursor = false;
 using glm::mat4;
 using glm::vec3;
 
-void computeTarget(const World *world);
+void computeTarget();
 void showInfoText(Counter &frame, int culled);
 // void computeMVP(mat4 *p, mat4 *v);
 void initialize();
@@ -65,10 +71,39 @@ void deinitialize();
 void initializeControls();
 void glCallback(GLenum source, GLenum type, GLuint id, GLenum severity, GLsizei length, const GLchar *message, const void *argp);
 
-int main() 
+int main(int argc, char **argv) 
 {
     using glm::vec3;
 
+    if (argc > 1 && !strcmp(argv[1], "bench"))
+        return benchmark(argc - 2, argv + 2);
+    if (argc > 1 && !strcmp(argv[1], "render"))
+        return render(argc - 2, argv + 2);
+
+    // Chunks and the edit journal go to the save directory, nothing is kept without one
+    const char *save = "save";
+    bool caves = false;
+    for (int a = 1; a < argc; ++a)
+    {
+        if (!strcmp(argv[a], "--caves"))
+        {
+            caves = true;
+        }
+        else if (!strcmp(argv[a], "--save") && a + 1 < argc)
+        {
+            save = argv[++a];
+        }
+        else if (!strcmp(argv[a], "--no-save"))
+        {
+            save = nullptr;
+        }
+        else
+        {
+            fprintf(stderr, "usage: octree [--caves] [--save <directory> | --no-save] | bench ... | render ...\n");
+            return 1;
+        }
+    }
+
     initialize();
 
     initializeControls();
@@ -77,8 +112,9 @@ int main()
 
     imag.init(glm::vec3(3.0, 1.0, 0.5));
 
-    world.init(4, 4, 4, 128);
+    world.init(4, 4, 4, 128, caves, save);
     world.load_gpu();
+    queries.init(&world);
 
     gbuffer.init(width, height);
 
@@ -153,9 +189,8 @@ int main()
     dcamera.height = height;
     dcamera.up = vec3(0, 1, 0);
 
-    WorldShaderContext world_shadow = WorldShaderContext(Shader(glCreateProgram())
-        .vertex("shaders/ShadowmapWorld.Vertex.glsl")
-        .include("shaders/Chunkmarch.glsl")
+    WorldShaderContext world_shadow = WorldShaderContext(includeChunkmarch(Shader(glCreateProgram())
+        .vertex("shaders/ShadowmapWorld.Vertex.glsl"))
         .fragment("shaders/ShadowmapWorld.Fragment.glsl")
         .link());
     world_shadow.bind_ul();
@@ -170,6 +205,10 @@ int main()
         dcamera.direction = directionalLight.direction;
 
         input.poll();
+        world.follow(&camera);
+        world.compact();
+        world.upload();
+        queries.update(&world);
 
         mat4 p = camera.proj();
         mat4 v = camera.view();
@@ -226,7 +265,7 @@ int main()
 
         skybox.draw(v, p);
 
-        computeTarget(&world);
+        computeTarget();
         if (imag.real) 
             imag.draw(mvp);
 
@@ -252,6 +291,8 @@ int main()
     shadowmap.release();
     pointLightContext.release();
     skybox.release();
+    world.unload_gpu();
+    queries.deinit();
     world.deinit();
     gbuffer.deinit();
     imag.deinit();
@@ -274,6 +315,8 @@ void showInfoText(Counter &frame, int culled)
     text.printf("speed: %f", speed);
     text.printf("grid size: %dx%dx%d = %d", world.width, world.height, world.depth, world.volume);
     text.printf("culled/trees: %d/%d = %f%%", culled, world.volume, (float)culled * 100 / world.volume);
+    text.printf("streaming: %u pending, %u dispatched, %u generated, %u uploaded", world.streamstats.pending,
+        world.streamstats.dispatched, world.streamstats.generated, world.streamstats.uploaded);
     {
         using std::string;
         using std::to_string;
@@ -311,60 +354,31 @@ void showInfoText(Counter &frame, int culled)
     }
 }
 
-void computeTarget(const World *w)
+void computeTarget()
 {
-    vec3 sigma = vec3(0);
-    imag.real = chunkmarch(camera.position, camera.direction, w, &sigma);
-    imag.position(sigma);
-}
-
-template <typename F>
-void modify(const ImagCube *imag, World *world, F f)
-{
-    using glm::ivec3;
-
-    if (!imag->real) return;
-
-    for (int i = 0; i < 8; ++i)
-    {
-        vec3 p = imag->bmin + vec3(glm::bvec3(i & 4, i & 2, i & 1)) * imag->scale;
-        ivec3 q = world->index_float(p);
-        int j = world->index(q.x, q.y, q.z);
-
-        if (!isInsideCube(p, world->chunk[j].position, world->chunk[j].position + (float)world->chunksize)) continue;
-
-        f(j);
-    }
+    RayQuery ray = { camera.position, camera.direction, INFINITY };
+    RayHit hit;
+    queries.cast(&ray, &hit);
+    imag.real = hit.hit;
+    imag.position(hit.point);
 }
 
 void destroy()
 {
-    auto dd = [&](int i) { 
-        Ocdelta deltatree, deltatwig;
-        world.chunk[i].destroy(imag.bmin, imag.bmin + imag.scale, &deltatree, &deltatwig);
-        world.modify(i, &deltatree, &deltatwig);
-    };
-    modify(&imag, &world, dd);
+    if (imag.real)
+        world.edit(EDIT_DESTROY, imag.bmin, imag.bmin + imag.scale, 0);
 }
 
 void build()
 {
-    auto db = [&](int i) { 
-        Ocdelta deltatree, deltatwig;
-        world.chunk[i].build(imag.bmin, imag.bmin + imag.scale, 5, &deltatree, &deltatwig);
-        world.modify(i, &deltatree, &deltatwig);
-    };
-    modify(&imag, &world, db);
+    if (imag.real)
+        world.edit(EDIT_BUILD, imag.bmin, imag.bmin + imag.scale, 5);
 }
 
 void replace()
 {
-    auto dr = [&](int i) { 
-        Ocdelta deltatree, deltatwig;
-        world.chunk[i].replace(imag.bmin, imag.bmin + imag.scale, 5, &deltatree, &deltatwig);
-        world.modify(i, &deltatree, &deltatwig);
-    };
-    modify(&imag, &world, dr);
+    if (imag.real)
+        world.edit(EDIT_REPLACE, imag.bmin, imag.bmin + imag.scale, 5);
 }
 
 void initialize()
@@ -442,16 +456,18 @@ void initializeControls()
         int i = world.index(ip.x, ip.y, ip.z);
         Ocroot r = world.chunk[i].lodmm();
         print(&r);
+        world.chunk[i].release();
         world.chunk[i] = r;
         Ocdelta tree(true), twig(true);
         world.modify(i, &tree, &twig);
     });
-    input.bindKey('1', [&]() { world.shift(glm::ivec3(1, 0, 0)); });
-    input.bindKey('2', [&]() { world.shift(glm::ivec3(-1, 0, 0)); });
-    input.bindKey('3', [&]() { world.shift(glm::ivec3(0, 1, 0)); });
-    input.bindKey('4', [&]() { world.shift(glm::ivec3(0, -1, 0)); });
-    input.bindKey('5', [&]() { world.shift(glm::ivec3(0, 0, 1)); });
-    input.bindKey('6', [&]() { world.shift(glm::ivec3(0, 0, -1)); });
+    input.bindKey('i', [&]() {
+        FILE *f = fopen("stats.json", "w");
+        if (!f)
+            return;
+        writejson(f, &world);
+        fclose(f);
+    });
     input.bindKey(SDLK_SPACE, [&]() { camera.position += glm::vec3(0.f, 1.f, 0.f) * speed; });
     input.bindKey(SDLK_LSHIFT, [&]() { camera.position -= glm::vec3(0.f, 1.f, 0.f) * speed; });
     input.bindKey(SDLK_ESCAPE, [&]() { running = false; });
@@ -0,0 +1,249 @@
+#include <math.h>
+#include <stdint.h>
+#include <algorithm>
+#include "Noise.h"
+
+#if defined(__AVX__)
+# include <immintrin.h>
+# define NOISE_AVX
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+# include <emmintrin.h>
+# ifdef __SSE4_1__
+#  include <smmintrin.h>
+# endif
+# define NOISE_SSE2
+#endif
+
+// The kernel is written once against these, each lane is one point
+struct Scalar
+{
+    using V = float;
+    static constexpr size_t WIDTH = 1;
+
+    static V load(const float *p) { return *p; }
+    static void store(float *p, V v) { *p = v; }
+    static V set(float f) { return f; }
+    static V add(V a, V b) { return a + b; }
+    static V sub(V a, V b) { return a - b; }
+    static V mul(V a, V b) { return a * b; }
+    static V div(V a, V b) { return a / b; }
+    static V max(V a, V b) { return a > b ? a : b; }
+    static V abs(V a) { return fabsf(a); }
+    static V floor(V a) { return floorf(a); }
+    // 1 where a > b, otherwise 0
+    static V greater(V a, V b) { return a > b ? 1.0f : 0.0f; }
+};
+
+#ifdef NOISE_AVX
+struct Avx
+{
+    using V = __m256;
+    static constexpr size_t WIDTH = 8;
+
+    static V load(const float *p) { return _mm256_loadu_ps(p); }
+    static void store(float *p, V v) { _mm256_storeu_ps(p, v); }
+    static V set(float f) { return _mm256_set1_ps(f); }
+    static V add(V a, V b) { return _mm256_add_ps(a, b); }
+    static V sub(V a, V b) { return _mm256_sub_ps(a, b); }
+    static V mul(V a, V b) { return _mm256_mul_ps(a, b); }
+    static V div(V a, V b) { return _mm256_div_ps(a, b); }
+    static V max(V a, V b) { return _mm256_max_ps(a, b); }
+    static V abs(V a) { return _mm256_andnot_ps(_mm256_set1_ps(-0.0f), a); }
+    static V floor(V a) { return _mm256_floor_ps(a); }
+    static V greater(V a, V b) { return _mm256_and_ps(_mm256_cmp_ps(a, b, _CMP_GT_OQ), _mm256_set1_ps(1.0f)); }
+};
+#endif
+
+#ifdef NOISE_SSE2
+struct Sse2
+{
+    using V = __m128;
+    static constexpr size_t WIDTH = 4;
+
+    static V load(const float *p) { return _mm_loadu_ps(p); }
+    static void store(float *p, V v) { _mm_storeu_ps(p, v); }
+    static V set(float f) { return _mm_set1_ps(f); }
+    static V add(V a, V b) { return _mm_add_ps(a, b); }
+    static V sub(V a, V b) { return _mm_sub_ps(a, b); }
+    static V mul(V a, V b) { return _mm_mul_ps(a, b); }
+    static V div(V a, V b) { return _mm_div_ps(a, b); }
+    static V max(V a, V b) { return _mm_max_ps(a, b); }
+    static V abs(V a) { return _mm_andnot_ps(_mm_set1_ps(-0.0f), a); }
+    static V greater(V a, V b) { return _mm_and_ps(_mm_cmpgt_ps(a, b), _mm_set1_ps(1.0f)); }
+
+    static V floor(V a)
+    {
+#ifdef __SSE4_1__
+        return _mm_floor_ps(a);
+#else
+        // Truncation rounds negative numbers up, every value here is far below 2^31
+        V t = _mm_cvtepi32_ps(_mm_cvttps_epi32(a));
+        return _mm_sub_ps(t, greater(t, a));
+#endif
+    }
+};
+#endif
+
+template <typename S>
+static typename S::V mod289(typename S::V x)
+{
+    return S::sub(x, S::mul(S::floor(S::mul(x, S::set(1.0f / 289.0f))), S::set(289.0f)));
+}
+
+template <typename S>
+static typename S::V permute(typename S::V x)
+{
+    return mod289<S>(S::mul(S::add(S::mul(x, S::set(34.0f)), S::set(1.0f)), x));
+}
+
+// One corner of the simplex: its falloff times the dot product of its gradient with the
+// offset (x, y) of the point from it
+template <typename S>
+static typename S::V corner(typename S::V p, typename S::V x, typename S::V y)
+{
+    using V = typename S::V;
+
+    // Gradients: 41 points uniformly over a line, mapped onto a diamond
+    V g = S::sub(S::mul(S::set(2.0f), S::sub(S::mul(p, S::set(0.024390243902439f)), S::floor(S::mul(p, S::set(0.024390243902439f))))), S::set(1.0f));
+    V h = S::sub(S::abs(g), S::set(0.5f));
+    V a = S::sub(g, S::floor(S::add(g, S::set(0.5f))));
+
+    V m = S::max(S::sub(S::set(0.5f), S::add(S::mul(x, x), S::mul(y, y))), S::set(0.0f));
+    m = S::mul(m, m);
+    m = S::mul(m, m);
+    // Normalises the gradient with a Taylor approximation of 1/sqrt
+    m = S::mul(m, S::sub(S::set(1.79284291400159f), S::mul(S::set(0.85373472095314f), S::add(S::mul(a, a), S::mul(h, h)))));
+    return S::mul(m, S::add(S::mul(a, x), S::mul(h, y)));
+}
+
+template <typename S>
+static typename S::V simplex(typename S::V vx, typename S::V vy)
+{
+    using V = typename S::V;
+    const V cx = S::set(0.211324865405187f);
+    const V cy = S::set(0.366025403784439f);
+    const V cz = S::set(-0.577350269189626f);
+    const V n = S::set(289.0f);
+
+    // First corner, and the offsets of the point from all three
+    V s = S::add(S::mul(vx, cy), S::mul(vy, cy));
+    V ix = S::floor(S::add(vx, s));
+    V iy = S::floor(S::add(vy, s));
+    V d = S::add(S::mul(ix, cx), S::mul(iy, cx));
+    V x0 = S::add(S::sub(vx, ix), d);
+    V y0 = S::add(S::sub(vy, iy), d);
+
+    V i1x = S::greater(x0, y0);
+    V i1y = S::sub(S::set(1.0f), i1x);
+    V x1 = S::sub(S::add(x0, cx), i1x);
+    V y1 = S::sub(S::add(y0, cx), i1y);
+    V x2 = S::add(x0, cz);
+    V y2 = S::add(y0, cz);
+
+    // Permutations, wrapped first to avoid truncation
+    ix = S::sub(ix, S::mul(n, S::floor(S::div(ix, n))));
+    iy = S::sub(iy, S::mul(n, S::floor(S::div(iy, n))));
+    V p0 = permute<S>(S::add(permute<S>(iy), ix));
+    V p1 = permute<S>(S::add(S::add(permute<S>(S::add(iy, i1y)), ix), i1x));
+    V p2 = permute<S>(S::add(S::add(permute<S>(S::add(iy, S::set(1.0f))), ix), S::set(1.0f)));
+
+    V g = S::add(S::add(corner<S>(p0, x0, y0), corner<S>(p1, x1, y1)), corner<S>(p2, x2, y2));
+    return S::mul(S::set(130.0f), g);
+}
+
+template <typename S>
+static size_t batch(const float *x, const float *y, float *out, size_t n)
+{
+    size_t i = 0;
+    for (; i + S::WIDTH <= n; i += S::WIDTH)
+        S::store(out + i, simplex<S>(S::load(x + i), S::load(y + i)));
+    return i;
+}
+
+void simplex(const float *x, const float *y, float *out, size_t n)
+{
+    size_t i = 0;
+#if defined(NOISE_AVX)
+    i = batch<Avx>(x, y, out, n);
+#elif defined(NOISE_SSE2)
+    i = batch<Sse2>(x, y, out, n);
+#endif
+    for (; i < n; ++i)
+        out[i] = simplex<Scalar>(x[i], y[i]);
+}
+
+float simplex(float x, float y)
+{
+    return simplex<Scalar>(x, y);
+}
+
+// A random value in [-1, 1] for every lattice point
+static float lattice(int32_t x, int32_t y, int32_t z)
+{
+    uint32_t h = (uint32_t)x * 0x8da6b343u ^ (uint32_t)y * 0xd8163841u ^ (uint32_t)z * 0xcb1ab31fu;
+    h ^= h >> 15;
+    h *= 0x2c1b3c6du;
+    h ^= h >> 12;
+    h *= 0x297a2d39u;
+    h ^= h >> 15;
+    return (float)(h >> 8) * (2.0f / 16777215.0f) - 1.0f;
+}
+
+static float fade(float t)
+{
+    return t * t * t * (t * (t * 6.0f - 15.0f) + 10.0f);
+}
+
+static float mix(float a, float b, float t)
+{
+    return a + (b - a) * t;
+}
+
+float valuenoise(float x, float y, float z)
+{
+    float fx = floorf(x), fy = floorf(y), fz = floorf(z);
+    int32_t ix = (int32_t)fx, iy = (int32_t)fy, iz = (int32_t)fz;
+    float tx = fade(x - fx), ty = fade(y - fy), tz = fade(z - fz);
+
+    float c00 = mix(lattice(ix, iy, iz), lattice(ix + 1, iy, iz), tx);
+    float c10 = mix(lattice(ix, iy + 1, iz), lattice(ix + 1, iy + 1, iz), tx);
+    float c01 = mix(lattice(ix, iy, iz + 1), lattice(ix + 1, iy, iz + 1), tx);
+    float c11 = mix(lattice(ix, iy + 1, iz + 1), lattice(ix + 1, iy + 1, iz + 1), tx);
+    return mix(mix(c00, c10, ty), mix(c01, c11, ty), tz);
+}
+
+void valuenoisebound(float x, float y, float z, float size, float *lo, float *hi)
+{
+    // Covers the rounding of the noise around its exact value
+    const float slack = 1e-4f;
+    float r = size * 0.8660254f;
+    float n = valuenoise(x + size * 0.5f, y + size * 0.5f, z + size * 0.5f);
+
+    float fx = floorf(x), fy = floorf(y), fz = floorf(z);
+    if (x + size > fx + 1 || y + size > fy + 1 || z + size > fz + 1)
+    {
+        *lo = std::max(n - VALUE_NOISE_LIPSCHITZ * r - slack, -1.0f);
+        *hi = std::min(n + VALUE_NOISE_LIPSCHITZ * r + slack, 1.0f);
+        return;
+    }
+
+    float v[8];
+    int32_t ix = (int32_t)fx, iy = (int32_t)fy, iz = (int32_t)fz;
+    for (int i = 0; i < 8; ++i)
+        v[i] = lattice(ix + (i & 1), iy + ((i >> 1) & 1), iz + ((i >> 2) & 1));
+
+    // Each partial derivative is at most the fade's slope times the largest difference along
+    // an edge in its direction
+    float dx = 0, dy = 0, dz = 0;
+    for (int i = 0; i < 8; ++i)
+    {
+        if (!(i & 1)) dx = std::max(dx, fabsf(v[i + 1] - v[i]));
+        if (!(i & 2)) dy = std::max(dy, fabsf(v[i + 2] - v[i]));
+        if (!(i & 4)) dz = std::max(dz, fabsf(v[i + 4] - v[i]));
+    }
+    float lipschitz = 1.875f * sqrtf(dx * dx + dy * dy + dz * dz);
+
+    // and the noise is a blend of the corners, so it never leaves their range either
+    *lo = std::max(n - lipschitz * r - slack, *std::min_element(v, v + 8) - slack);
+    *hi = std::min(n + lipschitz * r + slack, *std::max_element(v, v + 8) + slack);
+}
@@ -0,0 +1,33 @@
+#pragma once
+
+#ifndef NOISE_H
+#define NOISE_H
+
+#include <stddef.h>
+
+// 2D simplex noise, the formulation of glm::simplex(vec2) evaluated for a whole batch of
+// points at a time: 8 per step with AVX, 4 with SSE2, one otherwise. Every operation is done
+// in the same order as glm, so results are identical unless the compiler fuses glm's
+// multiplies and adds, in which case they stay within NOISE_TOLERANCE over heightmap
+// coordinates.
+#define NOISE_TOLERANCE 1e-5f
+
+// Evaluates the noise at (x[i], y[i]) into out[i] for i < n
+void simplex(const float *x, const float *y, float *out, size_t n);
+
+// Same as glm::simplex, one point at a time
+float simplex(float x, float y);
+
+// 3D value noise in [-1, 1]: random values at the integer lattice, blended with a quintic
+// fade. Every point is a convex combination of the 8 corners around it, and a partial
+// derivative is at most the fade's 1.875 times the largest difference of 2, so no two points
+// differ by more than VALUE_NOISE_LIPSCHITZ times the distance between them.
+#define VALUE_NOISE_LIPSCHITZ (3.75f * 1.7320508f)
+
+float valuenoise(float x, float y, float z);
+// Bounds the noise over the cube at (x, y, z) with the given size, all in lattice units. Within
+// a single lattice cell it uses that cell's corners, which is much tighter than the Lipschitz
+// bound alone.
+void valuenoisebound(float x, float y, float z, float size, float *lo, float *hi);
+
+#endif
@@ -1,6 +1,8 @@
 #include <math.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#include <bit>
 #include <queue>
 #include <vector>
 #include <glm/vec3.hpp>
@@ -10,31 +12,21 @@
 #include "Octree.h"
 #include "MisraGries.h"
 #include "BoundsPyramid.h"
+#include "Density.h"
 #include "Traverse.h"
+#include "Arena.h"
+#include "Dag.h"
+#include "Codec.h"
+#include "Util.h"
 
 using glm::vec3;
 using glm::ivec3;
+using glm::uvec3;
 using glm::bvec3;
 
 using glm::all;
 using glm::greaterThanEqual;
 
-unsigned Octwig::word(unsigned x, unsigned y, unsigned z)
-{
-    assert(x < TWIG_SIZE);
-    assert(y < TWIG_SIZE);
-    assert(z < TWIG_SIZE);
-    unsigned i = (z * TWIG_SIZE * TWIG_SIZE) + (y * TWIG_SIZE) + x;
-    assert(i < TWIG_WORDS);
-    return i;
-}
-
-Octwig::Octwig(uint16_t v)
-{
-    for (size_t i = 0; i < TWIG_WORDS; ++i)
-        leaf[i] = v;
-}
-
 Octree::Octree(uint32_t type, uint32_t offset)
 {
     assert(type <= 3);
@@ -52,6 +44,28 @@ uint32_t Octree::type()
     return value >> 30;
 }
 
+bool Octree::shared()
+{
+    return type() >= BRANCH && (value & DAG_SHARED);
+}
+
+Octree Octree::sparse(uint32_t mask, uint32_t first)
+{
+    assert(mask < 256);
+    assert(first < (uint32_t)1 << SPARSE_OFFSET_BITS);
+    return Octree(BRANCH, (mask << SPARSE_OFFSET_BITS) | first);
+}
+
+uint32_t Octree::mask()
+{
+    return (uint32_t)(offset() >> SPARSE_OFFSET_BITS) & 0xff;
+}
+
+uint64_t Octree::first()
+{
+    return offset() & (((uint32_t)1 << SPARSE_OFFSET_BITS) - 1);
+}
+
 unsigned Octree::branch(bool xg, bool yg, bool zg)
 {
     return (int)xg + (int)yg * 2 + (int)zg * 4;
@@ -64,6 +78,178 @@ void Octree::cut(unsigned i, bool *xg, bool *yg, bool *zg)
     *zg = i & 4;
 }
 
+// Returns where child i of the branch at offset is stored. Children of dag branches keep
+// the DAG_SHARED bit in the returned offset, node() resolves it.
+uint64_t Ocroot::child(uint64_t offset, unsigned i) const
+{
+    Octree t = node(offset);
+    assert(t.type() == BRANCH && i < 8);
+    if (!sparse || t.shared())
+        return t.offset() + i;
+
+    // Stored children are in the order of their bits, so the ones below i come first
+    uint32_t mask = t.mask();
+    if (!(mask & (1 << i)))
+        return SPARSE_EMPTY;
+    return t.first() + std::popcount(mask & ((1u << i) - 1));
+}
+
+Octree Ocroot::node(uint64_t offset) const
+{
+    if (offset & DAG_SHARED)
+        return ocdag.store.tree[offset & ~(uint64_t)DAG_SHARED];
+    return tree[offset];
+}
+
+const Octwig *Ocroot::brick(Octree t) const
+{
+    assert(t.type() == TWIG);
+    if (t.shared())
+        return &ocdag.store.twig[t.offset() & ~(uint64_t)DAG_SHARED];
+    return &twig[t.offset()];
+}
+
+// Returns a branch whose 8 children are stored from first on
+Octree Ocroot::group(uint64_t first) const
+{
+    if (!sparse)
+        return Octree(BRANCH, (uint32_t)first);
+    assert(first < (uint64_t)1 << SPARSE_OFFSET_BITS);
+    return Octree::sparse(0xff, (uint32_t)first);
+}
+
+void Ocroot::reserve(uint64_t mintrees, uint64_t mintwigs)
+{
+    using glm::max;
+
+    // Edits double the storage when it runs out, starting from at least 16 of each
+    size_t bytes;
+    tree = (Octree *)ocarena.alloc(max(mintrees, (uint64_t)16) * sizeof(Octree), &bytes);
+    treestoragesize = bytes / sizeof(Octree);
+    twig = (Octwig *)ocarena.alloc(max(mintwigs, (uint64_t)16) * sizeof(Octwig), &bytes);
+    twigstoragesize = bytes / sizeof(Octwig);
+    garbagetrees = garbagetwigs = 0;
+    mapped = nullptr;
+}
+
+void Ocroot::release()
+{
+    if (tree)
+        ocdag.drop(this);
+    abandon();
+}
+
+// Gives back the storage but not the dag references, for roots whose references were moved
+// to a copy or never owned
+void Ocroot::abandon()
+{
+    if (mapped)
+    {
+        --*mapped;
+    }
+    else
+    {
+        ocarena.release(tree, treestoragesize * sizeof(Octree));
+        ocarena.release(twig, twigstoragesize * sizeof(Octwig));
+    }
+    mapped = nullptr;
+    tree = nullptr;
+    twig = nullptr;
+    trees = twigs = treestoragesize = twigstoragesize = 0;
+}
+
+// Makes room for count more trees, returns true if the storage moved
+bool Ocroot::growtrees(uint64_t count)
+{
+    using glm::max;
+
+    if (trees + count <= treestoragesize)
+        return false;
+
+    own();
+    if (trees + count <= treestoragesize)
+        return true;
+
+    size_t bytes;
+    uint64_t want = max(trees + count, treestoragesize * 2);
+    tree = (Octree *)ocarena.grow(tree, treestoragesize * sizeof(Octree), 
+        trees * sizeof(Octree), want * sizeof(Octree), &bytes);
+    treestoragesize = bytes / sizeof(Octree);
+    return true;
+}
+
+// Makes room for count more twigs, returns true if the storage moved
+bool Ocroot::growtwigs(uint64_t count)
+{
+    using glm::max;
+
+    if (twigs + count <= twigstoragesize)
+        return false;
+
+    own();
+    if (twigs + count <= twigstoragesize)
+        return true;
+
+    size_t bytes;
+    uint64_t want = max(twigs + count, twigstoragesize * 2);
+    twig = (Octwig *)ocarena.grow(twig, twigstoragesize * sizeof(Octwig), 
+        twigs * sizeof(Octwig), want * sizeof(Octwig), &bytes);
+    twigstoragesize = bytes / sizeof(Octwig);
+    return true;
+}
+
+// Copies mapped storage into the arena, with room for as many again. Other chunks loaded from
+// the same record share the view, so it is never written to.
+void Ocroot::own()
+{
+    using glm::max;
+
+    if (!mapped)
+        return;
+
+    size_t bytes;
+    Octree *t = (Octree *)ocarena.alloc(max(trees * 2, (uint64_t)16) * sizeof(Octree), &bytes);
+    memcpy(t, tree, trees * sizeof(Octree));
+    tree = t;
+    treestoragesize = bytes / sizeof(Octree);
+
+    Octwig *w = (Octwig *)ocarena.alloc(max(twigs * 2, (uint64_t)16) * sizeof(Octwig), &bytes);
+    memcpy(w, twig, twigs * sizeof(Octwig));
+    twig = w;
+    twigstoragesize = bytes / sizeof(Octwig);
+    --*mapped;
+    mapped = nullptr;
+}
+
+// Moves storage that is at least four times larger than needed into a block twice the size.
+// Mapped storage is left where it is, it takes no memory of its own.
+void Ocroot::shrink()
+{
+    using glm::max;
+
+    if (mapped)
+        return;
+
+    size_t bytes;
+    if (treestoragesize > 16 && treestoragesize / max(trees, (uint64_t)1) >= 4)
+    {
+        Octree *t = (Octree *)ocarena.alloc(max(trees * 2, (uint64_t)16) * sizeof(Octree), &bytes);
+        memcpy(t, tree, trees * sizeof(Octree));
+        ocarena.release(tree, treestoragesize * sizeof(Octree));
+        tree = t;
+        treestoragesize = bytes / sizeof(Octree);
+    }
+
+    if (twigstoragesize > 16 && twigstoragesize / max(twigs, (uint64_t)1) >= 4)
+    {
+        Octwig *w = (Octwig *)ocarena.alloc(max(twigs * 2, (uint64_t)16) * sizeof(Octwig), &bytes);
+        memcpy(w, twig, twigs * sizeof(Octwig));
+        ocarena.release(twig, twigstoragesize * sizeof(Octwig));
+        twig = w;
+        twigstoragesize = bytes / sizeof(Octwig);
+    }
+}
+
 #define INVALID_OFFSET 0
 
 uint16_t heightMaterial(float y)
@@ -71,21 +257,264 @@ uint16_t heightMaterial(float y)
     return (uint16_t)glm::clamp(y / 0.03, 1.0, 4.0);
 }
 
+// Decides what the node at pos becomes, shared by every builder so they agree exactly
+static Octype growtype(const Ocroot *root, vec3 pos, float size, uint32_t depth, const BoundsPyramid *pyr)
+{
+    vec3 p = (pos - root->position) / root->size;
+    float low = pyr->min(p.x, p.z, depth);
+    float high = pyr->max(p.x, p.z, depth);
+
+    if (high < pos.y)
+        // Maximum height in this quadrant is lower => empty
+        return EMPTY;
+    else if (low > pos.y + size)
+        // Minimum height in this quadrant is higher => leaf/solid
+        return LEAF;
+    else if (depth == root->depth - TWIG_LEVELS)
+        // Reached maximum depth => twig/brick
+        return TWIG;
+    else
+        // Must be a branch
+        return BRANCH;
+}
+
+static Octree growleaf(const Ocroot *root, vec3 pos)
+{
+    vec3 p = (pos - root->position) / root->size;
+    return Octree(LEAF, heightMaterial(p.y));
+}
+
+static void growtwig(const Ocroot *root, vec3 pos, float size, uint32_t depth, const BoundsPyramid *pyr, Octwig *twig)
+{
+    vec3 p = (pos - root->position) / root->size;
+    float twigLeafSize = size / (1 << TWIG_LEVELS);
+    uint16_t leaf[TWIG_WORDS];
+    for (int y = 0; y < TWIG_SIZE; ++y)
+    {
+        for (int z = 0; z < TWIG_SIZE; ++z)
+        {
+            for (int x = 0; x < TWIG_SIZE; ++x)
+            {
+                float dx = ((float)x * twigLeafSize) / root->size;
+                float dz = ((float)z * twigLeafSize) / root->size;
+                float h = pyr->max(p.x + dx, p.z + dz, depth + TWIG_LEVELS);
+
+                // Similar logic to growtype
+                uint32_t w = Octwig::word(x, y, z);
+                if (h >= pos.y + y * twigLeafSize) // Leaf
+                    leaf[w] = heightMaterial(p.y);
+                else // Empty
+                    leaf[w] = 0;
+            }
+        }
+    }
+
+    // Generated twigs only have one material
+    bool packed = twig->pack(leaf);
+    assert(packed);
+    (void)packed;
+}
+
+// Counts the nodes and twigs grow will emit, so that the storage can be allocated once
+static void growcount(const Ocroot *root, vec3 pos, float size, uint32_t depth, const BoundsPyramid *pyr, 
+    uint64_t *trees, uint64_t *twigs)
+{
+    Octype type = growtype(root, pos, size, depth, pyr);
+    if (type == TWIG)
+    {
+        *twigs += 1;
+    }
+    else if (type == BRANCH)
+    {
+        *trees += 8;
+        float halfsize = size * 0.5f;
+        for (int i = 0; i < 8; ++i)
+        {
+            bool xg, yg, zg;
+            Octree::cut(i, &xg, &yg, &zg);
+            growcount(root, pos + vec3(xg, yg, zg) * halfsize, halfsize, depth + 1, pyr, trees, twigs);
+        }
+    }
+}
+
+// Emits the children of the branch whose group of 8 starts at first. The groups of all the
+// children that are branches are allocated next to each other before descending into any of
+// them, so cousins stay as close as siblings while every subtree remains one contiguous run.
+static void growdfs(Ocroot *root, uint64_t first, vec3 pos, float size, uint32_t depth, const BoundsPyramid *pyr)
+{
+    float halfsize = size * 0.5f;
+    vec3 childpos[8];
+    uint64_t childfirst[8];
+
+    for (int i = 0; i < 8; ++i)
+    {
+        bool xg, yg, zg;
+        Octree::cut(i, &xg, &yg, &zg);
+        childpos[i] = pos + vec3(xg, yg, zg) * halfsize;
+        childfirst[i] = 0;
+
+        Octype type = growtype(root, childpos[i], halfsize, depth + 1, pyr);
+        if (type == EMPTY)
+        {
+            root->tree[first + i] = Octree(EMPTY, INVALID_OFFSET);
+        }
+        else if (type == LEAF)
+        {
+            root->tree[first + i] = growleaf(root, childpos[i]);
+        }
+        else if (type == TWIG)
+        {
+            assert(root->twigs < root->twigstoragesize);
+            uint64_t w = root->twigs++;
+            growtwig(root, childpos[i], halfsize, depth + 1, pyr, &root->twig[w]);
+            root->tree[first + i] = Octree(TWIG, (uint32_t)w);
+        }
+        else
+        {
+            assert(root->trees + 8 <= root->treestoragesize);
+            childfirst[i] = root->trees;
+            root->trees += 8;
+            root->tree[first + i] = Octree(BRANCH, (uint32_t)childfirst[i]);
+        }
+    }
+
+    for (int i = 0; i < 8; ++i)
+        if (childfirst[i])
+            growdfs(root, childfirst[i], childpos[i], halfsize, depth + 1, pyr);
+}
+
 void grow(Ocroot *root, vec3 position, float size, uint32_t depth, const BoundsPyramid *pyr)
+{
+    root->position = position;
+    root->size     = size;
+    root->depth    = depth;
+    root->sparse   = false;
+
+    uint64_t trees = 1, twigs = 0;
+    growcount(root, position, size, 0, pyr, &trees, &twigs);
+
+    root->reserve(trees, twigs);
+    root->trees = 1;
+    root->twigs = 0;
+
+    Octype type = growtype(root, position, size, 0, pyr);
+    if (type == EMPTY)
+    {
+        root->tree[0] = Octree(EMPTY, INVALID_OFFSET);
+    }
+    else if (type == LEAF)
+    {
+        root->tree[0] = growleaf(root, position);
+    }
+    else if (type == TWIG)
+    {
+        root->twigs = 1;
+        growtwig(root, position, size, 0, pyr, &root->twig[0]);
+        root->tree[0] = Octree(TWIG, 0);
+    }
+    else
+    {
+        root->trees += 8;
+        root->tree[0] = Octree(BRANCH, 1);
+        growdfs(root, 1, position, size, 0, pyr);
+    }
+
+    assert(root->trees == trees);
+    assert(root->twigs == twigs);
+}
+
+// Emits the node for the cube at pos into tree[offset], deciding it from the bounds of the
+// density alone whenever they allow and sampling voxels only in twigs
+static void growdensity(Ocroot *root, uint64_t offset, vec3 pos, float size, uint32_t depth, const Density *f, uint64_t *samples)
+{
+    Interval b = f->bound(pos, size);
+    *samples += 1;
+
+    if (b.hi <= 0)
+    {
+        root->tree[offset] = Octree(EMPTY, INVALID_OFFSET);
+    }
+    else if (b.lo > 0)
+    {
+        root->tree[offset] = Octree(LEAF, f->material(pos));
+    }
+    else if (depth == root->depth - TWIG_LEVELS)
+    {
+        float leafsize = size / TWIG_SIZE;
+        uint16_t leaf[TWIG_WORDS];
+        for (int z = 0; z < TWIG_SIZE; ++z)
+            for (int y = 0; y < TWIG_SIZE; ++y)
+                for (int x = 0; x < TWIG_SIZE; ++x)
+                {
+                    vec3 p = pos + (vec3(x, y, z) + 0.5f) * leafsize;
+                    leaf[Octwig::word(x, y, z)] = f->sample(p) > 0 ? f->material(p) : 0;
+                }
+        *samples += TWIG_WORDS;
+
+        Octwig twig;
+        bool packed = twig.pack(leaf);
+        assert(packed);
+        (void)packed;
+
+        // The bounds could not tell, but the voxels may still all be the same
+        int mono = twig.mono();
+        if (mono >= 0)
+        {
+            root->tree[offset] = Octree(mono ? LEAF : EMPTY, mono ? mono : INVALID_OFFSET);
+        }
+        else
+        {
+            root->growtwigs(1);
+            root->twig[root->twigs] = twig;
+            root->tree[offset] = Octree(TWIG, (uint32_t)root->twigs++);
+        }
+    }
+    else
+    {
+        root->growtrees(8);
+        uint64_t first = root->trees;
+        root->trees += 8;
+        root->tree[offset] = Octree(BRANCH, (uint32_t)first);
+
+        float halfsize = size * 0.5f;
+        for (int i = 0; i < 8; ++i)
+        {
+            bool xg, yg, zg;
+            Octree::cut(i, &xg, &yg, &zg);
+            growdensity(root, first + i, pos + vec3(xg, yg, zg) * halfsize, halfsize, depth + 1, f, samples);
+        }
+    }
+}
+
+uint64_t growdensity(Ocroot *root, vec3 position, float size, uint32_t depth, const Density *f)
+{
+    root->position = position;
+    root->size     = size;
+    root->depth    = depth;
+    root->sparse   = false;
+
+    root->reserve(64, 16);
+    root->trees = 1;
+    root->twigs = 0;
+
+    uint64_t samples = 0;
+    growdensity(root, 0, position, size, 0, f, &samples);
+    root->shrink();
+    return samples;
+}
+
+void growbfs(Ocroot *root, vec3 position, float size, uint32_t depth, const BoundsPyramid *pyr)
 {
     using std::queue;
 
     root->position = position;
     root->size     = size;
     root->depth    = depth;
+    root->sparse   = false;
 
-    root->treestoragesize = 16; 
+    root->reserve(16, 16);
     root->trees = 1; 
-    root->tree  = (Octree *)malloc(root->treestoragesize * sizeof(Octree));
-
-    root->twigstoragesize = 16;
     root->twigs = 0;
-    root->twig  = (Octwig *)malloc(root->twigstoragesize * sizeof(Octwig));
 
     struct Ocentry
     {
@@ -103,51 +532,20 @@ void grow(Ocroot *root, vec3 position, float size, uint32_t depth, const BoundsP
         Ocentry t = q.front();
         q.pop();
 
-        vec3 p = (t.pos - position) / size;
-        float low = pyr->min(p.x, p.z, t.depth);
-        float high = pyr->max(p.x, p.z, t.depth);
-
-        if(high < t.pos.y)
+        Octype type = growtype(root, t.pos, t.size, t.depth, pyr);
+        if (type == EMPTY)
         {
-            // Maximum height in this quadrant is lower => empty
             root->tree[t.offset] = Octree(EMPTY, INVALID_OFFSET);
         }
-        else if (low > t.pos.y + t.size)
+        else if (type == LEAF)
         {
-            // Minimum height in this quadrant is higher => leaf/solid
-            root->tree[t.offset] = Octree(LEAF, heightMaterial(p.y));
+            root->tree[t.offset] = growleaf(root, t.pos);
         }
-        else if (t.depth == root->depth - TWIG_LEVELS)
+        else if (type == TWIG)
         {
-            assert(high >= t.pos.y && low <= t.pos.y + t.size);
-
-            // Reached maximum depth => twig/brick
-            float twigLeafSize = t.size / (1 << TWIG_LEVELS);
             Octwig twig;
-            for (int y = 0; y < TWIG_SIZE; ++y)
-            {
-                for (int z = 0; z < TWIG_SIZE; ++z)
-                {
-                    for (int x = 0; x < TWIG_SIZE; ++x)
-                    {
-                        float dx = ((float)x * twigLeafSize) / size;
-                        float dz = ((float)z * twigLeafSize) / size;
-                        float l = pyr->min(p.x + dx, p.z + dz, t.depth + TWIG_LEVELS);
-                        float h = pyr->max(p.x + dx, p.z + dz, t.depth + TWIG_LEVELS);
-
-                        (void)l;
-
-                        // Similar logic to above
-                        uint32_t w = Octwig::word(x, y, z);
-                       if (h >= t.pos.y + y *twigLeafSize) // Leaf
-                            twig.leaf[w] = heightMaterial(p.y);
-                        else // Empty
-                            twig.leaf[w] = 0;
-                    }
-                }
-            }
-            if (root->twigs >= root->twigstoragesize)
-                root->twig = (Octwig *)realloc(root->twig, (root->twigstoragesize *= 2) * sizeof(Octwig));
+            growtwig(root, t.pos, t.size, t.depth, pyr, &twig);
+            root->growtwigs(1);
             uint64_t offset = root->twigs++;
             root->tree[t.offset] = Octree(TWIG, (uint32_t)offset);
             root->twig[offset] = twig;
@@ -155,11 +553,7 @@ void grow(Ocroot *root, vec3 position, float size, uint32_t depth, const BoundsP
         else
         {
             // Must be a branch => make 8 children and add them to the queue
-            assert(high >= t.pos.y && low <= t.pos.y + t.size);
-
-            if (root->trees+8 >= root->treestoragesize)
-                root->tree = (Octree *)realloc(root->tree, (root->treestoragesize *= 2) * sizeof(Octree));
-            
+            root->growtrees(8);
             uint64_t offset = root->trees;
 
             for (int i = 0; i < 8; ++i)
@@ -179,10 +573,16 @@ void grow(Ocroot *root, vec3 position, float size, uint32_t depth, const BoundsP
 
 void Ocroot::write(const char *path)
 {
+    // The codec walks the dag itself, and offsets are not written at all, so the file needs
+    // no copy that owns all of its nodes
+    std::vector<uint8_t> bytes;
+    encode(this, &bytes);
+    uint64_t size = bytes.size();
+
     FILE *fp = fopen(path, "wb");
     fwrite(&position, 1, TREE_STRUCT_SIZE, fp);
-    fwrite(tree, sizeof(Octree), trees, fp);
-    fwrite(twig, sizeof(Octwig), twigs, fp);
+    fwrite(&size, sizeof(size), 1, fp);
+    fwrite(bytes.data(), 1, size, fp);
     fclose(fp);
 }
 
@@ -191,13 +591,149 @@ void Ocroot::read(const char *path)
     FILE *fp = fopen(path, "rb");
     fread(&position, 1, TREE_STRUCT_SIZE, fp);
 
-    tree = (Octree *)malloc(treestoragesize * sizeof(Octree));
-    fread(tree, sizeof(Octree), trees, fp);
+    uint64_t size = 0;
+    fread(&size, sizeof(size), 1, fp);
+    std::vector<uint8_t> bytes(size);
+    size_t got = fread(bytes.data(), 1, size, fp);
+    fclose(fp);
 
-    twig = (Octwig *)malloc(twigstoragesize * sizeof(Octwig));
-    fread(twig, sizeof(Octwig), twigs, fp);
+    modified = false;
+    if (got != size || !decode(bytes.data(), size, this))
+        die("%s is not an octree file\n", path);
+}
 
-    fclose(fp);
+// Writes the size^3 voxels of leaf starting at base as the node at offset, merging
+// groups that are all one material
+static void growvoxels(Ocroot *root, uint64_t offset, const uint16_t leaf[TWIG_WORDS], uvec3 base, unsigned size)
+{
+    uint16_t x = leaf[Octwig::word(base.x, base.y, base.z)];
+    bool same = true;
+    for (unsigned z = 0; z < size && same; ++z)
+        for (unsigned y = 0; y < size && same; ++y)
+            for (unsigned w = 0; w < size && same; ++w)
+                same = leaf[Octwig::word(base.x + w, base.y + y, base.z + z)] == x;
+
+    if (same)
+    {
+        root->tree[offset] = Octree(x ? LEAF : EMPTY, x);
+        if (!x && root->sparse)
+            root->garbagetrees += 1;
+        return;
+    }
+
+    uint64_t pos = root->trees;
+    root->trees += 8;
+    root->tree[offset] = root->group(pos);
+
+    unsigned half = size / 2;
+    for (unsigned i = 0; i < 8; ++i)
+    {
+        bool xg, yg, zg;
+        Octree::cut(i, &xg, &yg, &zg);
+        growvoxels(root, pos + i, leaf, base + uvec3(xg, yg, zg) * half, half);
+    }
+}
+
+// Stores a brick whose materials do not fit in a twig palette as branches down to single
+// voxels. Returns true if the storage moved.
+static bool growvoxels(Ocroot *root, uint64_t offset, const uint16_t leaf[TWIG_WORDS])
+{
+    // A full tree over the brick has 8 + 64 + ... + TWIG_WORDS nodes below its root
+    bool moved = root->growtrees((TWIG_WORDS * 8 - 8) / 7);
+    growvoxels(root, offset, leaf, uvec3(0), TWIG_SIZE);
+    return moved;
+}
+
+// Makes all 8 children of the branch at offset stored in the chunk itself, copying them out
+// of the dag or out of a sparse group first if needed, and returns where child 0 is. Only
+// the path an edit goes down is copied, the groups left behind are garbage until a defrag.
+static uint64_t ownbranch(Ocroot *root, uint64_t offset, Ocdelta *tree)
+{
+    using glm::min;
+    using glm::max;
+
+    Octree t = root->tree[offset];
+    assert(t.type() == BRANCH);
+    if (!t.shared() && !root->sparse)
+        return t.offset();
+    if (!t.shared() && t.mask() == 0xff)
+        return t.first();
+    if (!t.shared())
+        root->garbagetrees += std::popcount(t.mask());
+
+    if (root->growtrees(8))
+        tree->realloc = true;
+
+    uint64_t pos = root->trees;
+    root->trees += 8;
+    for (unsigned i = 0; i < 8; ++i)
+    {
+        root->tree[pos + i] = root->node(root->child(offset, i));
+        // Empty children of sparse roots only take up room until the next compaction
+        if (root->sparse && root->tree[pos + i].type() == EMPTY)
+            root->garbagetrees += 1;
+    }
+    if (t.shared())
+        ocdag.unshare(t);
+
+    tree->left = min(tree->left, offset);
+    tree->right = max(tree->right, offset+1);
+    tree->left = min(tree->left, (size_t)pos);
+    tree->right = max(tree->right, (size_t)pos + 8);
+    root->tree[offset] = root->group(pos);
+    return pos;
+}
+
+// Copies the twig at offset out of the dag if it is shared, returns where it is in the chunk
+static uint64_t owntwig(Ocroot *root, uint64_t offset, Ocdelta *tree, Ocdelta *twig)
+{
+    using glm::min;
+    using glm::max;
+
+    Octree t = root->tree[offset];
+    assert(t.type() == TWIG);
+    if (!t.shared())
+        return t.offset();
+
+    if (root->growtwigs(1))
+        twig->realloc = true;
+
+    uint64_t pos = root->twigs++;
+    root->twig[pos] = *root->brick(t);
+    ocdag.unshare(t);
+
+    twig->left = min(twig->left, (size_t)pos);
+    twig->right = max(twig->right, (size_t)pos+1);
+    tree->left = min(tree->left, offset);
+    tree->right = max(tree->right, offset+1);
+    root->tree[offset] = Octree(TWIG, (uint32_t)pos);
+    return pos;
+}
+
+// Counts the storage below the node at offset as garbage and gives back its dag references,
+// before the node is overwritten
+static void discard(Ocroot *root, uint64_t offset)
+{
+    Octree t = root->tree[offset];
+    if (t.shared())
+    {
+        ocdag.drop(root, offset);
+    }
+    else if (t.type() == TWIG)
+    {
+        root->garbagetwigs += 1;
+    }
+    else if (t.type() == BRANCH)
+    {
+        for (unsigned i = 0; i < 8; ++i)
+        {
+            // Empty children of sparse roots were counted when they became empty
+            uint64_t c = root->child(offset, i);
+            if (!root->sparse || root->tree[c].type() != EMPTY)
+                root->garbagetrees += 1;
+            discard(root, c);
+        }
+    }
 }
 
 static void destroyCube(Ocroot *root, 
@@ -223,22 +759,23 @@ static void destroyCube(Ocroot *root,
     {
         return;
     }
-    else if (cubeIsInside(cmin, cmax, bmin, bmax))
+    else if (cubeIsInside(cmin, cmax, bmin, bmax) || depth == root->depth)
     {
+        // Single voxels go as soon as they are touched, like the leaves of a twig
         tree->left = min(tree->left, offset);
         tree->right = max(tree->right, offset+1);
+        discard(root, offset);
         root->tree[offset] = Octree(EMPTY, 0);
+        if (root->sparse && offset)
+            root->garbagetrees += 1;
     }
     else if (t.type() == LEAF)
     {
         if (depth == root->depth - TWIG_LEVELS)
         {
             // At max depth => make a twig
-            if (root->twigs >= root->twigstoragesize)
-            {
-                root->twig = (Octwig *)realloc(root->twig, (root->twigstoragesize *= 2) * sizeof(Octwig));
+            if (root->growtwigs(1))
                 twig->realloc = true;
-            }
 
             size_t pos = root->twigs++; 
             
@@ -255,15 +792,12 @@ static void destroyCube(Ocroot *root,
         else
         {
             // Make 8 leaf children and check recursively
-            if (root->trees+8 >= root->treestoragesize)
-            {
-                root->tree = (Octree *)realloc(root->tree, (root->treestoragesize *= 2) * sizeof(Octree));
+            if (root->growtrees(8))
                 tree->realloc = true;
-            }
 
             size_t pos = root->trees; 
             tree->left = min(tree->left, offset);
-            root->tree[offset] = Octree(BRANCH, (uint32_t)pos);
+            root->tree[offset] = root->group(pos);
 
             tree->right = max(tree->right, pos + 7 + 1);
             for (size_t i = 0; i < 8; ++i)
@@ -277,8 +811,11 @@ static void destroyCube(Ocroot *root,
     else if (t.type() == TWIG)
     {
         float leafsize = size / (1 << TWIG_LEVELS);
-        twig->left = min(twig->left, t.offset());
-        twig->right = max(twig->right, t.offset()+1);
+        uint64_t w = owntwig(root, offset, tree, twig);
+        twig->left = min(twig->left, w);
+        twig->right = max(twig->right, w+1);
+        uint16_t leaf[TWIG_WORDS];
+        root->twig[w].unpack(leaf);
         for (unsigned z = 0; z < TWIG_SIZE; ++z)
         {
             for (unsigned y = 0; y < TWIG_SIZE; ++y)
@@ -289,20 +826,26 @@ static void destroyCube(Ocroot *root,
                     vec3 leafmin = bmin + vec3(x, y, z) * leafsize;
                     vec3 leafmax = leafmin + leafsize;
                     if (cubesIntersect(leafmin, leafmax, cmin, cmax))
-                        root->twig[t.offset()].leaf[i] = 0;
+                        leaf[i] = 0;
                 }
             }
         }
+
+        // Removing voxels never adds a material, so this always fits
+        bool packed = root->twig[w].pack(leaf);
+        assert(packed);
+        (void)packed;
     }
     else if (t.type() == BRANCH)
     {
         float halfsize = size * 0.5f;
+        uint64_t first = ownbranch(root, offset, tree);
         for (unsigned i = 0; i < 8; ++i)
         {
             bool xg, yg, zg;
             Octree::cut(i, &xg, &yg, &zg);
             vec3 nextmin = bmin + vec3(xg, yg, zg) * halfsize;
-            destroyCube(root, t.offset() + i, nextmin, halfsize, depth+1, cmin, cmax, tree, twig);
+            destroyCube(root, first + i, nextmin, halfsize, depth+1, cmin, cmax, tree, twig);
         }
     }
     else
@@ -314,6 +857,8 @@ static void destroyCube(Ocroot *root,
 void Ocroot::destroy(glm::vec3 cmin, glm::vec3 cmax, Ocdelta *dtree, Ocdelta *dtwig)
 {
     *dtree = *dtwig = Ocdelta();
+    modified = true;
+    own();
     destroyCube(this, 0, position, size, 0, cmin, cmax, dtree, dtwig);
 }
 
@@ -339,7 +884,11 @@ static void buildCube(Ocroot *root,
     Octree t = root->tree[offset];
     if (t.type() == EMPTY)
     {
-        if (cubeIsInside(cmin, cmax, bmin, bmax))
+        // Whatever the node becomes, it stops being an empty child taking up room
+        if (root->sparse && offset && root->garbagetrees)
+            root->garbagetrees -= 1;
+
+        if (cubeIsInside(cmin, cmax, bmin, bmax) || depth == root->depth)
         {
             tree->left = min(tree->left, offset);
             tree->right = max(tree->right, offset+1);
@@ -348,11 +897,8 @@ static void buildCube(Ocroot *root,
         else if (depth == root->depth - TWIG_LEVELS)
         {
             // At max depth => make a twig
-            if (root->twigs >= root->twigstoragesize)
-            {
-                root->twig = (Octwig *)realloc(root->twig, (root->twigstoragesize *= 2) * sizeof(Octwig));
+            if (root->growtwigs(1))
                 twig->realloc = true;
-            }
 
             size_t pos = root->twigs++; 
             
@@ -369,19 +915,18 @@ static void buildCube(Ocroot *root,
         else
         {
             // Make 8 leaf children and check recursively
-            if (root->trees+8 >= root->treestoragesize)
-            {
-                root->tree = (Octree *)realloc(root->tree, (root->treestoragesize *= 2) * sizeof(Octree));
+            if (root->growtrees(8))
                 tree->realloc = true;
-            }
 
             size_t pos = root->trees; 
             tree->left = min(tree->left, offset);
-            root->tree[offset] = Octree(BRANCH, (uint32_t)pos);
+            root->tree[offset] = root->group(pos);
 
             tree->right = max(tree->right, pos + 7 + 1);
             for (size_t i = 0; i < 8; ++i)
                 root->tree[pos + i] = Octree(EMPTY, 0);
+            if (root->sparse)
+                root->garbagetrees += 8;
 
             root->trees += 8;
 
@@ -395,8 +940,9 @@ static void buildCube(Ocroot *root,
     else if (t.type() == TWIG)
     {
         float leafsize = size / (1 << TWIG_LEVELS);
-        twig->left = min(twig->left, t.offset());
-        twig->right = max(twig->right, t.offset()+1);
+        uint64_t w = owntwig(root, offset, tree, twig);
+        uint16_t leaf[TWIG_WORDS];
+        root->twig[w].unpack(leaf);
         for (unsigned z = 0; z < TWIG_SIZE; ++z)
         {
             for (unsigned y = 0; y < TWIG_SIZE; ++y)
@@ -406,21 +952,37 @@ static void buildCube(Ocroot *root,
                     size_t i = Octwig::word(x, y, z);
                     vec3 leafmin = bmin + vec3(x, y, z) * leafsize;
                     vec3 leafmax = leafmin + leafsize;
-                    if (root->twig[t.offset()].leaf[i] == 0 && cubesIntersect(leafmin, leafmax, cmin, cmax))
-                        root->twig[t.offset()].leaf[i] = material;
+                    if (leaf[i] == 0 && cubesIntersect(leafmin, leafmax, cmin, cmax))
+                        leaf[i] = material;
                 }
             }
         }
+
+        if (root->twig[w].pack(leaf))
+        {
+            twig->left = min(twig->left, w);
+            twig->right = max(twig->right, w+1);
+        }
+        else
+        {
+            // Palette is full => the twig is left behind and the node becomes voxel branches
+            root->garbagetwigs += 1;
+            tree->left = min(tree->left, offset);
+            if (growvoxels(root, offset, leaf))
+                tree->realloc = true;
+            tree->right = max(tree->right, (size_t)root->trees);
+        }
     }
     else if (t.type() == BRANCH)
     {
         float halfsize = size * 0.5f;
+        uint64_t first = ownbranch(root, offset, tree);
         for (unsigned i = 0; i < 8; ++i)
         {
             bool xg, yg, zg;
             Octree::cut(i, &xg, &yg, &zg);
             vec3 nextmin = bmin + vec3(xg, yg, zg) * halfsize;
-            buildCube(root, t.offset() + i, nextmin, halfsize, depth+1, cmin, cmax, material, tree, twig);
+            buildCube(root, first + i, nextmin, halfsize, depth+1, cmin, cmax, material, tree, twig);
         }
     }
     else
@@ -432,26 +994,20 @@ static void buildCube(Ocroot *root,
 void Ocroot::build(glm::vec3 cmin, glm::vec3 cmax, uint16_t mat, Ocdelta *dtree, Ocdelta *dtwig)
 {
     *dtree = *dtwig = Ocdelta();
+    modified = true;
+    own();
     buildCube(this, 0, position, size, 0, cmin, cmax, mat, dtree, dtwig);
 }
 
 void Ocroot::replace(glm::vec3 cmin, glm::vec3 cmax, uint16_t mat, Ocdelta *dtree, Ocdelta *dtwig)
 {
     *dtree = *dtwig = Ocdelta();
+    modified = true;
+    own();
     destroyCube(this, 0, position, size, 0, cmin, cmax, dtree, dtwig);
     buildCube(this, 0, position, size, 0, cmin, cmax, mat, dtree, dtwig);
 }
 
-// Returns -1 if more than one material is found, otherwise returns the material
-int is_monotwig(const Octwig *twig)
-{
-    uint16_t x = twig->leaf[0];
-    for (int i = 1; i < TWIG_WORDS; ++i)
-        if (twig->leaf[i] != x)
-            return -1;
-    return x;
-}
-
 // Returns -1 on false, otherwise returns the material
 int is_monobranch(const Ocroot *root, uint32_t offset)
 {
@@ -471,7 +1027,7 @@ uint16_t descend(const Ocroot *root, uint32_t offset, vec3 cmin, float size, vec
 
     assert(isInsideCube(p, cmin, cmax));
 
-    Octree t = root->tree[offset];
+    Octree t = root->node(offset);
     if (t.type() == EMPTY)
         return 0;
     else if (t.type() == LEAF)
@@ -482,7 +1038,7 @@ uint16_t descend(const Ocroot *root, uint32_t offset, vec3 cmin, float size, vec
         ivec3 i = ivec3((p - cmin) / leafsize);
         assert(all(greaterThanEqual(i, ivec3(0))) && all(greaterThanEqual(ivec3(TWIG_SIZE - 1), i)));
         unsigned w = Octwig::word(i.x, i.y, i.z);
-        return root->twig[t.offset()].leaf[w];
+        return root->brick(t)->get(w);
     }
     else
     {
@@ -490,7 +1046,7 @@ uint16_t descend(const Ocroot *root, uint32_t offset, vec3 cmin, float size, vec
         vec3 cmid = cmin + halfsize;
         bvec3 geq = greaterThanEqual(p, cmid);
         unsigned i = Octree::branch(geq.x, geq.y, geq.z);
-        return descend(root, (uint32_t)t.offset() + i, cmin + vec3(geq) * halfsize, halfsize, p);
+        return descend(root, (uint32_t)root->child(offset, i), cmin + vec3(geq) * halfsize, halfsize, p);
     }
 }
 
@@ -498,7 +1054,7 @@ uint16_t descend(const Ocroot *root, uint32_t offset, vec3 cmin, float size, vec
 int defragcopy(const Ocroot *from, Ocroot *to, uint32_t f, uint32_t t)
 {
     auto twig = Octwig();
-    Octree tree = from->tree[f];
+    Octree tree = from->node(f);
     if (tree.type() == EMPTY)
     {
         // Empty nodes and leaves are copied as is
@@ -512,11 +1068,11 @@ int defragcopy(const Ocroot *from, Ocroot *to, uint32_t f, uint32_t t)
     }
     else if (tree.type() == TWIG)
     {
-        twig = from->twig[tree.offset()];
+        twig = *from->brick(tree);
 
         makeTwig: 
 
-        int x = is_monotwig(&twig);
+        int x = twig.mono();
         if (x != -1)
         {
             // Twig is only one material => make it an empty branch or a leaf
@@ -527,8 +1083,7 @@ int defragcopy(const Ocroot *from, Ocroot *to, uint32_t f, uint32_t t)
         else
         {
             // Copy the twig as is
-            if (to->twigs >= to->twigstoragesize)
-                to->twig = (Octwig *)realloc(to->twig, (to->twigstoragesize *= 2) * sizeof(Octwig));
+            to->growtwigs(1);
 
             uint32_t i = (uint32_t)to->twigs++;
             to->tree[t] = Octree(TWIG, i);
@@ -542,8 +1097,7 @@ int defragcopy(const Ocroot *from, Ocroot *to, uint32_t f, uint32_t t)
         uint64_t trees = to->trees;
         uint64_t twigs = to->twigs;
 
-        if (to->trees + 8 >= to->treestoragesize)
-            to->tree = (Octree *)realloc(to->tree, (to->treestoragesize *= 2) * sizeof(Octree));
+        to->growtrees(8);
 
         uint32_t i = (uint32_t)to->trees;
         to->tree[t] = Octree(BRANCH, i);
@@ -552,7 +1106,7 @@ int defragcopy(const Ocroot *from, Ocroot *to, uint32_t f, uint32_t t)
         int maxdepth = 0;
         for (int j = 0; j < 8; ++j)
         {
-            int d = defragcopy(from, to, (uint32_t)tree.offset() + j, i + j);
+            int d = defragcopy(from, to, (uint32_t)from->child(f, j), i + j);
             maxdepth = d > maxdepth ? d : maxdepth;
         }
 
@@ -573,12 +1127,9 @@ int defragcopy(const Ocroot *from, Ocroot *to, uint32_t f, uint32_t t)
         if (maxdepth == TWIG_DEPTH)
         {
             // Made a branch when a twig or leaf/empty would suffice!
-            // Reset the tree to its original state and make a twig
-            to->trees = trees;
-            to->twigs = twigs;
-
             float leafsize = 1.0 / (1 << TWIG_DEPTH);
             float halfleafsize = leafsize * 0.5f;
+            uint16_t leaf[TWIG_WORDS];
             for (unsigned z = 0; z < TWIG_SIZE; ++z)
             {
                 for (unsigned y = 0; y < TWIG_SIZE; ++y)
@@ -587,101 +1138,283 @@ int defragcopy(const Ocroot *from, Ocroot *to, uint32_t f, uint32_t t)
                     {
                         vec3 p = vec3(x, y, z) * leafsize + halfleafsize;
                         unsigned w = Octwig::word(x, y, z);
-                        twig.leaf[w] = descend(to, t, vec3(0), 1.0, p);
+                        leaf[w] = descend(to, t, vec3(0), 1.0, p);
                     }
                 }
             }
 
-            goto makeTwig;
+            // Reset the tree to its original state and make a twig, unless the palette
+            // cannot hold all the materials, then the branch stays
+            if (twig.pack(leaf))
+            {
+                to->trees = trees;
+                to->twigs = twigs;
+                goto makeTwig;
+            }
         }
         return maxdepth + 1;
     }
 }
 
+// Counts the branches and twigs below the node at offset, dag nodes once for every use or
+// not at all
+static void reachable(const Ocroot *root, uint64_t offset, uint64_t *branches, uint64_t *twigs, bool shared = true)
+{
+    Octree t = root->node(offset);
+    if (t.shared() && !shared)
+    {
+        return;
+    }
+    else if (t.type() == TWIG)
+    {
+        *twigs += 1;
+    }
+    else if (t.type() == BRANCH)
+    {
+        *branches += 1;
+        for (unsigned i = 0; i < 8; ++i)
+            reachable(root, root->child(offset, i), branches, twigs, shared);
+    }
+}
+
+// Trees of a copy that gives every branch all 8 children, and its twigs
+static uint64_t densetrees(const Ocroot *root, uint64_t *twigs)
+{
+    // Shared subtrees are copied out as many times as they are used, so the chunk's own
+    // storage says little about the size of the copy
+    uint64_t branches = 0;
+    *twigs = 0;
+    reachable(root, 0, &branches, twigs);
+    return branches * 8 + 1;
+}
+
 void defragcopy(const Ocroot *from, Ocroot *to)
 {
     to->position = from->position;
     to->size = from->size;
     to->depth = from->depth;
+    to->sparse = false;
+    // The copy never has more trees than the original, nor more twigs than the original has
+    // twigs and branches together, so it is built without moving and then shrunk once
+    uint64_t twigs;
+    uint64_t trees = densetrees(from, &twigs);
+    to->reserve(trees, twigs + trees / 8 + 1);
     to->trees = 1;
     to->twigs = 0;
-    to->treestoragesize = 16;
-    to->twigstoragesize = 16;
-    to->tree = (Octree *)malloc(to->treestoragesize * sizeof(Octree));
-    to->twig = (Octwig *)malloc(to->twigstoragesize * sizeof(Octwig));
     
     ::defragcopy(from, to, 0, 0);
 
-    // Did we allocate too much memory?
-    while (to->trees > 0 && to->treestoragesize > 16 && to->treestoragesize / to->trees >= 4)
-        to->tree = (Octree *)realloc(to->tree, (to->treestoragesize /= 2) * sizeof(Octree));
+    to->shrink();
+}
+
+static void sparsify(const Ocroot *from, Ocroot *to, uint64_t f, uint64_t t)
+{
+    Octree tree = from->node(f);
+    if (tree.type() == TWIG)
+    {
+        uint64_t i = to->twigs++;
+        to->twig[i] = *from->brick(tree);
+        to->tree[t] = Octree(TWIG, (uint32_t)i);
+    }
+    else if (tree.type() != BRANCH)
+    {
+        to->tree[t] = tree;
+    }
+    else
+    {
+        uint32_t mask = 0;
+        for (unsigned i = 0; i < 8; ++i)
+            if (from->node(from->child(f, i)).type() != EMPTY)
+                mask |= 1 << i;
+
+        if (!mask)
+        {
+            to->tree[t] = Octree(EMPTY, 0);
+            return;
+        }
+
+        // Siblings stay together, each subtree follows as one run like in grow
+        uint64_t first = to->trees;
+        to->trees += std::popcount(mask);
+        to->tree[t] = Octree::sparse(mask, (uint32_t)first);
 
-    while (to->twigs > 0 && to->twigstoragesize > 16 && to->twigstoragesize / to->twigs >= 4)
-        to->twig = (Octwig *)realloc(to->twig, (to->twigstoragesize /= 2) * sizeof(Octwig));
+        for (unsigned i = 0, k = 0; i < 8; ++i)
+            if (mask & (1 << i))
+                sparsify(from, to, from->child(f, i), first + k++);
+    }
 }
 
+// Copies from into to without the empty children of branches. Returns false and leaves to
+// untouched if the copy could have offsets that do not fit in a sparse branch.
+bool sparsify(const Ocroot *from, Ocroot *to)
+{
+    // Every branch has at most 8 stored children
+    uint64_t twigs;
+    uint64_t trees = densetrees(from, &twigs) + 1;
+    if (trees > (uint64_t)1 << SPARSE_OFFSET_BITS)
+        return false;
 
-using glm::bvec3;
-using glm::uvec3;
+    to->position = from->position;
+    to->size = from->size;
+    to->depth = from->depth;
+    to->sparse = true;
+    to->reserve(trees, twigs);
+    to->trees = 2;
+    to->twigs = 0;
+    to->tree[SPARSE_EMPTY] = Octree(EMPTY, 0);
 
-// Returns the depth
-template <int K> 
-static int density(const Ocroot *root, uint32_t offset, vec3 bmin, float size, vec3 cmin, vec3 cmax, MisraGriesCounter<K> *c, unsigned int n)
+    sparsify(from, to, 0, 0);
+
+    to->shrink();
+    return true;
+}
+
+static void densify(const Ocroot *from, Ocroot *to, uint64_t f, uint64_t t)
 {
-    Octree t = root->tree[offset];
-    if (t.type() == EMPTY)
+    Octree tree = from->node(f);
+    if (tree.type() == TWIG)
     {
-        c->count(0, n);
-        return 1;
+        uint64_t i = to->twigs++;
+        to->twig[i] = *from->brick(tree);
+        to->tree[t] = Octree(TWIG, (uint32_t)i);
     }
-    else if (t.type() == LEAF)
+    else if (tree.type() != BRANCH)
     {
-        c->count(t.offset(), n);
-        return 1;
+        to->tree[t] = tree;
     }
-    else if (t.type() == TWIG)
+    else
     {
-        float leafsize = size / (1 << TWIG_DEPTH);
-        vec3 subtwigmin = glm::clamp((cmin - bmin) / leafsize, 0.0f, (float)TWIG_SIZE);
-        vec3 subtwigmax = glm::clamp((cmax - bmin) / leafsize, 0.0f, (float)TWIG_SIZE);
+        uint64_t first = to->trees;
+        to->trees += 8;
+        to->tree[t] = Octree(BRANCH, (uint32_t)first);
+
+        for (unsigned i = 0; i < 8; ++i)
+            densify(from, to, from->child(f, i), first + i);
+    }
+}
+
+// Copies from into to with all 8 children of every branch, keeping the structure as it is
+void densify(const Ocroot *from, Ocroot *to)
+{
+    to->position = from->position;
+    to->size = from->size;
+    to->depth = from->depth;
+    to->sparse = false;
+    uint64_t twigs;
+    uint64_t trees = densetrees(from, &twigs);
+    to->reserve(trees, twigs);
+    to->trees = 1;
+    to->twigs = 0;
 
-        unsigned int m = n / (1 << (TWIG_DEPTH*3));
-        for (unsigned z = (unsigned)subtwigmin.z; (float)z < subtwigmax.z; ++z)
+    densify(from, to, 0, 0);
+
+    to->shrink();
+}
+
+static void compact(const Ocroot *from, Ocroot *to, uint64_t f, uint64_t t)
+{
+    Octree tree = from->tree[f];
+    if (tree.shared() || tree.type() == EMPTY || tree.type() == LEAF)
+    {
+        to->tree[t] = tree;
+    }
+    else if (tree.type() == TWIG)
+    {
+        uint64_t i = to->twigs++;
+        to->twig[i] = from->twig[tree.offset()];
+        to->tree[t] = Octree(TWIG, (uint32_t)i);
+    }
+    else if (!to->sparse)
+    {
+        uint64_t first = to->trees;
+        to->trees += 8;
+        to->tree[t] = Octree(BRANCH, (uint32_t)first);
+
+        for (unsigned i = 0; i < 8; ++i)
+            compact(from, to, from->child(f, i), first + i);
+    }
+    else
+    {
+        // Groups edits filled up to 8 children become sparse again
+        uint32_t mask = 0;
+        for (unsigned i = 0; i < 8; ++i)
+            if (from->tree[from->child(f, i)].type() != EMPTY)
+                mask |= 1 << i;
+
+        if (!mask)
         {
-            for (unsigned y = (unsigned)subtwigmin.y; (float)y < subtwigmax.y; ++y)
-            {
-                for (unsigned x = (unsigned)subtwigmin.x; (float)x < subtwigmax.x; ++x)
-                {
-                    unsigned w = Octwig::word(x, y, z);
-                    c->count(root->twig[t.offset()].leaf[w], m);
-                }
-            }
+            to->tree[t] = Octree(EMPTY, 0);
+            return;
         }
 
-        return TWIG_DEPTH;
+        uint64_t first = to->trees;
+        to->trees += std::popcount(mask);
+        to->tree[t] = Octree::sparse(mask, (uint32_t)first);
+
+        for (unsigned i = 0, k = 0; i < 8; ++i)
+            if (mask & (1 << i))
+                compact(from, to, from->child(f, i), first + k++);
     }
-    else // if (t.type() == BRANCH)
+}
+
+// Only the chunk's own storage is read, dag words are copied as they are without touching
+// the dag, so this can run while other threads change it. The copy takes over the references
+// and from must be abandoned rather than released.
+void compact(const Ocroot *from, Ocroot *to)
+{
+    uint64_t branches = 0, twigs = 0;
+    reachable(from, 0, &branches, &twigs, false);
+
+    to->position = from->position;
+    to->size = from->size;
+    to->depth = from->depth;
+    to->sparse = from->sparse;
+    to->reserve(branches * 8 + 2, twigs);
+    to->trees = to->sparse ? SPARSE_EMPTY + 1 : 1;
+    to->twigs = 0;
+    if (to->sparse)
+        to->tree[SPARSE_EMPTY] = Octree(EMPTY, 0);
+
+    compact(from, to, 0, 0);
+
+    to->shrink();
+}
+
+using glm::bvec3;
+using glm::uvec3;
+
+// The voxels of the subtree at offset, a cube size voxels on a side at (x, y, z) of a grid
+// side voxels on a side
+static void voxels(const Ocroot *root, uint64_t offset, uvec3 p, unsigned size, uint16_t *grid, unsigned side)
+{
+    Octree t = root->node(offset);
+    if (t.type() == BRANCH)
     {
-        float halfsize = size * 0.5f;
-        int d = 0;
+        unsigned half = size / 2;
+        assert(half > 0);
         for (unsigned i = 0; i < 8; ++i)
         {
             bool gx, gy, gz;
             Octree::cut(i, &gx, &gy, &gz);
-            vec3 nextmin = bmin + vec3(gx, gy, gz) * halfsize;
-            vec3 nextmax = nextmin + halfsize;
-            if (cubesIntersect(cmin, cmax, nextmin, nextmax))
-                d = glm::max(d, density(root, (uint32_t)t.offset() + i, nextmin, halfsize, cmin, cmax, c, n / 8));
+            voxels(root, root->child(offset, i), p + uvec3(gx, gy, gz) * half, half, grid, side);
         }
-        return d + 1;
+        return;
     }
+
+    const Octwig *twig = t.type() == TWIG ? root->brick(t) : nullptr;
+    assert(!twig || size == TWIG_SIZE);
+    uint16_t value = t.type() == LEAF ? (uint16_t)t.offset() : 0;
+    for (unsigned z = 0; z < size; ++z)
+        for (unsigned y = 0; y < size; ++y)
+            for (unsigned x = 0; x < size; ++x)
+                grid[((p.z + z) * side + p.y + y) * side + p.x + x] = twig ? twig->get(Octwig::word(x, y, z)) : value;
 }
 
 static void lodmm(const Ocroot *from, Ocroot *to, uint32_t f, uint32_t t, size_t depth)
 {
     using glm::uvec3;
 
-    Octree tree = from->tree[f];
+    Octree tree = from->node(f);
 
     if (tree.type() != BRANCH)
     {
@@ -693,17 +1426,12 @@ static void lodmm(const Ocroot *from, Ocroot *to, uint32_t f, uint32_t t, size_t
 
         if (depth == to->depth - TWIG_LEVELS)
         {
-            // Make a new twig, sampling the average material of the twigs below
-            const float EPS = 1.0 / 256.0;
-
-            if (to->twigs >= to->twigstoragesize)
-                to->twig = (Octwig *)realloc(to->twig, (to->twigstoragesize *= 2) * sizeof(Octwig));
-
-            uint32_t i = (uint32_t)to->twigs++;
-            to->tree[t] = Octree(TWIG, i);
-            to->twig[i] = Octwig();
+            // Make a new twig, each voxel taking the most common material of the 8 below it
+            const unsigned SIDE = 2 * TWIG_SIZE;
+            uint16_t fine[SIDE * SIDE * SIDE];
+            voxels(from, f, uvec3(0), SIDE, fine, SIDE);
 
-            float leafsize = 1.0 / (1 << TWIG_LEVELS);
+            uint16_t leaf[TWIG_WORDS];
             MisraGriesCounter<8> counter;
             for (unsigned z = 0; z < TWIG_SIZE; ++z)
             {
@@ -711,40 +1439,49 @@ static void lodmm(const Ocroot *from, Ocroot *to, uint32_t f, uint32_t t, size_t
                 {
                     for (unsigned x = 0; x < TWIG_SIZE; ++x)
                     {
-                        unsigned w = Octwig::word(x, y, z);
-
-                        vec3 leafmin = vec3(x, y, z) * leafsize;
-                        vec3 leafmax = leafmin + leafsize;
-
-                        vec3 adjleafmin = leafmin + EPS;
-                        vec3 adjleafmax = leafmax - EPS;
-
                         counter.empty();
-                        unsigned int n = (1 << ((TWIG_DEPTH+1)*3)); // Initial multiplier
-                        assert(density(from, f, vec3(0), 1.0, adjleafmin, adjleafmax, &counter, n) <= (int)(from->depth - depth));
-
-                        to->twig[i].leaf[w] = (uint16_t)counter.majority();
+                        for (unsigned i = 0; i < 8; ++i)
+                        {
+                            bool gx, gy, gz;
+                            Octree::cut(i, &gx, &gy, &gz);
+                            uvec3 q = uvec3(x, y, z) * 2u + uvec3(gx, gy, gz);
+                            counter.count(fine[(q.z * SIDE + q.y) * SIDE + q.x]);
+                        }
+                        leaf[Octwig::word(x, y, z)] = (uint16_t)counter.majority();
                     }
                 }
             }
+
+            Octwig twig;
+            if (twig.pack(leaf))
+            {
+                to->growtwigs(1);
+
+                uint32_t i = (uint32_t)to->twigs++;
+                to->tree[t] = Octree(TWIG, i);
+                to->twig[i] = twig;
+            }
+            else
+            {
+                growvoxels(to, t, leaf);
+            }
         }
         else
         {
             // Same as copy algorithm, only replacing the recursive call
-            if (to->trees + 8 >= to->treestoragesize)
-                to->tree = (Octree *)realloc(to->tree, (to->treestoragesize *= 2) * sizeof(Octree));
+            to->growtrees(8);
 
             uint32_t pos = (uint32_t)to->trees;
             to->tree[t] = Octree(BRANCH, pos);
             to->trees += 8;
 
             for (int i = 0; i < 8; ++i)
-                lodmm(from, to, (uint32_t)tree.offset() + i, pos + i, depth + 1);
+                lodmm(from, to, (uint32_t)from->child(f, i), pos + i, depth + 1);
         }
     }
 }
 
-Ocroot Ocroot::lodmm()
+Ocroot Ocroot::lodmm() const
 {
     assert(depth > 1);
 
@@ -752,14 +1489,16 @@ Ocroot Ocroot::lodmm()
     to.position = position;
     to.size = size;
     to.depth = depth - 1;
+    to.sparse = false;
+    uint64_t densetwigs;
+    uint64_t dense = densetrees(this, &densetwigs);
+    to.reserve(dense, densetwigs + dense / 8 + 1);
     to.trees = 1;
     to.twigs = 0;
-    to.treestoragesize = 16;
-    to.twigstoragesize = 16;
-    to.tree = (Octree *)malloc(to.treestoragesize * sizeof(Octree));
-    to.twig = (Octwig *)malloc(to.twigstoragesize * sizeof(Octwig));
 
     ::lodmm(this, &to, 0, 0, 0);
 
+    to.shrink();
+
     return to;
 }
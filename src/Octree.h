@@ -3,7 +3,9 @@
 #ifndef OCTREE_H
 #define OCTREE_H
 
+#include <atomic>
 #include <glm/vec3.hpp>
+#include "Brick.h"
 
 enum Octype
 {
@@ -20,6 +22,13 @@ struct Octree
     Octree(uint32_t type, uint32_t offset);
     uint64_t offset();
     uint32_t type();
+    bool shared();
+
+    // Branches of sparse roots only store their non-empty children: an 8-bit mask of the
+    // stored children, and the offset of the first one in the low 21 bits
+    static Octree sparse(uint32_t mask, uint32_t first);
+    uint32_t mask();
+    uint64_t first();
 
     static unsigned branch(bool xg, bool yg, bool zg);
     static void cut(unsigned i, bool *xg, bool *yg, bool *zg);
@@ -27,22 +36,26 @@ struct Octree
 
 static_assert(sizeof(Octree) == sizeof(uint32_t));
 
-#define TWIG_DEPTH 2
-#define TWIG_LEVELS TWIG_DEPTH
-#define TWIG_SIZE 4
-#define TWIG_WORDS (8*8)
+#define SPARSE_OFFSET_BITS 21
+// Branches and twigs with this offset bit live in the dag shared by all chunks (see Dag.h),
+// where branches always store all 8 children
+#define DAG_SHARED ((uint32_t)1 << 29)
+// Word 1 of a sparse root is always empty, children missing from a mask resolve to it
+#define SPARSE_EMPTY 1
 
-struct Octwig
-{
-    uint16_t leaf[TWIG_WORDS];
+// Build with -DTWIG_DEPTH=1, 2 or 3 for 2^3, 4^3 or 8^3 bricks
+#ifndef TWIG_DEPTH
+#define TWIG_DEPTH 2
+#endif
 
-    static unsigned word(unsigned x, unsigned y, unsigned z);
+using Octwig = Brick<TWIG_DEPTH>;
 
-    Octwig() = default;
-    explicit Octwig(uint16_t v);
-};
+#define TWIG_LEVELS TWIG_DEPTH
+#define TWIG_SIZE (1 << TWIG_DEPTH)
+#define TWIG_WORDS (TWIG_SIZE * TWIG_SIZE * TWIG_SIZE)
+#define TWIG_PALETTE 4
 
-static_assert(sizeof(Octwig) == (1 << (TWIG_LEVELS * 3)) * sizeof(uint16_t));
+static_assert(TWIG_SIZE == Octwig::SIZE && TWIG_WORDS == Octwig::WORDS && TWIG_PALETTE == Octwig::PALETTE);
 
 struct Ocdelta
 {
@@ -62,22 +75,54 @@ struct Ocroot
     uint64_t  twigs;
     uint64_t  treestoragesize;
     uint64_t  twigstoragesize;
+    // Estimate of the trees and twigs edits have left unreachable
+    uint64_t  garbagetrees;
+    uint64_t  garbagetwigs;
+    // Changed since it was last saved to or loaded from a ChunkStore
     bool      modified;
+    bool      sparse;
+    // The storage is a read-only view of a region file (see ChunkStore.h) rather than arena
+    // blocks, it is copied into the arena before anything is written to it. Points at the
+    // count of roots using the view, which the store only unmaps once there are none.
+    std::atomic<uint32_t> *mapped;
     Octree   *tree;
     Octwig   *twig;
 
+    void reserve(uint64_t trees, uint64_t twigs);
+    void release();
+    void abandon();
+    bool growtrees(uint64_t count);
+    bool growtwigs(uint64_t count);
+    void own();
+    void shrink();
+    uint64_t child(uint64_t offset, unsigned i) const;
+    Octree node(uint64_t offset) const;
+    const Octwig *brick(Octree t) const;
+    Octree group(uint64_t first) const;
     void write(const char *path);
     void read(const char *path);
     void destroy(glm::vec3 cmin, glm::vec3 cmax, Ocdelta *dtree, Ocdelta *dtwig);
     void build(glm::vec3 cmin, glm::vec3 cmax, uint16_t mat, Ocdelta *dtree, Ocdelta *dtwig);
     void replace(glm::vec3 cmin, glm::vec3 cmax, uint16_t mat, Ocdelta *dtree, Ocdelta *dtwig);
     Ocroot defragcopy();
-    Ocroot lodmm();
+    Ocroot lodmm() const;
 };
 
 struct BoundsPyramid;
+struct Density;
 
 // Generate
 void grow(Ocroot *root, glm::vec3 position, float size, uint32_t depth, const BoundsPyramid *pyr);
+void growbfs(Ocroot *root, glm::vec3 position, float size, uint32_t depth, const BoundsPyramid *pyr);
+// Returns how many times the density was sampled or bounded
+uint64_t growdensity(Ocroot *root, glm::vec3 position, float size, uint32_t depth, const Density *f);
+uint16_t heightMaterial(float y);
+
+// Convert between branches with all 8 children and sparse branches
+bool sparsify(const Ocroot *from, Ocroot *to);
+void densify(const Ocroot *from, Ocroot *to);
+
+// Copies the nodes of from that are still reachable into to, moving its dag references
+void compact(const Ocroot *from, Ocroot *to);
 
 #endif
\ No newline at end of file
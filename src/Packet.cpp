@@ -0,0 +1,307 @@
+#include <math.h>
+#include <stdint.h>
+#include <algorithm>
+#include <bit>
+#include <vector>
+#include <glm/vec3.hpp>
+#include "Packet.h"
+#include "Octree.h"
+#include "Traverse.h"
+#include "World.h"
+
+#if defined(__AVX__)
+# include <immintrin.h>
+# define PACKET_AVX
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+# include <emmintrin.h>
+# define PACKET_SSE2
+#endif
+
+using glm::vec3;
+using glm::ivec3;
+using glm::uvec3;
+
+// The kernel is written once against these, each lane is one ray. Comparisons give a bit per
+// lane.
+struct ScalarLanes
+{
+    using V = float;
+    static constexpr unsigned WIDTH = 1;
+
+    static V load(const float *p) { return *p; }
+    static void store(float *p, V v) { *p = v; }
+    static V set(float f) { return f; }
+    static V sub(V a, V b) { return a - b; }
+    static V mul(V a, V b) { return a * b; }
+    static V min(V a, V b) { return a < b ? a : b; }
+    static V max(V a, V b) { return a > b ? a : b; }
+    static unsigned less(V a, V b) { return a < b; }
+};
+
+#ifdef PACKET_AVX
+struct AvxLanes
+{
+    using V = __m256;
+    static constexpr unsigned WIDTH = 8;
+
+    static V load(const float *p) { return _mm256_load_ps(p); }
+    static void store(float *p, V v) { _mm256_store_ps(p, v); }
+    static V set(float f) { return _mm256_set1_ps(f); }
+    static V sub(V a, V b) { return _mm256_sub_ps(a, b); }
+    static V mul(V a, V b) { return _mm256_mul_ps(a, b); }
+    static V min(V a, V b) { return _mm256_min_ps(a, b); }
+    static V max(V a, V b) { return _mm256_max_ps(a, b); }
+    static unsigned less(V a, V b) { return (unsigned)_mm256_movemask_ps(_mm256_cmp_ps(a, b, _CMP_LT_OQ)); }
+};
+#endif
+
+#if defined(PACKET_AVX) || defined(PACKET_SSE2)
+struct SseLanes
+{
+    using V = __m128;
+    static constexpr unsigned WIDTH = 4;
+
+    static V load(const float *p) { return _mm_load_ps(p); }
+    static void store(float *p, V v) { _mm_store_ps(p, v); }
+    static V set(float f) { return _mm_set1_ps(f); }
+    static V sub(V a, V b) { return _mm_sub_ps(a, b); }
+    static V mul(V a, V b) { return _mm_mul_ps(a, b); }
+    static V min(V a, V b) { return _mm_min_ps(a, b); }
+    static V max(V a, V b) { return _mm_max_ps(a, b); }
+    static unsigned less(V a, V b) { return (unsigned)_mm_movemask_ps(_mm_cmplt_ps(a, b)); }
+};
+#endif
+
+#if defined(PACKET_AVX) && PACKET_SIZE >= 8
+using Lanes = AvxLanes;
+#elif defined(PACKET_AVX) || defined(PACKET_SSE2)
+using Lanes = SseLanes;
+#else
+using Lanes = ScalarLanes;
+#endif
+
+// Smallest direction component, so that rays parallel to a plane get a far but finite t
+#define PACKET_MIN_DIRECTION 1e-20f
+// Deepest stack a root can need: the 7 siblings left behind at each level, and the last child
+#define PACKET_STACK (7 * 32 + 1)
+
+// The rays as the kernel wants them, with inverse directions
+struct Prepared
+{
+    alignas(64) float o[3][PACKET_SIZE];
+    alignas(64) float inv[3][PACKET_SIZE];
+    uint32_t lanes;
+    // The axes along which the first ray goes down, the child of a node it meets first
+    unsigned octant;
+};
+
+// A node to visit, active is the lanes whose rays it may still be of interest to
+struct PacketNode
+{
+    vec3 bmin;
+    float size;
+    uint64_t offset;
+    const Octwig *twig;
+    uvec3 voxel;
+    unsigned cells;
+    uint32_t active;
+};
+
+void RayPacket::set(uint32_t i, vec3 origin, vec3 direction)
+{
+    assert(i < PACKET_SIZE);
+    ox[i] = origin.x;
+    oy[i] = origin.y;
+    oz[i] = origin.z;
+    dx[i] = direction.x;
+    dy[i] = direction.y;
+    dz[i] = direction.z;
+}
+
+static void prepare(RayPacket *p, Prepared *q)
+{
+    assert(p->count > 0 && p->count <= PACKET_SIZE);
+    const float *o[3] = { p->ox, p->oy, p->oz };
+    const float *d[3] = { p->dx, p->dy, p->dz };
+    for (uint32_t i = 0; i < PACKET_SIZE; ++i)
+    {
+        // Lanes past count trace a copy of the first ray and are masked off
+        uint32_t from = i < p->count ? i : 0;
+        for (int k = 0; k < 3; ++k)
+        {
+            float dk = d[k][from];
+            if (fabsf(dk) < PACKET_MIN_DIRECTION)
+                dk = dk < 0 ? -PACKET_MIN_DIRECTION : PACKET_MIN_DIRECTION;
+            q->o[k][i] = o[k][from];
+            q->inv[k][i] = 1.0f / dk;
+        }
+        p->t[i] = INFINITY;
+    }
+    q->lanes = (1u << p->count) - 1;
+    q->octant = (p->dx[0] < 0 ? 1 : 0) | (p->dy[0] < 0 ? 2 : 0) | (p->dz[0] < 0 ? 4 : 0);
+}
+
+// The lanes of active whose rays cross the box ahead of their nearest hit so far, with where
+// they enter it in tnear
+template <typename S>
+static uint32_t boxtest(const Prepared *q, const float *best, vec3 bmin, float size, uint32_t active, float *tnear)
+{
+    using V = typename S::V;
+    const uint32_t LANES = (1u << S::WIDTH) - 1;
+
+    V lo[3] = { S::set(bmin.x), S::set(bmin.y), S::set(bmin.z) };
+    V hi[3] = { S::set(bmin.x + size), S::set(bmin.y + size), S::set(bmin.z + size) };
+    uint32_t mask = 0;
+    for (unsigned v = 0; v < PACKET_SIZE; v += S::WIDTH)
+    {
+        if (!((active >> v) & LANES))
+            continue;
+
+        V enter = S::set(0.0f);
+        V exit = S::set(INFINITY);
+        for (int k = 0; k < 3; ++k)
+        {
+            V o = S::load(q->o[k] + v);
+            V inv = S::load(q->inv[k] + v);
+            V a = S::mul(S::sub(lo[k], o), inv);
+            V b = S::mul(S::sub(hi[k], o), inv);
+            enter = S::max(enter, S::min(a, b));
+            exit = S::min(exit, S::max(a, b));
+        }
+        S::store(tnear + v, enter);
+        mask |= (S::less(enter, exit) & S::less(enter, S::load(best + v))) << v;
+    }
+    return mask & active;
+}
+
+// Traces the lanes of active through root, lowering best where they hit
+template <typename S>
+static void cast(const Prepared *q, float *best, const Ocroot *root, uint32_t active)
+{
+    PacketNode stack[PACKET_STACK];
+    alignas(64) float tnear[PACKET_SIZE];
+    int n = 0;
+    stack[n++] = { root->position, root->size, 0, nullptr, uvec3(0), 0, active };
+
+    while (n)
+    {
+        PacketNode e = stack[--n];
+        // Hits found since it was pushed may have put it behind some rays
+        uint32_t m = boxtest<S>(q, best, e.bmin, e.size, e.active, tnear);
+        if (!m)
+            continue;
+
+        // Only solid voxels are pushed, and no empty node but the root
+        bool solid = e.cells == 1;
+        if (!e.cells)
+        {
+            Octree t = root->node(e.offset);
+            if (t.type() == EMPTY)
+                continue;
+            solid = t.type() == LEAF;
+            if (t.type() == TWIG)
+            {
+                e.twig = root->brick(t);
+                e.voxel = uvec3(0);
+                e.cells = TWIG_SIZE;
+            }
+        }
+        if (solid)
+        {
+            for (uint32_t b = m; b; b &= b - 1)
+                best[std::countr_zero(b)] = tnear[std::countr_zero(b)];
+            continue;
+        }
+
+        // Farthest first, so that the child nearest to the first ray is taken next
+        float half = e.size * 0.5f;
+        for (int j = 7; j >= 0; --j)
+        {
+            unsigned i = (unsigned)j ^ q->octant;
+            PacketNode c;
+            c.bmin = e.bmin + vec3(i & 1, (i >> 1) & 1, (i >> 2) & 1) * half;
+            c.size = half;
+            c.active = m;
+            if (!e.cells)
+            {
+                c.offset = root->child(e.offset, i);
+                if (root->node(c.offset).type() == EMPTY)
+                    continue;
+                c.twig = nullptr;
+                c.cells = 0;
+            }
+            else
+            {
+                c.offset = e.offset;
+                c.twig = e.twig;
+                c.cells = e.cells / 2;
+                c.voxel = e.voxel + uvec3(i & 1, (i >> 1) & 1, (i >> 2) & 1) * c.cells;
+                if (c.cells == 1 && !c.twig->solid(Octwig::word(c.voxel.x, c.voxel.y, c.voxel.z)))
+                    continue;
+            }
+            assert(n < PACKET_STACK);
+            stack[n++] = c;
+        }
+    }
+}
+
+static uint32_t hits(const RayPacket *p, const Prepared *q)
+{
+    uint32_t mask = 0;
+    for (uint32_t i = 0; i < PACKET_SIZE; ++i)
+        if (p->t[i] < INFINITY)
+            mask |= 1u << i;
+    return mask & q->lanes;
+}
+
+uint32_t packetcast(RayPacket *p, const Ocroot *root)
+{
+    Prepared q;
+    prepare(p, &q);
+    cast<Lanes>(&q, p->t, root, q.lanes);
+    return hits(p, &q);
+}
+
+// The chunks crossed by any of the rays are visited once each, nearest first, with all the
+// rays that cross them
+uint32_t packetcast(RayPacket *p, const World *world)
+{
+    Prepared q;
+    prepare(p, &q);
+
+    struct Crossed
+    {
+        ivec3 q;
+        float t;
+        uint32_t lanes;
+    };
+    std::vector<Crossed> crossed;
+    for (uint32_t i = 0; i < p->count; ++i)
+    {
+        vec3 origin = vec3(p->ox[i], p->oy[i], p->oz[i]);
+        vec3 direction = vec3(p->dx[i], p->dy[i], p->dz[i]);
+        chunkwalk(origin, direction, world, [&](ivec3 c, float t) {
+            // Like chunkcast, a slot that does not hold its chunk yet ends the ray there, so
+            // the ray is not traced through any chunk past it and misses unless it hit before
+            const Ocroot *root = &world->chunk[world->index(c.x, c.y, c.z)];
+            if (root->position != vec3(c) * (float)world->chunksize)
+                return true;
+            for (Crossed& x : crossed)
+            {
+                if (x.q == c)
+                {
+                    x.t = glm::min(x.t, t);
+                    x.lanes |= 1u << i;
+                    return false;
+                }
+            }
+            crossed.push_back({ c, t, 1u << i });
+            return false;
+        });
+    }
+    std::sort(crossed.begin(), crossed.end(), [](const Crossed& a, const Crossed& b) { return a.t < b.t; });
+
+    for (const Crossed& x : crossed)
+        cast<Lanes>(&q, p->t, &world->chunk[world->index(x.q.x, x.q.y, x.q.z)], x.lanes);
+    return hits(p, &q);
+}
@@ -0,0 +1,42 @@
+#pragma once
+
+#ifndef PACKET_H
+#define PACKET_H
+
+#include <stdint.h>
+#include <glm/vec3.hpp>
+
+struct Ocroot;
+struct World;
+
+// Build with -DPACKET_SIZE=4, 8 or 16 for the rays traced together
+#ifndef PACKET_SIZE
+#define PACKET_SIZE 8
+#endif
+
+static_assert(PACKET_SIZE == 4 || PACKET_SIZE == 8 || PACKET_SIZE == 16);
+
+// Rays traced together, one per lane: 8 lanes to a vector with AVX, 4 with SSE2, one otherwise.
+// Every node is tested against all the rays still looking for it at once, each one's lane is
+// masked off once the node is behind its nearest hit so far. The children of a node are taken
+// in the order of the direction of the first ray, so coherent rays, like those of neighbouring
+// pixels, go front to back together. Others are still exact, just slower.
+struct RayPacket
+{
+    alignas(64) float ox[PACKET_SIZE], oy[PACKET_SIZE], oz[PACKET_SIZE];
+    alignas(64) float dx[PACKET_SIZE], dy[PACKET_SIZE], dz[PACKET_SIZE];
+    // Where each ray first enters a solid voxel, in lengths of its direction, INFINITY if it
+    // does not
+    alignas(64) float t[PACKET_SIZE];
+    // Rays from count on are not traced
+    uint32_t count;
+
+    void set(uint32_t i, glm::vec3 origin, glm::vec3 direction);
+};
+
+// Trace the rays of p through root or the world, filling in t. Return the mask of the lanes
+// that hit.
+uint32_t packetcast(RayPacket *p, const Ocroot *root);
+uint32_t packetcast(RayPacket *p, const World *world);
+
+#endif
@@ -0,0 +1,285 @@
+#include <assert.h>
+#include <math.h>
+#include <stdint.h>
+#include <glm/vec3.hpp>
+#include <glm/common.hpp>
+#include <glm/geometric.hpp>
+#include "Query.h"
+#include "Octree.h"
+#include "Traverse.h"
+#include "World.h"
+
+using glm::vec3;
+using glm::ivec3;
+
+// How far past a hit its voxel is looked up
+#define QUERY_NUDGE (1.0f / 1024.0f)
+
+SnapshotChunk::~SnapshotChunk()
+{
+    // The copy owns its storage and refers to nothing in the dag
+    if (root.tree)
+        root.abandon();
+}
+
+int WorldSnapshot::take(const World *world, const WorldSnapshot *last)
+{
+    width = world->width;
+    height = world->height;
+    depth = world->depth;
+    volume = world->volume;
+    chunksize = world->chunksize;
+    chunkcoordmin = world->chunkcoordmin;
+    chunk.resize(volume);
+
+    int copied = 0;
+    for (int i = 0; i < volume; ++i)
+    {
+        // Shifting the world hands slots chunks it had before, so they are told apart by where
+        // they are too
+        const Ocroot *from = &world->chunk[i];
+        const SnapshotChunk *had = last ? last->chunk[i].get() : nullptr;
+        if (had && had->revision == world->revision[i] && had->root.position == from->position)
+        {
+            chunk[i] = last->chunk[i];
+            continue;
+        }
+
+        // Both copy what shared subtrees the chunk has into the copy
+        SnapshotChunk *c = new SnapshotChunk();
+        if (!sparsify(from, &c->root))
+            densify(from, &c->root);
+        c->revision = world->revision[i];
+        chunk[i].reset(c);
+        ++copied;
+    }
+    return copied;
+}
+
+static int modulo(int n, int m)
+{
+    return ((n % m) + m) % m;
+}
+
+const Ocroot *WorldSnapshot::at(ivec3 q) const
+{
+    int i = modulo(q.y, height) * width * depth + modulo(q.z, depth) * width + modulo(q.x, width);
+    const Ocroot *root = &chunk[i]->root;
+    return root->position == vec3(q) * (float)chunksize ? root : nullptr;
+}
+
+void QueryBatch::clear()
+{
+    rays.clear();
+    rayhits.clear();
+    boxes.clear();
+    boxhits.clear();
+}
+
+bool QueryBatch::done()
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    return !left;
+}
+
+void QueryBatch::wait()
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    finished.wait(lock, [this]() { return !left; });
+}
+
+// Notified under the lock, so that the waiter cannot go on and free the batch before
+static void finish(QueryBatch *batch)
+{
+    std::unique_lock<std::mutex> lock(batch->mutex);
+    assert(batch->left);
+    if (!--batch->left)
+        batch->finished.notify_all();
+}
+
+void QueryService::init(const World *world, unsigned threads)
+{
+    update(world);
+    pool.init(threads);
+}
+
+void QueryService::deinit()
+{
+    // The jobs let go of their snapshots as the workers finish
+    pool.wait();
+    pool.deinit();
+    snapshot.store(nullptr);
+}
+
+int QueryService::update(const World *world)
+{
+    std::shared_ptr<const WorldSnapshot> last = snapshot.load();
+    WorldSnapshot *next = new WorldSnapshot();
+    int copied = next->take(world, last.get());
+    snapshot.store(std::shared_ptr<const WorldSnapshot>(next));
+    return copied;
+}
+
+static void cast(const WorldSnapshot *s, const RayQuery *ray, RayHit *hit);
+static void overlap(const WorldSnapshot *s, const BoxQuery *box, BoxHit *hit);
+
+void QueryService::submit(QueryBatch *batch)
+{
+    size_t rays = batch->rays.size(), boxes = batch->boxes.size();
+    uint32_t rayjobs = (uint32_t)((rays + QUERY_JOB - 1) / QUERY_JOB);
+    uint32_t boxjobs = (uint32_t)((boxes + QUERY_JOB - 1) / QUERY_JOB);
+    batch->rayhits.resize(rays);
+    batch->boxhits.resize(boxes);
+    {
+        std::unique_lock<std::mutex> lock(batch->mutex);
+        assert(!batch->left);
+        batch->left = rayjobs + boxjobs;
+    }
+
+    std::shared_ptr<const WorldSnapshot> s = snapshot.load();
+    for (uint32_t j = 0; j < rayjobs; ++j)
+    {
+        pool.submit([s, batch, j, rays]() {
+            for (size_t r = (size_t)j * QUERY_JOB; r < rays && r < (size_t)(j + 1) * QUERY_JOB; ++r)
+                ::cast(s.get(), &batch->rays[r], &batch->rayhits[r]);
+            finish(batch);
+        });
+    }
+    for (uint32_t j = 0; j < boxjobs; ++j)
+    {
+        pool.submit([s, batch, j, boxes]() {
+            for (size_t b = (size_t)j * QUERY_JOB; b < boxes && b < (size_t)(j + 1) * QUERY_JOB; ++b)
+                ::overlap(s.get(), &batch->boxes[b], &batch->boxhits[b]);
+            finish(batch);
+        });
+    }
+}
+
+void QueryService::run(QueryBatch *batch)
+{
+    submit(batch);
+    batch->wait();
+}
+
+void QueryService::cast(const RayQuery *ray, RayHit *hit) const
+{
+    ::cast(snapshot.load().get(), ray, hit);
+}
+
+void QueryService::overlap(const BoxQuery *box, BoxHit *hit) const
+{
+    ::overlap(snapshot.load().get(), box, hit);
+}
+
+static void cast(const WorldSnapshot *s, const RayQuery *ray, RayHit *hit)
+{
+    ivec3 lo = s->chunkcoordmin;
+    ivec3 hi = lo + ivec3(s->width, s->height, s->depth);
+    float extent = glm::length(ray->direction);
+    vec3 nudge = extent > 0 ? ray->direction * (QUERY_NUDGE / extent) : vec3(0);
+
+    *hit = {};
+    chunkwalk(ray->origin, ray->direction, lo, hi, (float)s->chunksize, [&](ivec3 q, float t) {
+        // Like chunkcast, a slot that does not hold its chunk yet ends the walk, and so does
+        // the end of a segment
+        const Ocroot *root = s->at(q);
+        if (t > ray->length || !root)
+            return true;
+
+        float u;
+        if (!treecast(ray->origin, ray->direction, root, &u))
+            return false;
+        if (u > ray->length)
+            return true;
+
+        hit->hit = true;
+        hit->t = u;
+        hit->point = ray->origin + ray->direction * u;
+        // The voxel is just past the point, which lies on its face, and inside this chunk
+        vec3 p = glm::clamp(hit->point + nudge, root->position, root->position + root->size);
+        if (voxelat(p, root, &hit->material, &hit->bmin, &hit->size))
+            hit->normal = cubeNormal(hit->point, hit->bmin, hit->size);
+        return true;
+    });
+}
+
+// Finds a solid voxel of the node at offset, whose box is at bmin, that the box overlaps
+static bool overlap(const Ocroot *root, uint64_t offset, vec3 bmin, float size, const BoxQuery *box, BoxHit *hit)
+{
+    using glm::all;
+    using glm::lessThan;
+
+    if (!all(lessThan(box->bmin, bmin + size)) || !all(lessThan(bmin, box->bmax)))
+        return false;
+
+    Octree t = root->node(offset);
+    if (t.type() == EMPTY)
+        return false;
+    if (t.type() == LEAF)
+    {
+        hit->hit = true;
+        hit->material = (uint16_t)t.offset();
+        hit->bmin = bmin;
+        hit->size = size;
+        return true;
+    }
+    if (t.type() == TWIG)
+    {
+        // The cells from lo to hi are the ones the box overlaps
+        float leafsize = size / TWIG_SIZE;
+        ivec3 lo = glm::clamp(ivec3(glm::floor((box->bmin - bmin) / leafsize)), ivec3(0), ivec3(TWIG_SIZE - 1));
+        ivec3 hi = glm::clamp(ivec3(glm::ceil((box->bmax - bmin) / leafsize)) - 1, ivec3(0), ivec3(TWIG_SIZE - 1));
+        const Octwig *twig = root->brick(t);
+        for (int z = lo.z; z <= hi.z; ++z)
+        {
+            for (int y = lo.y; y <= hi.y; ++y)
+            {
+                for (int x = lo.x; x <= hi.x; ++x)
+                {
+                    uint32_t word = Octwig::word(x, y, z);
+                    if (!twig->solid(word))
+                        continue;
+                    hit->hit = true;
+                    hit->material = twig->get(word);
+                    hit->bmin = bmin + vec3(x, y, z) * leafsize;
+                    hit->size = leafsize;
+                    return true;
+                }
+            }
+        }
+        return false;
+    }
+
+    float half = size * 0.5f;
+    for (unsigned i = 0; i < 8; ++i)
+    {
+        bool x, y, z;
+        Octree::cut(i, &x, &y, &z);
+        if (overlap(root, root->child(offset, i), bmin + vec3(x, y, z) * half, half, box, hit))
+            return true;
+    }
+    return false;
+}
+
+static void overlap(const WorldSnapshot *s, const BoxQuery *box, BoxHit *hit)
+{
+    float chunksize = (float)s->chunksize;
+    ivec3 lo = s->chunkcoordmin;
+    ivec3 hi = lo + ivec3(s->width, s->height, s->depth) - 1;
+    ivec3 qmin = glm::clamp(ivec3(glm::floor(box->bmin / chunksize)), lo, hi);
+    ivec3 qmax = glm::clamp(ivec3(glm::ceil(box->bmax / chunksize)) - 1, lo, hi);
+
+    *hit = {};
+    for (int y = qmin.y; y <= qmax.y; ++y)
+    {
+        for (int z = qmin.z; z <= qmax.z; ++z)
+        {
+            for (int x = qmin.x; x <= qmax.x; ++x)
+            {
+                const Ocroot *root = s->at(ivec3(x, y, z));
+                if (root && ::overlap(root, 0, root->position, root->size, box, hit))
+                    return;
+            }
+        }
+    }
+}
@@ -0,0 +1,125 @@
+#pragma once
+
+#ifndef QUERY_H
+#define QUERY_H
+
+#include <stdint.h>
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include <glm/vec3.hpp>
+#include "Jobs.h"
+#include "Octree.h"
+
+struct World;
+
+// Queries of a batch are handed to the workers this many at a time
+#define QUERY_JOB 256
+
+// A ray from origin along direction, as far as length times direction. Rays have an infinite
+// length, the segment from a to b is a with direction b - a and length 1.
+struct RayQuery
+{
+    glm::vec3 origin, direction;
+    float length;
+};
+
+// Where a ray first enters a solid voxel, in lengths of its direction, and that voxel
+struct RayHit
+{
+    bool hit;
+    float t;
+    glm::vec3 point;
+    // Of the face it enters the voxel by
+    glm::vec3 normal;
+    uint16_t material;
+    glm::vec3 bmin;
+    float size;
+};
+
+// An axis-aligned box, for collisions
+struct BoxQuery
+{
+    glm::vec3 bmin, bmax;
+};
+
+// A solid voxel the box overlaps, touching one only by a face does not count
+struct BoxHit
+{
+    bool hit;
+    uint16_t material;
+    glm::vec3 bmin;
+    float size;
+};
+
+// A copy of a chunk without dag references, so that the dag changing does not matter
+struct SnapshotChunk
+{
+    Ocroot root;
+    // The revision of the world's slot it was copied at
+    uint64_t revision;
+
+    ~SnapshotChunk();
+};
+
+// The chunks of a world as they were between two frames, for queries to read from any thread
+// while the world goes on changing. Never changed once taken, the next one shares the copies
+// of the chunks that have not changed since, by their revision.
+struct WorldSnapshot
+{
+    std::vector<std::shared_ptr<const SnapshotChunk>> chunk;
+    glm::ivec3 chunkcoordmin;
+    int width, height, depth, volume, chunksize;
+
+    // Takes the chunks of world, sharing what copies of last are up to date, returns how many
+    // it copied
+    int take(const World *world, const WorldSnapshot *last);
+    // The chunk at chunk coordinate q, null if its slot does not hold it
+    const Ocroot *at(glm::ivec3 q) const;
+};
+
+// Rays, segments and boxes to answer together. The results are filled in as the queries are
+// answered, and only to be read once done. A batch must outlive its queries.
+struct QueryBatch
+{
+    std::vector<RayQuery> rays;
+    std::vector<RayHit> rayhits;
+    std::vector<BoxQuery> boxes;
+    std::vector<BoxHit> boxhits;
+    // Jobs of this batch not finished yet
+    std::mutex mutex;
+    std::condition_variable finished;
+    uint32_t left = 0;
+
+    void clear();
+    bool done();
+    void wait();
+};
+
+// Answers batches of queries from gameplay, picking, line of sight and collisions, on a pool
+// of its own, against a snapshot of the world taken between frames. Any thread may submit
+// batches or answer single queries while the thread owning the world publishes the next
+// snapshot, each batch is answered against the one there was when it was submitted.
+struct QueryService
+{
+    JobPool pool;
+    // Swapped for the next one as a whole, batches hold on to theirs until they are done
+    std::atomic<std::shared_ptr<const WorldSnapshot>> snapshot;
+
+    void init(const World *world, unsigned threads = 0);
+    void deinit();
+    // Publishes a snapshot of the world as it is now, returns how many chunks it copied. Called
+    // by the thread owning the world, after it has changed the chunks in a frame.
+    int update(const World *world);
+    // Answers the batch on the pool and returns at once, see QueryBatch::done
+    void submit(QueryBatch *batch);
+    // Answers the batch on the pool, and waits for it
+    void run(QueryBatch *batch);
+    // Answers one query on the calling thread
+    void cast(const RayQuery *ray, RayHit *hit) const;
+    void overlap(const BoxQuery *box, BoxHit *hit) const;
+};
+
+#endif
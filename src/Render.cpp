@@ -0,0 +1,437 @@
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <atomic>
+#include <thread>
+#include <glm/vec3.hpp>
+#include <glm/vec4.hpp>
+#include <glm/common.hpp>
+#include <glm/geometric.hpp>
+#include <glm/mat4x4.hpp>
+#include <glm/matrix.hpp>
+#include "Render.h"
+#include "Packet.h"
+#include "Traverse.h"
+#include "World.h"
+#include "Util.h"
+#include "Debug.h"
+
+using glm::vec3;
+using glm::vec4;
+using glm::ivec3;
+using glm::mat4;
+
+// Packets are blocks of PACKET_X by PACKET_Y neighbouring pixels
+#define PACKET_X (PACKET_SIZE >= 8 ? 4 : 2)
+#define PACKET_Y (PACKET_SIZE / PACKET_X)
+// How far past a hit its voxel is looked up, and how far off the surface shadow rays start
+#define RENDER_NUDGE (1.0f / 1024.0f)
+
+static_assert(RENDER_TILE % PACKET_X == 0 && RENDER_TILE % PACKET_Y == 0);
+
+struct RenderMaterial
+{
+    vec3 ambient;
+    vec3 diffuse;
+    vec3 specular;
+    float shininess;
+};
+
+// ML of World.Fragment.glsl, by the materials of leaves
+static const RenderMaterial MATERIALS[8] =
+{
+    { vec3(0), vec3(0), vec3(0), 0 },                // void
+    { vec3(0.8f), vec3(0.8f), vec3(0.5f), 8 },       // stone
+    { vec3(0.8f), vec3(0.6f), vec3(0.1f), 16 },      // dirt
+    { vec3(0.8f), vec3(0.7f), vec3(0.15f), 32 },     // sand
+    { vec3(0.8f), vec3(0.9f), vec3(0.7f), 10000 },   // grass
+    { vec3(0.8f), vec3(0.5f), vec3(0), 0 },          // shroom
+    { vec3(0.8f), vec3(0.4f), vec3(1.0f), 100 },     // water
+    { vec3(0), vec3(0), vec3(0), 0 },                // void
+};
+
+void Image::init(int width, int height)
+{
+    this->width = width;
+    this->height = height;
+    rgb.assign((size_t)width * height * 3, 0);
+}
+
+bool Image::writeppm(const char *path) const
+{
+    FILE *fp = fopen(path, "wb");
+    if (!fp)
+        return false;
+    fprintf(fp, "P6\n%d %d\n255\n", width, height);
+    bool ok = fwrite(rgb.data(), 1, rgb.size(), fp) == rgb.size();
+    return fclose(fp) == 0 && ok;
+}
+
+static uint32_t crc32(const uint8_t *p, size_t n, uint32_t crc)
+{
+    static uint32_t table[256];
+    if (!table[1])
+    {
+        for (uint32_t i = 0; i < 256; ++i)
+        {
+            uint32_t c = i;
+            for (int k = 0; k < 8; ++k)
+                c = c & 1 ? 0xedb88320u ^ (c >> 1) : c >> 1;
+            table[i] = c;
+        }
+    }
+    crc = ~crc;
+    for (size_t i = 0; i < n; ++i)
+        crc = table[(crc ^ p[i]) & 0xff] ^ (crc >> 8);
+    return ~crc;
+}
+
+static void bigendian(std::vector<uint8_t> *out, uint32_t v)
+{
+    for (int k = 3; k >= 0; --k)
+        out->push_back((uint8_t)(v >> (k * 8)));
+}
+
+static void chunk(std::vector<uint8_t> *png, const char *type, const std::vector<uint8_t>& data)
+{
+    bigendian(png, (uint32_t)data.size());
+    size_t start = png->size();
+    png->insert(png->end(), type, type + 4);
+    png->insert(png->end(), data.begin(), data.end());
+    bigendian(png, crc32(png->data() + start, png->size() - start, 0));
+}
+
+// Uncompressed, as stored deflate blocks, so that no library is needed
+bool Image::writepng(const char *path) const
+{
+    static const uint8_t SIGNATURE[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n' };
+    std::vector<uint8_t> png(SIGNATURE, SIGNATURE + 8);
+
+    std::vector<uint8_t> header;
+    bigendian(&header, (uint32_t)width);
+    bigendian(&header, (uint32_t)height);
+    // 8 bits per channel, RGB, deflate, no filter, no interlace
+    uint8_t rest[5] = { 8, 2, 0, 0, 0 };
+    header.insert(header.end(), rest, rest + 5);
+    chunk(&png, "IHDR", header);
+
+    // Every row starts with its filter, none
+    std::vector<uint8_t> raw;
+    size_t row = (size_t)width * 3;
+    for (int y = 0; y < height; ++y)
+    {
+        raw.push_back(0);
+        raw.insert(raw.end(), rgb.begin() + y * row, rgb.begin() + (y + 1) * row);
+    }
+
+    std::vector<uint8_t> z = { 0x78, 0x01 };
+    for (size_t i = 0; i < raw.size() || i == 0; i += 65535)
+    {
+        size_t n = glm::min(raw.size() - i, (size_t)65535);
+        z.push_back(i + n == raw.size() ? 1 : 0);
+        z.push_back((uint8_t)n);
+        z.push_back((uint8_t)(n >> 8));
+        z.push_back((uint8_t)~n);
+        z.push_back((uint8_t)(~n >> 8));
+        z.insert(z.end(), raw.begin() + i, raw.begin() + i + n);
+    }
+    uint32_t a = 1, b = 0;
+    for (uint8_t c : raw)
+    {
+        a = (a + c) % 65521;
+        b = (b + a) % 65521;
+    }
+    bigendian(&z, b << 16 | a);
+    chunk(&png, "IDAT", z);
+    chunk(&png, "IEND", {});
+
+    FILE *fp = fopen(path, "wb");
+    if (!fp)
+        return false;
+    bool ok = fwrite(png.data(), 1, png.size(), fp) == png.size();
+    return fclose(fp) == 0 && ok;
+}
+
+// A camera over the middle of the world looking down at the terrain, lit like Main starts out
+void RenderScene::init(const World *world, int width, int height)
+{
+    vec3 lo = vec3(world->chunkcoordmin * world->chunksize);
+    vec3 extent = vec3(world->width, world->height, world->depth) * (float)world->chunksize;
+
+    camera.position = lo + extent * vec3(0.5f, 0.9f, 0.05f);
+    camera.yaw_deg = 0;
+    camera.pitch_deg = 30;
+    camera.roll_deg = 0;
+    camera.near = 0.125f;
+    camera.far = 8192.0f;
+    camera.fov_deg = 90;
+    camera.width = width;
+    camera.height = height;
+
+    point.position = vec3(50, 8, 65);
+    point.color = vec3(0.8, 0.6, 0.2);
+    point.ambient = vec3(0.1);
+    point.diffuse = vec3(0.5);
+    point.specular = vec3(1);
+    point.constant = 1.0;
+    point.linear = 0.14;
+    point.quadratic = 0.09;
+
+    directional.position = vec3(250, 125, 250);
+    directional.direction = glm::normalize(vec3(1, -1, 0));
+    directional.ambient = vec3(0.2, 0.3, 0.4);
+    directional.diffuse = vec3(0.3, 0.3, 0.6);
+    directional.specular = vec3(0);
+
+    spot.position = vec3(50, 20, 70);
+    spot.direction = glm::normalize(vec3(-0.1, -1.0, -0.1));
+    spot.ambient = vec3(0.2, 0.8, 0.3);
+    spot.diffuse = vec3(0.2, 0.8, 0.3);
+    spot.specular = vec3(1);
+    spot.phi_deg = 25.0;
+    spot.gamma_deg = 35.0;
+    spot.constant = 1.0;
+    spot.linear = 0.045;
+    spot.quadratic = 0.0075;
+
+    shadows = true;
+}
+
+bool TileQueue::pop(int *tile)
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    if (tiles.empty())
+        return false;
+    *tile = tiles.front();
+    tiles.pop_front();
+    return true;
+}
+
+bool TileQueue::steal(int *tile)
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    if (tiles.empty())
+        return false;
+    *tile = tiles.back();
+    tiles.pop_back();
+    return true;
+}
+
+void Renderer::init(unsigned threads)
+{
+    if (threads == 0)
+        threads = std::thread::hardware_concurrency();
+    if (threads == 0)
+        threads = 1;
+    this->threads = threads;
+    stats = {};
+}
+
+// The material and box of the voxel at p, false if there is none
+static bool voxel(const World *world, vec3 p, uint16_t *material, vec3 *bmin, float *size)
+{
+    ivec3 q = world->index_float(p);
+    return voxelat(p, &world->chunk[world->index(q.x, q.y, q.z)], material, bmin, size);
+}
+
+static float attenuation(float kc, float kl, float kq, float d)
+{
+    return 1.0f / (kc + kl * d + kq * d * d);
+}
+
+// The Blinn-Phong terms of a light as in World.Fragment.glsl, l is towards the light
+static void blinnphong(vec3 l, vec3 n, vec3 p, vec3 e, const RenderMaterial *m, vec3 *diffuse, vec3 *specular)
+{
+    vec3 v = glm::normalize(e - p);
+    vec3 h = glm::normalize(l + v);
+    float d = glm::max(glm::dot(n, l), 0.0f);
+    float s = powf(glm::max(glm::dot(v, h), 0.0f), m->shininess);
+    *diffuse = d * m->diffuse;
+    *specular = s * m->specular;
+}
+
+static vec3 shade(const World *world, const RenderScene *scene, vec3 eye, vec3 beta, float sigma, uint64_t *rays)
+{
+    vec3 point = eye + beta * sigma;
+    uint16_t material;
+    vec3 bmin;
+    float size;
+    if (!voxel(world, point + beta * RENDER_NUDGE, &material, &bmin, &size))
+        return vec3(0);
+    const RenderMaterial *m = &MATERIALS[material < 8 ? material : 0];
+    vec3 normal = cubeNormal(point, bmin, size);
+
+    float shadow = 0;
+    if (scene->shadows)
+    {
+        vec3 sigma;
+        ++*rays;
+        shadow = chunkcast(point + normal * RENDER_NUDGE, -scene->directional.direction, world, &sigma) ? 1.0f : 0.0f;
+    }
+
+    vec3 color = vec3(0), diffuse, specular;
+    {
+        const PointLight *light = &scene->point;
+        blinnphong(glm::normalize(light->position - point), normal, point, eye, m, &diffuse, &specular);
+        vec3 ambient = light->ambient * m->diffuse;
+        float att = attenuation(light->constant, light->linear, light->quadratic, glm::distance(point, light->position));
+        color += (ambient + (light->diffuse * diffuse + light->specular * specular) * (1.0f - shadow)) * att;
+    }
+    {
+        const DirectionalLight *light = &scene->directional;
+        blinnphong(glm::normalize(-light->direction), normal, point, eye, m, &diffuse, &specular);
+        vec3 ambient = light->ambient * m->diffuse;
+        color += ambient + (light->diffuse * diffuse + light->specular * specular) * (1.0f - shadow);
+    }
+    {
+        const Spotlight *light = &scene->spot;
+        vec3 l = glm::normalize(light->position - point);
+        blinnphong(l, normal, point, eye, m, &diffuse, &specular);
+        vec3 ambient = light->ambient * m->diffuse;
+        float att = attenuation(light->constant, light->linear, light->quadratic, glm::distance(point, light->position));
+        float cosphi = cosf(glm::radians(light->phi_deg)), cosgamma = cosf(glm::radians(light->gamma_deg));
+        float theta = glm::dot(l, glm::normalize(-light->direction));
+        float intensity = glm::clamp((theta - cosgamma) / (cosphi - cosgamma), 0.0f, 1.0f);
+        color += (ambient + (light->diffuse * diffuse + light->specular * specular) * (1.0f - shadow) * intensity) * att;
+    }
+    return color;
+}
+
+// Traces the pixels of a tile, a packet at a time, returns the rays it took
+static uint64_t trace(const World *world, const RenderScene *scene, const mat4& unproject, Image *image, int tile)
+{
+    int across = (image->width + RENDER_TILE - 1) / RENDER_TILE;
+    int x0 = tile % across * RENDER_TILE, y0 = tile / across * RENDER_TILE;
+    int x1 = glm::min(x0 + RENDER_TILE, image->width), y1 = glm::min(y0 + RENDER_TILE, image->height);
+    vec3 eye = scene->camera.position;
+
+    RayPacket packet;
+    int px[PACKET_SIZE], py[PACKET_SIZE];
+    vec3 beta[PACKET_SIZE];
+    uint64_t rays = 0;
+    for (int by = y0; by < y1; by += PACKET_Y)
+    {
+        for (int bx = x0; bx < x1; bx += PACKET_X)
+        {
+            packet.count = 0;
+            for (int y = by; y < glm::min(by + PACKET_Y, y1); ++y)
+            {
+                for (int x = bx; x < glm::min(bx + PACKET_X, x1); ++x)
+                {
+                    // Through the far plane at the middle of the pixel, like the rasterizer
+                    vec4 ndc = vec4((x + 0.5f) / image->width * 2 - 1, 1 - (y + 0.5f) / image->height * 2, 1, 1);
+                    vec4 far = unproject * ndc;
+                    uint32_t i = packet.count++;
+                    px[i] = x;
+                    py[i] = y;
+                    beta[i] = glm::normalize(vec3(far) / far.w - eye);
+                    packet.set(i, eye, beta[i]);
+                }
+            }
+
+            packetcast(&packet, world);
+            rays += packet.count;
+            for (uint32_t i = 0; i < packet.count; ++i)
+            {
+                vec3 color = packet.t[i] < INFINITY ? shade(world, scene, eye, beta[i], packet.t[i], &rays) : vec3(0);
+                uint8_t *out = &image->rgb[((size_t)py[i] * image->width + px[i]) * 3];
+                for (int k = 0; k < 3; ++k)
+                    out[k] = (uint8_t)(glm::clamp(color[k], 0.0f, 1.0f) * 255 + 0.5f);
+            }
+        }
+    }
+    return rays;
+}
+
+// Deals the tiles out in runs of neighbours, one run to each thread, which steal from the
+// others once they are done with their own
+void Renderer::render(const World *world, const RenderScene *scene, Image *image)
+{
+    int across = (image->width + RENDER_TILE - 1) / RENDER_TILE;
+    int down = (image->height + RENDER_TILE - 1) / RENDER_TILE;
+    int count = across * down;
+
+    std::vector<TileQueue> queues(threads);
+    for (int k = 0; k < count; ++k)
+        queues[(uint64_t)k * threads / count].tiles.push_back(k);
+
+    PerspectiveCamera camera = scene->camera;
+    mat4 unproject = glm::inverse(camera.proj() * camera.view());
+
+    std::atomic<uint64_t> rays = 0, stolen = 0;
+    auto work = [&](unsigned self) {
+        uint64_t r = 0, s = 0;
+        for ( ; ; )
+        {
+            int tile;
+            bool found = queues[self].pop(&tile);
+            for (unsigned k = 1; k < threads && !found; ++k)
+                if ((found = queues[(self + k) % threads].steal(&tile)))
+                    ++s;
+            if (!found)
+                break;
+            r += trace(world, scene, unproject, image, tile);
+        }
+        rays += r;
+        stolen += s;
+    };
+
+    Counter sw;
+    sw.start();
+    std::vector<std::thread> workers;
+    for (unsigned i = 1; i < threads; ++i)
+        workers.emplace_back(work, i);
+    work(0);
+    for (std::thread& t : workers)
+        t.join();
+
+    stats.rays = rays;
+    stats.tiles = count;
+    stats.stolen = stolen;
+    stats.seconds = sw.elapsed();
+}
+
+int render(int argc, char **argv)
+{
+    if (argc != 1 && argc != 3 && argc != 4)
+    {
+        printf("usage: octree render <file.png|file.ppm> [width height [threads]]\n");
+        return 1;
+    }
+    const char *path = argv[0];
+    int width = argc > 1 ? atoi(argv[1]) : 640;
+    int height = argc > 1 ? atoi(argv[2]) : 360;
+    unsigned threads = argc > 3 ? (unsigned)atoi(argv[3]) : 0;
+    if (width <= 0 || height <= 0)
+        die("Bad image size %dx%d\n", width, height);
+
+    Counter sw;
+    World world;
+    SW_START(sw, "Generating world");
+    world.init(4, 4, 4, 128);
+    SW_STOP(sw);
+
+    RenderScene scene;
+    scene.init(&world, width, height);
+    Renderer renderer;
+    renderer.init(threads);
+    Image image;
+    image.init(width, height);
+    renderer.render(&world, &scene, &image);
+
+    const RenderStats *s = &renderer.stats;
+    printf("%dx%d on %u threads in %.3f s, %.3f Mrays/s, %llu of %llu tiles stolen\n", width, height, renderer.threads,
+        s->seconds, s->rays / s->seconds / 1e6, (unsigned long long)s->stolen, (unsigned long long)s->tiles);
+
+    size_t n = strlen(path);
+    bool png = n > 4 && !strcmp(path + n - 4, ".png");
+    bool ok = png ? image.writepng(path) : image.writeppm(path);
+    world.deinit();
+    if (!ok)
+    {
+        fprintf(stderr, "Could not write %s\n", path);
+        return 1;
+    }
+    return 0;
+}
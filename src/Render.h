@@ -0,0 +1,74 @@
+#pragma once
+
+#ifndef RENDER_H
+#define RENDER_H
+
+#include <stdint.h>
+#include <deque>
+#include <mutex>
+#include <vector>
+#include "Camera.h"
+#include "Light.h"
+
+struct World;
+
+// Side of the square tiles a frame is cut into, in pixels
+#define RENDER_TILE 16
+
+// RGB bytes, rows from the top
+struct Image
+{
+    int width, height;
+    std::vector<uint8_t> rgb;
+
+    void init(int width, int height);
+    bool writeppm(const char *path) const;
+    bool writepng(const char *path) const;
+};
+
+// What a frame shows and how it is lit, the lights of World.Fragment.glsl
+struct RenderScene
+{
+    PerspectiveCamera camera;
+    PointLight point;
+    DirectionalLight directional;
+    Spotlight spot;
+    // Trace a ray towards the directional light from every hit, like its shadow map does
+    bool shadows;
+
+    void init(const World *world, int width, int height);
+};
+
+// The tiles of one worker. It takes them from the front, others steal from the back once
+// they run out of their own, so that each one mostly stays on neighbouring tiles.
+struct TileQueue
+{
+    std::mutex mutex;
+    std::deque<int> tiles;
+
+    bool pop(int *tile);
+    bool steal(int *tile);
+};
+
+struct RenderStats
+{
+    uint64_t rays, tiles, stolen;
+    double seconds;
+};
+
+// Traces frames of a world on the CPU with every core and no GL: primary rays go through
+// packetcast a packet at a time, shading is that of the world shader with the colours of its
+// material table in place of the texture atlas.
+struct Renderer
+{
+    unsigned threads;
+    RenderStats stats;
+
+    void init(unsigned threads = 0);
+    void render(const World *world, const RenderScene *scene, Image *image);
+};
+
+// Renders the generated world to a PPM or PNG file from the command line, needs no window
+int render(int argc, char **argv);
+
+#endif
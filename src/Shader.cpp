@@ -84,3 +84,10 @@ Shader& Shader::include(const char *path)
     delete[] glss;
     return *this;
 }
+
+// Injected like an include, so it applies to the includes after it and the next shader compiled
+Shader& Shader::define(const char *name, size_t value)
+{
+    includes.push_back("#define " + std::string(name) + " " + std::to_string(value) + "\n");
+    return *this;
+}
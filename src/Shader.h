@@ -14,6 +14,7 @@ struct Shader
     Shader(unsigned int p) : program(p) {}
 
     Shader& include(const char *path);
+    Shader& define(const char *name, size_t value);
     Shader& compile(const char *path, unsigned int type);
     Shader& vertex(const char *path);
     Shader& fragment(const char *path);
@@ -0,0 +1,151 @@
+#include <bit>
+#include <stdio.h>
+#include <glm/common.hpp>
+#include "Stats.h"
+#include "Octree.h"
+#include "Dag.h"
+#include "World.h"
+
+uint64_t Ocstats::usedbytes() const
+{
+    return trees * sizeof(Octree) + twigs * sizeof(Octwig);
+}
+
+uint64_t Ocstats::reservedbytes() const
+{
+    return treestoragesize * sizeof(Octree) + twigstoragesize * sizeof(Octwig);
+}
+
+double Ocstats::monoratio() const
+{
+    return twignodes ? (double)monotwigs / twignodes : 0.0;
+}
+
+static void walk(const Ocroot *root, uint64_t offset, uint32_t depth, bool shared, Ocstats *s)
+{
+    Octree t = root->node(offset);
+    shared = shared || t.shared();
+
+    s->nodes[t.type()] += 1;
+    s->depth[glm::min(depth, (uint32_t)STATS_MAX_DEPTH - 1)] += 1;
+    if (shared)
+        s->sharednodes += 1;
+
+    if (t.type() == TWIG)
+    {
+        s->twignodes += 1;
+        if (root->brick(t)->mono() >= 0)
+            s->monotwigs += 1;
+        if (!shared)
+            s->reachabletwigs += 1;
+    }
+    else if (t.type() == BRANCH)
+    {
+        if (!shared)
+            s->reachabletrees += root->sparse ? std::popcount(t.mask()) : 8;
+        for (unsigned i = 0; i < 8; ++i)
+            walk(root, root->child(offset, i), depth + 1, shared, s);
+    }
+}
+
+void stats(const Ocroot *root, Ocstats *s)
+{
+    s->roots += 1;
+    s->trees += root->trees;
+    s->twigs += root->twigs;
+    s->treestoragesize += root->treestoragesize;
+    s->twigstoragesize += root->twigstoragesize;
+    s->garbagetrees += root->garbagetrees;
+    s->garbagetwigs += root->garbagetwigs;
+    if (!root->tree)
+        return;
+
+    // The root word, and the empty word missing children of sparse roots resolve to
+    s->reachabletrees += root->sparse ? 2 : 1;
+    walk(root, 0, 0, false, s);
+}
+
+void stats(const World *world, Ocstats *s)
+{
+    for (int i = 0; i < world->volume; ++i)
+        stats(&world->chunk[i], s);
+}
+
+static void writefields(FILE *f, const Ocstats *s, const char *indent)
+{
+    static const char *types[] = { "empty", "leaf", "branch", "twig" };
+
+    fprintf(f, "%s\"roots\": %llu,\n", indent, (unsigned long long)s->roots);
+    fprintf(f, "%s\"nodes\": {", indent);
+    for (int i = 0; i < 4; ++i)
+        fprintf(f, "%s\"%s\": %llu", i ? ", " : " ", types[i], (unsigned long long)s->nodes[i]);
+    fprintf(f, ", \"shared\": %llu },\n", (unsigned long long)s->sharednodes);
+
+    int levels = STATS_MAX_DEPTH;
+    while (levels > 0 && !s->depth[levels - 1])
+        --levels;
+    fprintf(f, "%s\"depth\": [", indent);
+    for (int i = 0; i < levels; ++i)
+        fprintf(f, "%s%llu", i ? ", " : " ", (unsigned long long)s->depth[i]);
+    fprintf(f, " ],\n");
+
+    fprintf(f, "%s\"twigs\": { \"reached\": %llu, \"mono\": %llu, \"monoratio\": %f },\n", indent,
+        (unsigned long long)s->twignodes, (unsigned long long)s->monotwigs, s->monoratio());
+    fprintf(f, "%s\"trees\": { \"reachable\": %llu, \"used\": %llu, \"reserved\": %llu, \"garbage\": %llu },\n", indent,
+        (unsigned long long)s->reachabletrees, (unsigned long long)s->trees,
+        (unsigned long long)s->treestoragesize, (unsigned long long)s->garbagetrees);
+    fprintf(f, "%s\"bricks\": { \"reachable\": %llu, \"used\": %llu, \"reserved\": %llu, \"garbage\": %llu },\n", indent,
+        (unsigned long long)s->reachabletwigs, (unsigned long long)s->twigs,
+        (unsigned long long)s->twigstoragesize, (unsigned long long)s->garbagetwigs);
+    fprintf(f, "%s\"bytes\": { \"used\": %llu, \"reserved\": %llu }\n", indent,
+        (unsigned long long)s->usedbytes(), (unsigned long long)s->reservedbytes());
+}
+
+void writejson(FILE *f, const Ocstats *s)
+{
+    fprintf(f, "{\n");
+    writefields(f, s, "  ");
+    fprintf(f, "}\n");
+}
+
+template <typename C>
+static void writecache(FILE *f, const char *name, const C *cache, const char *comma)
+{
+    fprintf(f, "    \"%s\": { \"entries\": %zu, \"bytes\": %zu, \"limit\": %zu, \"hits\": %llu, \"misses\": %llu, \"evictions\": %llu }%s\n",
+        name, cache->map.size(), cache->bytes, cache->limit, (unsigned long long)cache->hits,
+        (unsigned long long)cache->misses, (unsigned long long)cache->evictions, comma);
+}
+
+void writejson(FILE *f, const World *world)
+{
+    Ocstats s = {};
+    stats(world, &s);
+
+    // Dag words are only ever reached through the chunks, so the store has no tree of its own
+    const Ocroot *store = &ocdag.store;
+    Ocstats d = {};
+    d.trees = store->trees;
+    d.twigs = store->twigs;
+    d.treestoragesize = store->treestoragesize;
+    d.twigstoragesize = store->twigstoragesize;
+
+    fprintf(f, "{\n");
+    fprintf(f, "  \"chunks\": {\n");
+    writefields(f, &s, "    ");
+    fprintf(f, "  },\n");
+    fprintf(f, "  \"dag\": {\n");
+    fprintf(f, "    \"groups\": %zu,\n", ocdag.groups.size());
+    fprintf(f, "    \"twigs\": %zu,\n", ocdag.twigs.size());
+    fprintf(f, "    \"trees\": { \"used\": %llu, \"reserved\": %llu },\n",
+        (unsigned long long)d.trees, (unsigned long long)d.treestoragesize);
+    fprintf(f, "    \"bricks\": { \"used\": %llu, \"reserved\": %llu },\n",
+        (unsigned long long)d.twigs, (unsigned long long)d.twigstoragesize);
+    fprintf(f, "    \"bytes\": { \"used\": %llu, \"reserved\": %llu }\n",
+        (unsigned long long)d.usedbytes(), (unsigned long long)d.reservedbytes());
+    fprintf(f, "  },\n");
+    fprintf(f, "  \"cache\": {\n");
+    writecache(f, "chunks", &world->chunkcache, ",");
+    writecache(f, "heightmaps", &world->heightmapcache, "");
+    fprintf(f, "  }\n");
+    fprintf(f, "}\n");
+}
@@ -0,0 +1,47 @@
+#pragma once
+
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+struct Ocroot;
+struct World;
+
+#define STATS_MAX_DEPTH 32
+
+// Shape and memory use of a tree, or of all the chunks of a world added up. Nodes are
+// counted as the tree reads: missing children of sparse branches count as empty nodes, and
+// subtrees in the dag count once for every chunk that refers to them. Words, on the other
+// hand, are the ones the chunk itself stores.
+struct Ocstats
+{
+    uint64_t roots;
+    // Nodes by Octype and by depth, and the ones found in the dag
+    uint64_t nodes[4];
+    uint64_t depth[STATS_MAX_DEPTH];
+    uint64_t sharednodes;
+    // Twigs reached, and the ones with a single material that could have been leaves
+    uint64_t twignodes;
+    uint64_t monotwigs;
+    // Words and twigs still reachable from the root, in use, and allocated
+    uint64_t reachabletrees, reachabletwigs;
+    uint64_t trees, twigs;
+    uint64_t treestoragesize, twigstoragesize;
+    uint64_t garbagetrees, garbagetwigs;
+
+    uint64_t usedbytes() const;
+    uint64_t reservedbytes() const;
+    double monoratio() const;
+};
+
+// Both add to s, which starts out zeroed
+void stats(const Ocroot *root, Ocstats *s);
+void stats(const World *world, Ocstats *s);
+
+void writejson(FILE *f, const Ocstats *s);
+// Also reports the dag shared by the chunks
+void writejson(FILE *f, const World *world);
+
+#endif
@@ -1,3 +1,4 @@
+#include <math.h>
 #include <glm/vec3.hpp>
 #include <glm/gtc/matrix_transform.hpp>
 #include "Traverse.h"
@@ -36,37 +37,97 @@ Tree traverse(vec3 p, const Ocroot *root)
     Tree t = Tree(root->position, root->size, 0);
     for ( ; ; )
     {
-        if (root->tree[t.offset].type() != BRANCH) return t;
+        if (root->node(t.offset).type() != BRANCH) return t;
         float halfsize = t.size * 0.5f;
         vec3 mid = t.bmin + halfsize;
         bvec3 ge = greaterThanEqual(p, mid);
         vec3 bmin = t.bmin + (vec3)ge * halfsize;
         uint64_t i = Octree::branch(ge.x, ge.y, ge.z);
-        uint64_t next = root->tree[t.offset].offset() + i;
+        uint64_t next = root->child(t.offset, i);
         t = Tree(bmin, halfsize, next);
     }
 }
 
-bool twigmarch(vec3 a, vec3 b, vec3 bmin, float size, float leafsize, const Octwig *twig, float *s)
+// The material and box of the voxel of root at p, false if there is none
+bool voxelat(vec3 p, const Ocroot *root, uint16_t *material, vec3 *bmin, float *size)
 {
-    vec3 bmax = bmin + size;
-    float t = 0.0;
-    for (int c = 0; c < 1000; ++c)
+    if (!isInsideCube(p, root->position, root->position + root->size))
+        return false;
+
+    Tree t = traverse(p, root);
+    Octree node = root->node(t.offset);
+    if (node.type() == LEAF)
     {
-        vec3 p = a + b * t;
-        if (!isInsideCube(p, bmin, bmax)) return false;
-        ivec3 off = ivec3((p - bmin) / leafsize);
-        if (!isInsideCube(off, vec3(0), vec3(TWIG_SIZE-1))) return false;
-        uint32_t word = Octwig::word(off.x, off.y, off.z);
-        if (twig->leaf[word] != 0)
+        *material = (uint16_t)node.offset();
+        *bmin = t.bmin;
+        *size = t.size;
+        return true;
+    }
+    if (node.type() != TWIG)
+        return false;
+
+    float leafsize = t.size / TWIG_SIZE;
+    ivec3 i = glm::clamp(ivec3((p - t.bmin) / leafsize), ivec3(0), ivec3(TWIG_SIZE - 1));
+    *material = root->brick(node)->get(Octwig::word(i.x, i.y, i.z));
+    *bmin = t.bmin + vec3(i) * leafsize;
+    *size = leafsize;
+    return *material != 0;
+}
+
+// The normal of the face of the box nearest to p
+vec3 cubeNormal(vec3 p, vec3 bmin, float size)
+{
+    vec3 n = (p - (bmin + size * 0.5f)) / (size * 0.5f);
+    vec3 a = glm::abs(n);
+    int k = a.x > a.y ? (a.x > a.z ? 0 : 2) : (a.y > a.z ? 1 : 2);
+    vec3 r = vec3(0);
+    r[k] = n[k] < 0 ? -1.0f : 1.0f;
+    return r;
+}
+
+// A 3D-DDA over the cells of the twig: the next face of each axis is kept as the distance
+// to it, the nearest one is crossed at every step, so no cell is visited twice and the
+// voxel is never looked up from a point nudged past a face
+bool twigmarch(vec3 a, vec3 b, vec3 bmin, float size, float leafsize, const Octwig *twig, float *s, uint32_t *steps)
+{
+    if (!isInsideCube(a, bmin, bmin + size)) return false;
+
+    vec3 u = (a - bmin) / leafsize;
+    ivec3 cell, step;
+    vec3 next, delta;
+    for (int k = 0; k < 3; ++k)
+    {
+        // On a face between cells, the cell is the one the ray goes into
+        cell[k] = (int)(b[k] < 0 ? ceilf(u[k]) - 1 : floorf(u[k]));
+        step[k] = b[k] < 0 ? -1 : 1;
+        if (b[k] == 0)
+        {
+            next[k] = INFINITY;
+            delta[k] = INFINITY;
+            continue;
+        }
+        next[k] = ((float)cell[k] + (b[k] > 0) - u[k]) * leafsize / b[k];
+        delta[k] = leafsize / fabsf(b[k]);
+    }
+
+    float t = 0.0f;
+    for (uint32_t c = 1; ; ++c)
+    {
+        // Only the axis just stepped along can leave, but a starts on any face of the twig
+        if (!isInsideCube(cell, vec3(0), vec3(TWIG_SIZE - 1)))
+            break;
+        assert(c <= 3 * TWIG_SIZE - 2);
+        if (steps)
+            ++*steps;
+        if (twig->solid(Octwig::word(cell.x, cell.y, cell.z)))
         {
             *s = t;
             return true;
         }
-        vec3 leafmin = bmin + vec3(off) * leafsize;
-        vec3 leafmax = leafmin + leafsize;
-        float escape = cubeEscapeDistance(p, b, leafmin, leafmax);
-        t += escape + EPS;
+        int k = next.x < next.y ? (next.x < next.z ? 0 : 2) : (next.y < next.z ? 1 : 2);
+        t = next[k];
+        next[k] += delta[k];
+        cell[k] += step[k];
     }
     return false;
 }
@@ -82,7 +143,7 @@ bool treemarch(vec3 a, vec3 b, const Ocroot *root, float *s)
         if (!isInsideCube(p, rmin, rmax)) return false;
 
         Tree tree = traverse(p, root);
-        uint32_t type = root->tree[tree.offset].type();
+        uint32_t type = root->node(tree.offset).type();
         if (type == EMPTY)
         {
             float escape = cubeEscapeDistance(p, b, tree.bmin, tree.bmin + tree.size);
@@ -96,7 +157,7 @@ bool treemarch(vec3 a, vec3 b, const Ocroot *root, float *s)
         else if (type == TWIG)
         {
             float leafsize = tree.size / (1 << TWIG_LEVELS);
-            if (twigmarch(p, b, tree.bmin, tree.size, leafsize, &root->twig[root->tree[tree.offset].offset()], s))
+            if (twigmarch(p, b, tree.bmin, tree.size, leafsize, root->brick(root->node(tree.offset)), s))
             {
                 *s += t;
                 return true;
@@ -112,6 +173,170 @@ bool treemarch(vec3 a, vec3 b, const Ocroot *root, float *s)
     return false;
 }
 
+// A node whose children treecast is walking: a branch, or a cell of a twig with voxels of
+// the twig for children. t0 and t1 are where the mirrored ray crosses its lower and upper
+// planes, next is the child to visit after the current one, 8 once there are none left.
+struct Cast
+{
+    vec3 t0, t1;
+    uint64_t offset;
+    const Octwig *twig;
+    glm::uvec3 voxel;
+    unsigned cells;
+    unsigned next;
+};
+
+enum CastResult { CAST_SKIP, CAST_HIT, CAST_ENTER };
+
+// Deepest stack a root can need, a frame per level from the root down to single voxels
+#define CAST_DEPTH 32
+// Smallest direction component, so that rays parallel to a plane get a far but finite t
+#define CAST_MIN_DIRECTION 1e-20f
+
+static float maxof(vec3 v)
+{
+    return max(max(v.x, v.y), v.z);
+}
+
+static float minof(vec3 v)
+{
+    return min(min(v.x, v.y), v.z);
+}
+
+// The first child of a node the ray crosses: the one holding the point where it enters, found
+// from which planes through the middle it crosses before that
+static unsigned firstchild(vec3 t0, vec3 tm)
+{
+    float enter = maxof(t0);
+    unsigned i = 0;
+    if (t0.x == enter)
+        i = (tm.y < enter ? 2 : 0) | (tm.z < enter ? 4 : 0);
+    else if (t0.y == enter)
+        i = (tm.x < enter ? 1 : 0) | (tm.z < enter ? 4 : 0);
+    else
+        i = (tm.x < enter ? 1 : 0) | (tm.y < enter ? 2 : 0);
+    return i;
+}
+
+// The sibling the ray goes on to from child i, which it leaves at t1. Leaving through an upper
+// plane of the parent ends the walk of the parent.
+static unsigned nextchild(unsigned i, vec3 t1)
+{
+    float exit = minof(t1);
+    unsigned axis = t1.x == exit ? 1 : t1.y == exit ? 2 : 4;
+    return i & axis ? 8 : i | axis;
+}
+
+// What to do with the node of frame c: nothing if it is empty, stop if it is solid, and walk
+// its children if it has any
+static CastResult enter(const Ocroot *root, Cast *c)
+{
+    if (!c->cells)
+    {
+        Octree t = root->node(c->offset);
+        if (t.type() == EMPTY)
+            return CAST_SKIP;
+        if (t.type() == LEAF)
+            return CAST_HIT;
+        if (t.type() == TWIG)
+        {
+            c->twig = root->brick(t);
+            c->voxel = glm::uvec3(0);
+            c->cells = TWIG_SIZE;
+        }
+    }
+    else if (c->cells == 1)
+    {
+        return c->twig->solid(Octwig::word(c->voxel.x, c->voxel.y, c->voxel.z)) ? CAST_HIT : CAST_SKIP;
+    }
+
+    c->next = firstchild(c->t0, (c->t0 + c->t1) * 0.5f);
+    return CAST_ENTER;
+}
+
+// Walks root front to back along the ray a + b t from t = 0 on, visiting every node the ray
+// crosses once and descending from the nodes above it instead of from the root. This is the
+// parametric walk of Revelles et al: the ray is mirrored so that every component of b is
+// positive, and the children of a node are told apart by comparing where the ray crosses its
+// middle planes. Returns the t at which the ray enters the first solid voxel in s.
+bool treecast(vec3 a, vec3 b, const Ocroot *root, float *s)
+{
+    // Child i of the mirrored tree is child i ^ mirror of the real one
+    vec3 o = a - root->position;
+    unsigned mirror = 0;
+    for (int k = 0; k < 3; ++k)
+    {
+        if (b[k] < 0)
+        {
+            o[k] = root->size - o[k];
+            b[k] = -b[k];
+            mirror |= 1 << k;
+        }
+        b[k] = max(b[k], CAST_MIN_DIRECTION);
+    }
+
+    Cast stack[CAST_DEPTH];
+    Cast *c = &stack[0];
+    c->t0 = -o / b;
+    c->t1 = (root->size - o) / b;
+    c->offset = 0;
+    c->cells = 0;
+    if (maxof(c->t0) >= minof(c->t1) || minof(c->t1) < 0)
+        return false;
+
+    CastResult r = enter(root, c);
+    int top = 0;
+    while (r == CAST_ENTER && top >= 0)
+    {
+        Cast *parent = &stack[top];
+        if (parent->next == 8)
+        {
+            --top;
+            continue;
+        }
+
+        unsigned i = parent->next;
+        vec3 tm = (parent->t0 + parent->t1) * 0.5f;
+        assert(top + 1 < CAST_DEPTH);
+        c = &stack[top + 1];
+        for (int k = 0; k < 3; ++k)
+        {
+            bool upper = i & (1 << k);
+            c->t0[k] = upper ? tm[k] : parent->t0[k];
+            c->t1[k] = upper ? parent->t1[k] : tm[k];
+        }
+        parent->next = nextchild(i, c->t1);
+
+        // Children behind the start of the ray are passed over
+        if (minof(c->t1) < 0)
+            continue;
+
+        unsigned real = i ^ mirror;
+        if (!parent->cells)
+        {
+            c->offset = root->child(parent->offset, real);
+            c->cells = 0;
+        }
+        else
+        {
+            c->twig = parent->twig;
+            c->cells = parent->cells / 2;
+            c->voxel = parent->voxel + glm::uvec3(real & 1, (real >> 1) & 1, (real >> 2) & 1) * c->cells;
+        }
+
+        r = enter(root, c);
+        if (r == CAST_ENTER)
+            ++top;
+        else if (r == CAST_SKIP)
+            r = CAST_ENTER;
+    }
+
+    if (r != CAST_HIT)
+        return false;
+    *s = max(maxof(c->t0), 0.0f);
+    return true;
+}
+
 float intersectCube(vec3 a, vec3 b, vec3 cmin, vec3 cmax, bool *intersect)
 {
     vec3 tmin = (cmin - a) / b;
@@ -170,6 +395,77 @@ bool chunkmarch(vec3 alpha, vec3 beta, const World *world, vec3 *sigma)
     return false;
 }
 
+// Calls visit with the coordinate of each chunk from lo up to hi the ray crosses, in order, and
+// the t at which the ray enters it, with a 3D DDA over the chunk grid. Stops once visit returns
+// true, returns whether it did.
+bool chunkwalk(vec3 alpha, vec3 beta, ivec3 lo, ivec3 hi, float chunksize, const std::function<bool(ivec3 q, float t)>& visit)
+{
+
+    vec3 d = beta;
+    for (int k = 0; k < 3; ++k)
+        if (glm::abs(d[k]) < CAST_MIN_DIRECTION)
+            d[k] = CAST_MIN_DIRECTION;
+    vec3 ta = (vec3(lo) * chunksize - alpha) / d;
+    vec3 tb = (vec3(hi) * chunksize - alpha) / d;
+    float t = max(maxof(min(ta, tb)), 0.0f);
+    float tfar = minof(max(ta, tb));
+    if (t > tfar)
+        return false;
+
+    ivec3 q = glm::clamp(ivec3(glm::floor((alpha + beta * t) / chunksize)), lo, hi - 1);
+    ivec3 step;
+    vec3 tnext, tdelta;
+    for (int k = 0; k < 3; ++k)
+    {
+        step[k] = d[k] < 0 ? -1 : 1;
+        tnext[k] = ((q[k] + (d[k] < 0 ? 0 : 1)) * chunksize - alpha[k]) / d[k];
+        tdelta[k] = chunksize / glm::abs(d[k]);
+    }
+
+    for ( ; ; )
+    {
+        if (visit(q, t))
+            return true;
+
+        int k = tnext.x < tnext.y ? (tnext.x < tnext.z ? 0 : 2) : (tnext.y < tnext.z ? 1 : 2);
+        if (tnext[k] > tfar)
+            return false;
+        q[k] += step[k];
+        if (q[k] < lo[k] || q[k] >= hi[k])
+            return false;
+        t = tnext[k];
+        tnext[k] += tdelta[k];
+    }
+}
+
+// The chunks of the world the ray crosses
+bool chunkwalk(vec3 alpha, vec3 beta, const World *world, const std::function<bool(ivec3 q, float t)>& visit)
+{
+    ivec3 lo = world->chunkcoordmin;
+    ivec3 hi = lo + ivec3(world->width, world->height, world->depth);
+    return chunkwalk(alpha, beta, lo, hi, (float)world->chunksize, visit);
+}
+
+// Same hits as chunkmarch, but walks the chunks the ray crosses in order and each one with
+// treecast, the first hit found is the nearest
+bool chunkcast(vec3 alpha, vec3 beta, const World *world, vec3 *sigma)
+{
+    bool hit = false;
+    chunkwalk(alpha, beta, world, [&](ivec3 q, float) {
+        const Ocroot *root = &world->chunk[world->index(q.x, q.y, q.z)];
+        // Like chunkmarch, a slot that does not hold this chunk yet ends the walk
+        if (root->position != vec3(q) * (float)world->chunksize)
+            return true;
+
+        float s;
+        hit = treecast(alpha, beta, root, &s);
+        if (hit)
+            *sigma = alpha + beta * s;
+        return hit;
+    });
+    return hit;
+}
+
 bool cubesIntersect(vec3 bmin0, vec3 bmax0, vec3 bmin1, vec3 bmax1)
 {
     using glm::all; 
@@ -3,10 +3,10 @@
 #ifndef TRAVERSE_H
 #define TRAVERSE_H
 
+#include <functional>
 #include <glm/vec3.hpp>
+#include "Octree.h"
 
-struct Ocroot;
-struct Octwig;
 struct World;
 
 struct Tree
@@ -25,8 +25,16 @@ bool cubesIntersect(glm::vec3 bmin0, glm::vec3 bmax0, glm::vec3 bmin1, glm::vec3
 bool cubeIsInside(glm::vec3 omin, glm::vec3 omax, glm::vec3 imin, glm::vec3 imax);
 
 Tree traverse(glm::vec3 p, const Ocroot *root);
-bool twigmarch(glm::vec3 a, glm::vec3 b, glm::vec3 bmin, float size, float leafsize, const Octwig *twig, float *s);
+bool voxelat(glm::vec3 p, const Ocroot *root, uint16_t *material, glm::vec3 *bmin, float *size);
+glm::vec3 cubeNormal(glm::vec3 p, glm::vec3 bmin, float size);
+// steps, if given, counts the cells looked at, at most 3 * TWIG_SIZE - 2
+bool twigmarch(glm::vec3 a, glm::vec3 b, glm::vec3 bmin, float size, float leafsize, const Octwig *twig, float *s, uint32_t *steps = nullptr);
 bool treemarch(glm::vec3 a, glm::vec3 b, const Ocroot *root, float *s);
 bool chunkmarch(glm::vec3 alpha, glm::vec3 beta, const World *world, glm::vec3 *sigma);
+// Front to back walks with a stack instead of a descent from the root at every step
+bool treecast(glm::vec3 a, glm::vec3 b, const Ocroot *root, float *s);
+bool chunkcast(glm::vec3 alpha, glm::vec3 beta, const World *world, glm::vec3 *sigma);
+bool chunkwalk(glm::vec3 alpha, glm::vec3 beta, glm::ivec3 lo, glm::ivec3 hi, float chunksize, const std::function<bool(glm::ivec3 q, float t)>& visit);
+bool chunkwalk(glm::vec3 alpha, glm::vec3 beta, const World *world, const std::function<bool(glm::ivec3 q, float t)>& visit);
 
 #endif
\ No newline at end of file
@@ -5,8 +5,17 @@
 #include <stdlib.h>
 #include <stdarg.h>
 #include <chrono>
+#include <filesystem>
+#include <string>
 #include "Util.h"
 
+#ifdef _WIN32
+# include <io.h>
+#else
+# include <fcntl.h>
+# include <unistd.h>
+#endif
+
 static inline uintmax_t now_ns()
 {
     auto dt = std::chrono::high_resolution_clock::now().time_since_epoch();
@@ -90,4 +99,28 @@ char * readfile(const char *path)
     cont[size] = '\0';
     fclose(stream);
     return cont;
-}
\ No newline at end of file
+}
+void syncfile(FILE *fp)
+{
+    fflush(fp);
+#ifdef _WIN32
+    _commit(_fileno(fp));
+#else
+    fsync(fileno(fp));
+#endif
+}
+
+void syncdirectory(const char *path)
+{
+#ifdef _WIN32
+    // Directories cannot be opened to be flushed, NTFS journals their entries itself
+    (void)path;
+#else
+    std::string parent = std::filesystem::path(path).parent_path().string();
+    int fd = open(parent.empty() ? "." : parent.c_str(), O_RDONLY);
+    if (fd < 0)
+        die("open(\"%s\"): %s\n", parent.c_str(), strerror(errno));
+    fsync(fd);
+    close(fd);
+#endif
+}
@@ -1,9 +1,15 @@
 #pragma once
 
 #include <stdint.h>
+#include <stdio.h>
 
 [[noreturn]] void die(const char *format, ...);
 char * readfile(const char *path);
+// Flushes fp and waits until what was written to it is on the disk
+void syncfile(FILE *fp);
+// Waits until the entries of the directory holding path are on the disk, so that a file
+// created or renamed there stays after a crash
+void syncdirectory(const char *path);
 
 struct Counter
 {
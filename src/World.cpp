@@ -1,3 +1,8 @@
+#include <math.h>
+#include <stddef.h>
+#include <string.h>
+#include <string>
+#include <vector>
 #include <algorithm>
 #include <GL/glew.h>
 #include <glm/vec3.hpp>
@@ -5,18 +10,40 @@
 #include "World.h"
 #include "Octree.h"
 #include "BoundsPyramid.h"
+#include "Density.h"
 #include "Shader.h"
 #include "Traverse.h"
+#include "Arena.h"
+#include "Dag.h"
+#include "Util.h"
+#include "Camera.h"
 
 #define TREE_MAX_DEPTH 8
 #define PYRAMID_RESOLUTION 256
+// Default memory limits of the caches of chunks and heightmaps shifted out of the world
+#define CHUNK_CACHE_BYTES ((size_t)64 << 20)
+#define HEIGHTMAP_CACHE_BYTES ((size_t)16 << 20)
+// Chunks are compacted once a quarter of their storage is garbage, and at least this much
+#define COMPACT_MIN_GARBAGE (4 * 1024)
+// Default budget of the chunk uploads done each frame, whichever runs out first
+#define UPLOAD_BYTES ((size_t)4 << 20)
+#define UPLOAD_MS 2.0
+// Generation jobs out at once for each streaming worker
+#define STREAM_JOBS_PER_WORKER 2
+// Journaled edits go out to the disk at most this often, and are saved with their chunks
+// once the journal has grown this large
+#define JOURNAL_SYNC_MS 100.0
+#define JOURNAL_CHECKPOINT_BYTES ((size_t)1 << 20)
+// Chunks closer than this many chunks are drawn at full detail, then they lose a level every
+// time their distance doubles
+#define LOD_DISTANCE 1.0f
 
 using glm::vec3;
 using glm::ivec3;
 using glm::mat4;
 
 
-void World::init(int w, int h, int d, int s)
+void World::init(int w, int h, int d, int s, bool caves, const char *save)
 {
     width  = w;
     height = h;
@@ -24,22 +51,67 @@ void World::init(int w, int h, int d, int s)
     plane  = width * depth;
     volume = plane * height;
     chunksize = s;
+    this->caves = caves;
     
     ivec3 bound = ivec3(width, height, depth);
     chunkcoordmin = vec3(0);
 
-    heightmap = new BoundsPyramid[plane];
+    jobs.init();
+    background.init(1);
+    // jobs only runs while this thread waits for it, streaming runs next to this thread and
+    // the background worker, so it gets the cores they leave
+    unsigned hw = std::thread::hardware_concurrency();
+    unsigned busy = (unsigned)background.worker.size() + 1;
+    streaming.init(hw > busy ? hw - busy : 1);
+    uploadbytes = UPLOAD_BYTES;
+    uploadms = UPLOAD_MS;
+    inflight = 0;
+    carried = 0;
+    streamstats = StreamStats();
+    ocdag.init();
+    store = nullptr;
+    journal = nullptr;
+    if (save)
+    {
+        store = new ChunkStore();
+        store->init(save, chunksize, TREE_MAX_DEPTH);
+
+        std::vector<JournalEdit> journaled;
+        journal = new EditJournal();
+        journal->init((std::string(save) + "/journal").c_str(), &journaled);
+        for (const JournalEdit& e : journaled)
+            edits[e.chunk].push_back(e);
+    }
+    chunkcache.init(CHUNK_CACHE_BYTES, [this](CachedChunk *c) {
+        this->save(&c->root, &c->lod, true);
+        c->root.release();
+        c->lod.release();
+    });
+    heightmapcache.init(HEIGHTMAP_CACHE_BYTES, [](BoundsPyramid *h) { h->deinit(); });
+
+    // Every pyramid and every chunk only writes to its own slot, so each one is a job
+    heightmap = new BoundsPyramid[plane]();
     for (int z = 0; z < depth; ++z)
         for (int x = 0; x < width; ++x)
-            g_pyramid(chunkcoordmin.x+x, chunkcoordmin.z+z);
-
-    chunk = new Ocroot[volume];
+            jobs.submit([this, x, z]() { g_pyramid(chunkcoordmin.x+x, chunkcoordmin.z+z); });
+    jobs.wait();
+
+    chunk = new Ocroot[volume]();
+    lod = new ChunkLod[volume]();
+    version = new uint64_t[volume]();
+    revision = new uint64_t[volume]();
+    compacting = new bool[volume]();
+    pending = new bool[volume]();
+    queued = new bool[volume]();
+    ticket = new std::atomic<uint64_t>[volume]();
     for (int z = 0; z < depth; ++z)
         for (int y = 0; y < height; ++y)
             for (int x = 0; x < width; ++x)
-                g_chunk(chunkcoordmin.x+x, chunkcoordmin.y+y, chunkcoordmin.z+z);
+                jobs.submit([this, x, y, z]() { g_chunk(chunkcoordmin.x+x, chunkcoordmin.y+y, chunkcoordmin.z+z); });
+    jobs.wait();
 
-    gcd = new GPUChunk[volume];
+    // The dag goes after the chunks, shaders find it at DAG_ROOT
+    gcd = new GPUChunk[volume + 1];
 }
 
 GPUChunk::GPUChunk(const Ocroot *r, RootAllocation a)
@@ -49,6 +121,7 @@ GPUChunk::GPUChunk(const Ocroot *r, RootAllocation a)
     tr_off = a.tree.offset / sizeof(uint32_t);
     tw_reg = a.twig.region;
     tw_off = a.twig.offset / sizeof(uint32_t);
+    flags = (r->sparse ? CHUNK_SPARSE : 0) | r->depth << CHUNK_DEPTH_SHIFT;
 }
 
 extern const float CUBE_VERTICES[8*3];
@@ -58,9 +131,11 @@ void World::load_gpu()
 {
     atlas.init();
 
-    allocator.init(volume);
+    allocator.init(volume + 1);
     for (int i = 0; i < volume; ++i)
-        gcd[i] = GPUChunk(&chunk[i], allocator.alloc(i, &chunk[i]));
+        gcd[i] = GPUChunk(active(i), allocator.alloc(i, active(i)));
+    gcd[volume] = GPUChunk(&ocdag.store, allocator.alloc(volume, &ocdag.store));
+    ocdag.dtree = ocdag.dtwig = Ocdelta();
 
     glGenVertexArrays(1, &vao);
     glBindVertexArray(vao);
@@ -77,22 +152,43 @@ void World::load_gpu()
 
     glGenBuffers(1, &chunk_ssbo);
     glBindBuffer(GL_SHADER_STORAGE_BUFFER, chunk_ssbo);
-    glBufferData(GL_SHADER_STORAGE_BUFFER, volume * sizeof(GPUChunk), gcd, GL_STATIC_DRAW);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, (volume + 1) * sizeof(GPUChunk), gcd, GL_STATIC_DRAW);
 
     glBindVertexArray(0);
     glBindBuffer(GL_ARRAY_BUFFER, 0);
     glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
     glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
 
-    shader_context = WorldShaderContext(Shader(glCreateProgram())
-        .vertex("shaders/World.Vertex.glsl")
-        .include("shaders/Chunkmarch.glsl")
+    shader_context = WorldShaderContext(includeChunkmarch(Shader(glCreateProgram())
+        .vertex("shaders/World.Vertex.glsl"))
         .fragment("shaders/World.Fragment.glsl")
         .link());
 
     shader_context.bind_ul();
 }
 
+Shader& defineTwigLayout(Shader& shader)
+{
+    static_assert(sizeof(Octwig) % sizeof(uint32_t) == 0);
+
+    // Where the parts of a twig start are in dwords, TWIG_PALETTE is the size of its palette
+    return shader
+        .define("TWIG_DEPTH", TWIG_DEPTH)
+        .define("TWIG_SIZE", TWIG_SIZE)
+        .define("TWIG_WORDS", TWIG_WORDS)
+        .define("TWIG_PALETTE", TWIG_PALETTE)
+        .define("TWIG_DWORDS", sizeof(Octwig) / sizeof(uint32_t))
+        .define("TWIG_MASK_DWORD", offsetof(Octwig, mask) / sizeof(uint32_t))
+        .define("TWIG_PALETTE_DWORD", offsetof(Octwig, palette) / sizeof(uint32_t))
+        .define("TWIG_INDEX_DWORD", offsetof(Octwig, index) / sizeof(uint32_t));
+}
+
+Shader& includeChunkmarch(Shader& shader)
+{
+    return defineTwigLayout(shader)
+        .include("shaders/Chunkmarch.glsl");
+}
+
 void WorldShaderContext::bind_ul()
 {
     chunkmin_ul = glGetUniformLocation(shader, "chunkmin");
@@ -126,7 +222,7 @@ void WorldShaderContext::bind_ul()
     // assert(specular_ul != -1);
 }
 
-void World::deinit()
+void World::unload_gpu()
 {
     glDeleteVertexArrays(1, &vao);
     glDeleteBuffers(1, &vbo);
@@ -134,20 +230,63 @@ void World::deinit()
     glDeleteBuffers(1, &chunk_ssbo);
     glDeleteProgram(shader_context.shader);
 
+    allocator.release();
+}
+
+void World::deinit()
+{
+    // Whatever is still queued finds its ticket gone and returns straight away
+    for (int i = 0; i < volume; ++i)
+        ++ticket[i];
+    streaming.deinit();
+    jobs.deinit();
+    background.deinit();
+    if (journal)
+        checkpoint();
+
+    // Generated chunks are only interned once they are uploaded
+    for (Streamed& s : streamed)
+    {
+        s.root.abandon();
+        s.lod.release();
+    }
+    streamed.clear();
+    delete[] pending;
+    delete[] queued;
+    delete[] ticket;
+
+    // The references of compacted copies still belong to their chunks
+    for (Compaction& c : compacted)
+        c.root.abandon();
+    compacted.clear();
+    delete[] version;
+    delete[] revision;
+    delete[] compacting;
+
     for (int i = 0; i < volume; ++i)
     {
-        free(chunk[i].tree);
-        free(chunk[i].twig);
+        chunk[i].release();
+        lod[i].release();
     }
     delete[] chunk;
+    delete[] lod;
+    chunkcache.deinit();
+    heightmapcache.deinit();
+    if (store)
+    {
+        journal->deinit();
+        delete journal;
+        store->deinit();
+        delete store;
+    }
+    ocdag.deinit();
+    ocarena.deinit();
 
     for (int i = 0; i < plane; ++i)
         heightmap[i].deinit();
     delete[] heightmap;
 
     delete[] gcd;
-
-    allocator.release();
 }
 
 static mat4 srt(vec3 chunkmin, vec3 bounds)
@@ -265,14 +404,390 @@ void World::draw(mat4 mvp, vec3 eye, const Shadowmap *shadowmap, const mat4 *sha
     glUseProgram(0);
 }
 
+// Coarse copies are never interned, they belong to their chunk alone
+void ChunkLod::release()
+{
+    for (uint32_t k = 0; k < levels; ++k)
+        coarse[k].abandon();
+    level = levels = 0;
+}
+
+size_t ChunkLod::bytes() const
+{
+    size_t n = 0;
+    for (uint32_t k = 0; k < levels; ++k)
+        n += coarse[k].treestoragesize * sizeof(Octree) + coarse[k].twigstoragesize * sizeof(Octwig);
+    return n;
+}
+
+// The version of chunk i the GPU has
+const Ocroot *World::active(int i) const
+{
+    return lod[i].level ? &lod[i].coarse[lod[i].level - 1] : &chunk[i];
+}
+
+// Makes an edit of the box from cmin to cmax in every chunk of the world it reaches, and
+// journals it for each of them
+void World::edit(EditOp op, vec3 cmin, vec3 cmax, uint16_t material)
+{
+    ivec3 lo = glm::max(index_float(cmin), chunkcoordmin);
+    ivec3 hi = glm::min(index_float(cmax), chunkcoordmin + ivec3(width, height, depth) - 1);
+    for (int z = lo.z; z <= hi.z; ++z)
+    {
+        for (int y = lo.y; y <= hi.y; ++y)
+        {
+            for (int x = lo.x; x <= hi.x; ++x)
+            {
+                // Edits to placeholders would be lost once their chunk arrives
+                int i = index(x, y, z);
+                if (pending[i])
+                    continue;
+
+                JournalEdit e = { ivec3(x, y, z), cmin, cmax, material, (uint16_t)op, 0 };
+                Ocdelta tree, twig;
+                apply(&chunk[i], &e, &tree, &twig);
+                modify(i, &tree, &twig);
+
+                if (journal)
+                {
+                    journal->append(e);
+                    std::unique_lock<std::mutex> lock(editmutex);
+                    edits[e.chunk].push_back(e);
+                }
+            }
+        }
+    }
+}
+
+// Uploads an edit of chunk i. Its coarse copies no longer match it, so they are dropped and
+// the chunk is drawn at full detail from then on.
 void World::modify(int i, const Ocdelta *tree, const Ocdelta *twig)
 {
-    gcd[i] = GPUChunk(&chunk[i], allocator.subst(i, &chunk[i], tree, twig));
+    ++revision[i];
+    bool coarse = lod[i].level > 0;
+    lod[i].release();
+    if (coarse)
+    {
+        Ocdelta all(true);
+        refresh(i, &all, &all);
+        return;
+    }
+    refresh(i, tree, twig);
+}
+
+// Uploads the changes tree and twig to the version of chunk i the GPU has
+void World::refresh(int i, const Ocdelta *tree, const Ocdelta *twig)
+{
     glBindBuffer(GL_SHADER_STORAGE_BUFFER, chunk_ssbo);
+    if (stage(i, tree, twig))
+        glBufferSubData(GL_SHADER_STORAGE_BUFFER, volume * sizeof(GPUChunk), sizeof(GPUChunk), &gcd[volume]);
     glBufferSubData(GL_SHADER_STORAGE_BUFFER, i * sizeof(GPUChunk), sizeof(GPUChunk), &gcd[i]);
     glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
 }
 
+// Uploads the changed storage of chunk i and updates gcd, leaving chunk_ssbo to the caller.
+// Returns true if the dag's entry changed too.
+bool World::stage(int i, const Ocdelta *tree, const Ocdelta *twig)
+{
+    // The chunk can refer to dag nodes added since the last upload, those go first
+    bool dag = false;
+    const Ocdelta *dt = &ocdag.dtree, *dw = &ocdag.dtwig;
+    if (dt->realloc || dt->left < dt->right || dw->realloc || dw->left < dw->right)
+    {
+        gcd[volume] = GPUChunk(&ocdag.store, allocator.subst(volume, &ocdag.store, dt, dw));
+        ocdag.dtree = ocdag.dtwig = Ocdelta();
+        dag = true;
+    }
+
+    gcd[i] = GPUChunk(active(i), allocator.subst(i, active(i), tree, twig));
+
+    // Copies being compacted from the chunk as it was are out of date now
+    ++version[i];
+    return dag;
+}
+
+static bool wasteful(const Ocroot *r)
+{
+    // Trees and twigs are compared separately so that large twigs do not hide tree garbage
+    uint64_t garbage = r->garbagetrees * sizeof(Octree) + r->garbagetwigs * sizeof(Octwig);
+    return garbage >= COMPACT_MIN_GARBAGE
+        && (r->garbagetrees * 4 >= r->trees || r->garbagetwigs * 4 >= r->twigs);
+}
+
+// Swaps in the chunks compacted since the last call and hands the chunks that edits have
+// left with too much garbage to the background worker. Called once per frame by the thread
+// owning the GL context, which is the only one to edit chunks outside of init and shift.
+void World::compact()
+{
+    std::vector<Compaction> done;
+    {
+        std::unique_lock<std::mutex> lock(compactmutex);
+        done.swap(compacted);
+    }
+
+    for (Compaction& c : done)
+    {
+        int i = c.index;
+        compacting[i] = false;
+        if (c.version != version[i])
+        {
+            c.root.abandon();
+            continue;
+        }
+
+        // The copy has exactly the dag references of the chunk, so they simply move over
+        c.root.modified = chunk[i].modified;
+        chunk[i].abandon();
+        chunk[i] = c.root;
+        Ocdelta tree(true), twig(true);
+        refresh(i, &tree, &twig);
+    }
+
+    if (journal)
+    {
+        journal->sync(JOURNAL_SYNC_MS);
+        if (journal->bytes >= JOURNAL_CHECKPOINT_BYTES)
+            checkpoint();
+    }
+
+    for (int i = 0; i < volume; ++i)
+    {
+        if (compacting[i] || pending[i] || !wasteful(&chunk[i]))
+            continue;
+
+        // The worker gets a snapshot, edits can go on meanwhile and only make it stale. Dag
+        // words in it are never followed, so it does not matter if they go away.
+        Ocroot snapshot = chunk[i];
+        snapshot.reserve(chunk[i].trees, chunk[i].twigs);
+        memcpy(snapshot.tree, chunk[i].tree, chunk[i].trees * sizeof(Octree));
+        memcpy(snapshot.twig, chunk[i].twig, chunk[i].twigs * sizeof(Octwig));
+
+        compacting[i] = true;
+        uint64_t v = version[i];
+        background.submit([this, i, v, snapshot]() mutable {
+            Compaction c = { i, v, Ocroot() };
+            ::compact(&snapshot, &c.root);
+            snapshot.abandon();
+
+            std::unique_lock<std::mutex> lock(compactmutex);
+            compacted.push_back(c);
+        });
+    }
+}
+
+// False if the box is entirely outside one of the planes of the frustum
+static bool visible(const mat4& viewproj, vec3 bmin, vec3 bmax)
+{
+    glm::vec4 c[8];
+    for (int i = 0; i < 8; ++i)
+        c[i] = viewproj * glm::vec4(i & 1 ? bmax.x : bmin.x, i & 2 ? bmax.y : bmin.y, i & 4 ? bmax.z : bmin.z, 1.0f);
+
+    for (int axis = 0; axis < 3; ++axis)
+    {
+        bool below = true, above = true;
+        for (int i = 0; i < 8; ++i)
+        {
+            below = below && c[i][axis] < -c[i].w;
+            above = above && c[i][axis] > c[i].w;
+        }
+        if (below || above)
+            return false;
+    }
+    return true;
+}
+
+// Keeps the camera in the middle chunk of the world and streams in what that brings in
+void World::follow(PerspectiveCamera *camera)
+{
+    recenter(index_float(camera->position) - ivec3(width, height, depth) / 2);
+    dispatch(camera->position, camera->proj() * camera->view());
+    pickdetail(camera->position);
+}
+
+// Hands placeholders to the streaming workers, those in view first and nearest first among
+// them, keeping only a few jobs queued so that the order follows the camera
+void World::dispatch(vec3 eye, const mat4& viewproj)
+{
+    struct Candidate
+    {
+        bool hidden;
+        float distance;
+        int index;
+    };
+
+    std::vector<Candidate> waiting;
+    streamstats.pending = 0;
+    streamstats.dispatched = 0;
+    for (int i = 0; i < volume; ++i)
+    {
+        if (!pending[i])
+            continue;
+        ++streamstats.pending;
+        if (queued[i])
+            continue;
+
+        vec3 bmin = chunk[i].position, bmax = bmin + (float)chunksize;
+        waiting.push_back({ !visible(viewproj, bmin, bmax), glm::distance(eye, glm::clamp(eye, bmin, bmax)), i });
+    }
+
+    std::sort(waiting.begin(), waiting.end(), [](const Candidate& a, const Candidate& b) {
+        return a.hidden != b.hidden ? b.hidden : a.distance < b.distance;
+    });
+
+    int limit = (int)streaming.worker.size() * STREAM_JOBS_PER_WORKER;
+    for (const Candidate& c : waiting)
+    {
+        if (inflight >= limit)
+            break;
+
+        // Jobs get their own copy of the pyramid, the column's one may be shifted out before
+        // they run
+        int i = c.index;
+        ivec3 p = index_float(chunk[i].position + 0.5f);
+        uint64_t t = ticket[i];
+        BoundsPyramid pyr = heightmap[index(p.x, p.z)].copy();
+        queued[i] = true;
+        ++inflight;
+        ++streamstats.dispatched;
+        streaming.submit([this, i, t, p, pyr]() mutable {
+            if (ticket[i] == t)
+            {
+                Streamed s = { i, t, Ocroot(), ChunkLod() };
+                if (load(&s.root, &s.lod, p))
+                {
+                    replay(&s.root, &s.lod, p);
+                }
+                else
+                {
+                    g_root(&s.root, &s.lod, p, &pyr);
+                    replay(&s.root, &s.lod, p);
+                    // Someone else may have saved the chunk since
+                    save(&s.root, &s.lod, false);
+                }
+
+                std::unique_lock<std::mutex> lock(streammutex);
+                streamed.push_back(s);
+            }
+            pyr.deinit();
+            --inflight;
+        });
+    }
+}
+
+// Gives every chunk the level of detail its distance to the camera calls for, as far as its
+// coarse copies go
+void World::pickdetail(vec3 eye)
+{
+    for (int i = 0; i < volume; ++i)
+    {
+        if (pending[i])
+            continue;
+
+        vec3 bmin = chunk[i].position, bmax = bmin + (float)chunksize;
+        float d = glm::distance(eye, glm::clamp(eye, bmin, bmax)) / ((float)chunksize * LOD_DISTANCE);
+        uint32_t level = d < 1.0f ? 0 : (uint32_t)log2f(d) + 1;
+        level = glm::min(level, lod[i].levels);
+        if (level == lod[i].level)
+            continue;
+
+        lod[i].level = level;
+        Ocdelta all(true);
+        refresh(i, &all, &all);
+    }
+}
+
+// Bytes modify sends to the GPU for a chunk changed by tree and twig, with the dag changes
+// it brings along
+static size_t uploadsize(const Ocroot *r, const Ocdelta *tree, const Ocdelta *twig)
+{
+    size_t n = 0;
+    n += tree->realloc ? r->trees * sizeof(Octree) : tree->left < tree->right ? (tree->right - tree->left) * sizeof(Octree) : 0;
+    n += twig->realloc ? r->twigs * sizeof(Octwig) : twig->left < twig->right ? (twig->right - twig->left) * sizeof(Octwig) : 0;
+    return n;
+}
+
+// Interns and uploads the chunks generated since the last call, oldest first, until the
+// frame's budget is spent. At least one goes up every frame so that streaming never stalls.
+void World::upload()
+{
+    std::vector<Streamed> ready;
+    {
+        std::unique_lock<std::mutex> lock(streammutex);
+        ready.swap(streamed);
+    }
+    streamstats.generated = (uint32_t)(ready.size() - carried);
+    streamstats.uploaded = 0;
+
+    Counter timer;
+    timer.start();
+    size_t sent = 0;
+    size_t n = 0;
+    for (; n < ready.size(); ++n)
+    {
+        if (n > 0 && (sent >= uploadbytes || timer.elapsed() * 1e3 >= uploadms))
+            break;
+
+        Streamed& s = ready[n];
+        int i = s.index;
+        if (s.ticket != ticket[i])
+        {
+            s.root.abandon();
+            s.lod.release();
+            continue;
+        }
+
+        ocdag.intern(&s.root);
+        chunk[i].release();
+        chunk[i] = s.root;
+        lod[i] = s.lod;
+        pending[i] = false;
+        ++revision[i];
+        ++streamstats.uploaded;
+
+        Ocdelta tree(true), twig(true);
+        sent += uploadsize(&ocdag.store, &ocdag.dtree, &ocdag.dtwig) + uploadsize(active(i), &tree, &twig);
+        refresh(i, &tree, &twig);
+    }
+
+    // What did not fit waits for the next frame, ahead of anything generated meanwhile
+    carried = ready.size() - n;
+    if (n < ready.size())
+    {
+        std::unique_lock<std::mutex> lock(streammutex);
+        streamed.insert(streamed.begin(), ready.begin() + n, ready.end());
+    }
+}
+
+void World::uploadbudget(size_t bytes, double ms)
+{
+    uploadbytes = bytes;
+    uploadms = ms;
+}
+
+size_t ChunkHash::operator()(glm::ivec2 p) const
+{
+    return (size_t)(uint32_t)p.x * 0x9e3779b97f4a7c15ull ^ (size_t)(uint32_t)p.y * 0xc2b2ae3d27d4eb4full;
+}
+
+size_t ChunkHash::operator()(glm::ivec3 p) const
+{
+    return (*this)(glm::ivec2(p.x, p.z)) ^ (size_t)(uint32_t)p.y * 0x165667b19e3779f9ull;
+}
+
+void World::cachelimits(size_t chunkbytes, size_t heightmapbytes)
+{
+    chunkcache.limit = chunkbytes;
+    chunkcache.trim(chunkbytes);
+    heightmapcache.limit = heightmapbytes;
+    heightmapcache.trim(heightmapbytes);
+}
+
+static size_t bytes(const CachedChunk *c)
+{
+    const Ocroot *r = &c->root;
+    return r->treestoragesize * sizeof(Octree) + r->twigstoragesize * sizeof(Octwig) + c->lod.bytes();
+}
+
 static int modulo(int n, int m)
 {
     return (m + (n % m)) % m;
@@ -292,7 +807,6 @@ int World::index(int x, int y, int z) const
     return i;
 }
 
-// Both of these currently leak memory
 void World::g_pyramid(int x, int z)
 {
     int i = index(x, z);
@@ -301,6 +815,8 @@ void World::g_pyramid(int x, int z)
     float xshift = (float)x * PYRAMID_RESOLUTION;
     float yshift = 16.0f;
     float zshift = (float)z * PYRAMID_RESOLUTION;
+    if (heightmap[i].basequad)
+        heightmap[i].deinit();
     heightmap[i] = BoundsPyramid();
     heightmap[i].init(PYRAMID_RESOLUTION, amplitude, period, xshift, yshift, zshift);
 }
@@ -308,16 +824,185 @@ void World::g_pyramid(int x, int z)
 void World::g_chunk(int x, int y, int z)
 {
     int i = index(x, y, z);
-    int j = index(x, z);
-    vec3 p = vec3(x, y, z) * (float)chunksize;
-    chunk[i] = Ocroot();
-    grow(&chunk[i], p, (float)chunksize, TREE_MAX_DEPTH, &heightmap[j]);
+    // The slot's old storage goes back to the arena, where the new tree most likely picks it up again
+    chunk[i].release();
+    lod[i].release();
+    if (load(&chunk[i], &lod[i], ivec3(x, y, z)))
+    {
+        replay(&chunk[i], &lod[i], ivec3(x, y, z));
+    }
+    else
+    {
+        g_root(&chunk[i], &lod[i], ivec3(x, y, z), &heightmap[index(x, z)]);
+        replay(&chunk[i], &lod[i], ivec3(x, y, z));
+        save(&chunk[i], &lod[i], true);
+    }
+
+    // a lot of terrain looks the same from one chunk to the next
+    ocdag.intern(&chunk[i]);
+}
+
+// Terrain is mostly air, so most branches have only a few children worth storing
+static void sparsen(Ocroot *root)
+{
+    Ocroot sparse;
+    if (sparsify(root, &sparse))
+    {
+        root->release();
+        *root = sparse;
+    }
+}
+
+// Generates the chunk at chunk coordinate p into root and its coarse copies into lod, without
+// touching the world, so that it can run while the world goes on changing
+void World::g_root(Ocroot *root, ChunkLod *lod, ivec3 p, const BoundsPyramid *pyr) const
+{
+    vec3 q = vec3(p) * (float)chunksize;
+    if (caves)
+    {
+        Density f = ::caves(pyr, q, (float)chunksize);
+        growdensity(root, q, (float)chunksize, TREE_MAX_DEPTH, &f);
+    }
+    else
+    {
+        grow(root, q, (float)chunksize, TREE_MAX_DEPTH, pyr);
+    }
 
     // Add water at y=6
-    vec3 watermin = chunk[i].position;
-    vec3 watermax = vec3(chunk[i].position.x + chunk[i].size, 6, chunk[i].position.z + chunk[i].size);
+    vec3 watermin = root->position;
+    vec3 watermax = vec3(root->position.x + root->size, 6, root->position.z + root->size);
     Ocdelta d;
-    chunk[i].build(watermin, watermax, 6, &d, &d);
+    root->build(watermin, watermax, 6, &d, &d);
+
+    // Each level is made from the one above, while all of them are still dense
+    *lod = ChunkLod();
+    const Ocroot *finer = root;
+    while (lod->levels < LOD_LEVELS - 1 && finer->depth > TWIG_LEVELS + 1)
+    {
+        lod->coarse[lod->levels] = finer->lodmm();
+        finer = &lod->coarse[lod->levels++];
+    }
+
+    sparsen(root);
+    for (uint32_t k = 0; k < lod->levels; ++k)
+        sparsen(&lod->coarse[k]);
+    root->modified = true;
+}
+
+// Points root and lod at the chunk at chunk coordinate p and its coarse copies in the store.
+// Returns false if it was never saved.
+bool World::load(Ocroot *root, ChunkLod *lod, ivec3 p) const
+{
+    if (!store)
+        return false;
+
+    Ocroot *roots[LOD_LEVELS] = { root };
+    for (uint32_t k = 0; k < LOD_LEVELS - 1; ++k)
+        roots[k + 1] = &lod->coarse[k];
+    uint32_t n = store->load(p, roots, LOD_LEVELS);
+    if (!n)
+        return false;
+
+    lod->level = 0;
+    lod->levels = n - 1;
+    return true;
+}
+
+// Saves root with its coarse copies if it changed since it was loaded, over what the store has
+// for it unless replace is false. The journal no longer needs to replay the chunk's edits once
+// it is saved with them.
+void World::save(Ocroot *root, const ChunkLod *lod, bool replace)
+{
+    if (!store || !root->modified)
+        return;
+
+    const Ocroot *roots[LOD_LEVELS] = { root };
+    for (uint32_t k = 0; k < lod->levels; ++k)
+        roots[k + 1] = &lod->coarse[k];
+    ivec3 p = index_float(root->position + 0.5f);
+    // The journal goes first: a snapshot with edits the journal on disk does not have yet
+    // would have only the edits before them replayed on it after a crash
+    if (journal)
+    {
+        std::unique_lock<std::mutex> lock(editmutex);
+        if (edits.count(p))
+            journal->sync(0);
+    }
+    if (store->save(p, roots, lod->levels + 1, replace))
+    {
+        std::unique_lock<std::mutex> lock(editmutex);
+        edits.erase(p);
+    }
+    root->modified = false;
+}
+
+// Applies the journaled edits of the chunk at chunk coordinate p that it was not saved with.
+// The journal is only cut short at checkpoints, so after a crash a chunk can be saved with
+// edits that are replayed on it again. That changes nothing as long as all of them are: each
+// edit leaves every voxel in its box empty, or of its material, or as it was if it was solid,
+// whatever came before. save syncs the journal before the chunk for that.
+void World::replay(Ocroot *root, ChunkLod *lod, ivec3 p)
+{
+    std::vector<JournalEdit> list;
+    {
+        std::unique_lock<std::mutex> lock(editmutex);
+        auto found = edits.find(p);
+        if (found == edits.end())
+            return;
+        list = found->second;
+    }
+
+    // The coarse copies were made without the edits
+    lod->release();
+    for (const JournalEdit& e : list)
+    {
+        Ocdelta tree, twig;
+        apply(root, &e, &tree, &twig);
+    }
+}
+
+// Saves every chunk with journaled edits that is still in memory, then starts the journal over
+// with the edits of those that are not
+void World::checkpoint()
+{
+    std::vector<ivec3> dirty;
+    {
+        std::unique_lock<std::mutex> lock(editmutex);
+        for (const auto& e : edits)
+            dirty.push_back(e.first);
+    }
+
+    ivec3 bounds(width, height, depth);
+    for (ivec3 p : dirty)
+    {
+        int i = index(p.x, p.y, p.z);
+        bool inside = glm::all(glm::greaterThanEqual(p, chunkcoordmin)) && glm::all(glm::lessThan(p, chunkcoordmin + bounds));
+        if (inside && !pending[i])
+            save(&chunk[i], &lod[i], true);
+        else if (CachedChunk *c = chunkcache.peek(p))
+            save(&c->root, &c->lod, true);
+    }
+
+    std::vector<JournalEdit> left;
+    {
+        std::unique_lock<std::mutex> lock(editmutex);
+        for (const auto& e : edits)
+            left.insert(left.end(), e.second.begin(), e.second.end());
+    }
+    journal->rewrite(left);
+}
+
+// Puts an empty chunk at chunk coordinate p into slot i until the real one is uploaded
+void World::placeholder(int i, ivec3 p)
+{
+    chunk[i] = Ocroot();
+    chunk[i].position = vec3(p) * (float)chunksize;
+    chunk[i].size = (float)chunksize;
+    chunk[i].depth = TREE_MAX_DEPTH;
+    chunk[i].reserve(1, 1);
+    chunk[i].tree[0] = Octree(EMPTY, 0);
+    chunk[i].trees = 1;
+    chunk[i].twigs = 0;
 }
 
 glm::ivec3 World::index_float(glm::vec3 p) const
@@ -333,46 +1018,92 @@ glm::ivec3 World::index_float(glm::vec3 p) const
 
 void World::shift(glm::ivec3 offset)
 {
-    using glm::vec3;
-    using glm::ivec3;
-    using glm::ivec2;
-    using glm::length;
-    using glm::abs;
-
     assert(glm::length(vec3(offset)) == 1.0);
+    recenter(chunkcoordmin + offset);
+}
+
+// Moves the world to start at chunk coordinate newmin. Slots are already indexed modulo the
+// size of the world, so every chunk still inside keeps its slot and only the slots whose
+// coordinate changes are touched: what leaves goes to the caches, what enters comes from
+// them or is streamed in. Every GPUChunk then goes up in one write.
+void World::recenter(glm::ivec3 newmin)
+{
+    using glm::ivec2;
 
-    static const ivec3 axis[] = { ivec3(1, 0, 0), ivec3(0, 1, 0), ivec3(0, 0, 1) };
+    if (newmin == chunkcoordmin)
+        return;
 
     ivec3 bounds(width, height, depth);
-    vec3 chunkcoordmax = chunkcoordmin + bounds;
-    int index = offset.x ? 0 : offset.y ? 1 : /* offset.z ? */ 2;
-    ivec2 inv_index = offset.x ? ivec2(2, 1) : offset.y ? ivec2(2, 0) : /* offset.z ? */ ivec2(1, 0);
+    auto moved = [&](ivec3 c) {
+        return newmin + ivec3(modulo(c.x - newmin.x, width), modulo(c.y - newmin.y, height), modulo(c.z - newmin.z, depth));
+    };
 
-    assert(inv_index[0] != index && inv_index[1] != index);
-
-    int sign = offset.x + offset.y + offset.z;
-    ivec3 u = axis[index] * ivec3(sign < 0 ? chunkcoordmin[index] - 1 : chunkcoordmax[index]);
-    ivec3 prev = ivec3(0); // Previous pyramid point
-    for (int i = 0; i < bounds[inv_index[0]]; ++i)
+    // Each column gets at most one pyramid job, two jobs must never share a slot
+    for (int z = 0; z < depth; ++z)
     {
-        ivec3 s = axis[inv_index[0]] * (chunkcoordmin[inv_index[0]] + i);
-        for (int j = 0; j < bounds[inv_index[1]]; ++j)
+        for (int x = 0; x < width; ++x)
         {
-            ivec3 t = axis[inv_index[1]] * (chunkcoordmin[inv_index[1]] + j);
-            ivec3 p = s + t + u;
+            ivec3 c = chunkcoordmin + ivec3(x, 0, z), p = moved(c);
+            if (p.x == c.x && p.z == c.z)
+                continue;
+
+            int j = index(c.x, c.z);
+            heightmapcache.put(ivec2(c.x, c.z), heightmap[j], heightmap[j].bytes());
+            heightmap[j] = BoundsPyramid();
+            if (!heightmapcache.take(ivec2(p.x, p.z), &heightmap[j]))
+                jobs.submit([this, p]() { g_pyramid(p.x, p.z); });
+        }
+    }
 
-            if (!offset.y && (j == 0 || p.x != prev.x || p.z != prev.z)) // First iteration or a new point?
+    // All that leaves is put away before anything is taken back, placeholders and chunks
+    // still on their way are simply dropped
+    std::vector<ivec3> entering;
+    for (int z = 0; z < depth; ++z)
+    {
+        for (int y = 0; y < height; ++y)
+        {
+            for (int x = 0; x < width; ++x)
             {
-                g_pyramid(p.x, p.z);
-                prev = p;
+                ivec3 c = chunkcoordmin + ivec3(x, y, z), p = moved(c);
+                if (p == c)
+                    continue;
+
+                int i = index(c.x, c.y, c.z);
+                ++ticket[i];
+                CachedChunk cached = { chunk[i], lod[i] };
+                if (pending[i])
+                    chunk[i].release();
+                else
+                    chunkcache.put(c, cached, bytes(&cached));
+                chunk[i] = Ocroot();
+                lod[i] = ChunkLod();
+                entering.push_back(p);
             }
-
-            g_chunk(p.x, p.y, p.z);
-
-            Ocdelta d(true);
-            modify(this->index(p.x, p.y, p.z), &d, &d);
         }
     }
+    jobs.wait();
+
+    // Chunks missing from the cache are left to dispatch and upload, only the placeholders
+    // go up now. Uploads stay on this thread, it owns the GL context.
+    for (ivec3 p : entering)
+    {
+        int i = index(p.x, p.y, p.z);
+        CachedChunk cached = {};
+        pending[i] = !chunkcache.take(p, &cached);
+        queued[i] = false;
+        chunk[i] = cached.root;
+        lod[i] = cached.lod;
+        if (pending[i])
+            placeholder(i, p);
+        ++revision[i];
+
+        Ocdelta d(true);
+        stage(i, &d, &d);
+    }
+
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, chunk_ssbo);
+    glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, (volume + 1) * sizeof(GPUChunk), gcd);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
 
-    chunkcoordmin += offset;
+    chunkcoordmin = newmin;
 }
@@ -3,22 +3,32 @@
 #ifndef WORLD_H
 #define WORLD_H
 
+#include <atomic>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
 #include <glm/mat4x4.hpp>
+#include <glm/vec2.hpp>
 #include <glm/vec3.hpp>
 #include "Allocator.h"
 #include "Atlas.h"
+#include "BoundsPyramid.h"
+#include "Cache.h"
+#include "ChunkStore.h"
 #include "Light.h"
+#include "Jobs.h"
+#include "Journal.h"
+#include "Octree.h"
 
-struct Ocroot;
-struct Ocdelta;
-struct BoundsPyramid;
+struct Shader;
+struct PerspectiveCamera;
 
 struct GPUChunk
 {
     glm::vec3 bmin;
     uint32_t tr_reg, tr_off;
     uint32_t tw_reg, tw_off;
-    uint32_t _align;
+    uint32_t flags;
 
     GPUChunk() = default;
     GPUChunk(const Ocroot *r, RootAllocation a);
@@ -26,6 +36,32 @@ struct GPUChunk
 
 static_assert(sizeof(GPUChunk) % 32 == 0);
 
+#define CHUNK_SPARSE 1
+// The depth of the chunk's tree is kept in the flags above this bit
+#define CHUNK_DEPTH_SHIFT 8
+
+// Levels of detail of each chunk, level k being k levels shallower than the full chunk
+#define LOD_LEVELS 3
+
+// Coarser copies of a chunk made by lodmm when it is generated, each one from the one
+// before. Only the one picked for its distance to the camera is on the GPU, and they are
+// dropped when the chunk is edited since they no longer match it.
+struct ChunkLod
+{
+    uint32_t level, levels;
+    Ocroot coarse[LOD_LEVELS - 1];
+
+    void release();
+    size_t bytes() const;
+};
+
+// What the chunk cache keeps of a chunk
+struct CachedChunk
+{
+    Ocroot root;
+    ChunkLod lod;
+};
+
 struct WorldShaderContext
 {
     static constexpr int CHUNK_SSBO_BINDING = 2;
@@ -41,10 +77,77 @@ struct WorldShaderContext
     void bind_ul();
 };
 
+// A chunk compacted in the background, swapped in if it was not changed since
+struct Compaction
+{
+    int index;
+    uint64_t version;
+    Ocroot root;
+};
+
+// A chunk generated by the streaming workers, waiting for its upload. It belongs in its slot
+// only if the slot's ticket has not moved on since it was asked for.
+struct Streamed
+{
+    int index;
+    uint64_t ticket;
+    Ocroot root;
+    ChunkLod lod;
+};
+
+// What streaming did in the last frame, and how many placeholders are left
+struct StreamStats
+{
+    uint32_t pending, dispatched, generated, uploaded;
+};
+
+struct ChunkHash
+{
+    size_t operator()(glm::ivec2 p) const;
+    size_t operator()(glm::ivec3 p) const;
+};
+
+// Defines the twig layout of this build for the includes and the shader compiled after it
+Shader& defineTwigLayout(Shader& shader);
+// Includes shaders/Chunkmarch.glsl with the twig layout of this build defined in front of it
+Shader& includeChunkmarch(Shader& shader);
+
 struct World
 {
     RootAllocator allocator;
+    JobPool jobs, background, streaming;
     Ocroot *chunk;
+    ChunkLod *lod;
+    uint64_t *version;
+    // Counts the changes of the chunk in each slot, unlike version not those of its level of
+    // detail or of where its storage is
+    uint64_t *revision;
+    bool *compacting;
+    std::mutex compactmutex;
+    std::vector<Compaction> compacted;
+    // Slots shifted into the world hold an empty placeholder until their chunk is generated
+    // and uploaded, at most uploadbytes or uploadms worth of them per frame. Jobs are only
+    // handed out a few at a time, so that the ones nearest the camera always go first.
+    bool *pending, *queued;
+    std::atomic<uint64_t> *ticket;
+    std::atomic<int> inflight;
+    std::mutex streammutex;
+    std::vector<Streamed> streamed;
+    size_t carried;
+    size_t uploadbytes;
+    double uploadms;
+    StreamStats streamstats;
+    // Chunks and heightmaps shifted out of the world, with their edits, by chunk coordinate
+    LruCache<glm::ivec3, CachedChunk, ChunkHash> chunkcache;
+    LruCache<glm::ivec2, BoundsPyramid, ChunkHash> heightmapcache;
+    // Where chunks are paged in from before they are generated, and saved to when they are
+    // new or edited, if the world has a save directory
+    ChunkStore *store;
+    // Edits made since their chunks were last saved, journaled next to the store so that they
+    // are replayed when those chunks are loaded or generated again
+    EditJournal *journal;
+    std::mutex editmutex;
+    std::unordered_map<glm::ivec3, std::vector<JournalEdit>, ChunkHash> edits;
     GPUChunk *gcd;
     BoundsPyramid *heightmap;
     int width, height, depth, plane, volume, chunksize;
@@ -56,15 +159,37 @@ struct World
     glm::ivec3 index_float(glm::vec3 p) const;
     int index(int x, int y, int z) const;
     int index(int x, int z) const;
-    void init(int w, int h, int d, int s);
+    // Caves and overhangs carved out of the heightfield, or the heightfield alone
+    bool caves;
+
+    void init(int w, int h, int d, int s, bool caves = false, const char *save = nullptr);
     void deinit();
     void load_gpu();
+    void unload_gpu();
     void draw_shadowmap(const glm::mat4& viewproj, const DLight& position, const Shadowmap& shadowmap, const WorldShaderContext &context);
     void draw(glm::mat4 mvp, glm::vec3 eye, const Shadowmap *shadowmap = nullptr, const glm::mat4 *shadowVP = nullptr);
+    const Ocroot *active(int i) const;
+    void edit(EditOp op, glm::vec3 cmin, glm::vec3 cmax, uint16_t material);
     void modify(int i, const Ocdelta *tree, const Ocdelta *twig);
+    void refresh(int i, const Ocdelta *tree, const Ocdelta *twig);
+    bool stage(int i, const Ocdelta *tree, const Ocdelta *twig);
+    void compact();
+    void follow(PerspectiveCamera *camera);
+    void dispatch(glm::vec3 eye, const glm::mat4& viewproj);
+    void pickdetail(glm::vec3 eye);
+    void upload();
+    void uploadbudget(size_t bytes, double ms);
+    void cachelimits(size_t chunkbytes, size_t heightmapbytes);
     void g_pyramid(int x, int z);
     void g_chunk(int x, int y, int z);
+    void g_root(Ocroot *root, ChunkLod *lod, glm::ivec3 p, const BoundsPyramid *pyr) const;
+    bool load(Ocroot *root, ChunkLod *lod, glm::ivec3 p) const;
+    void save(Ocroot *root, const ChunkLod *lod, bool replace);
+    void replay(Ocroot *root, ChunkLod *lod, glm::ivec3 p);
+    void checkpoint();
+    void placeholder(int i, glm::ivec3 p);
     void shift(glm::ivec3 s);
+    void recenter(glm::ivec3 newmin);
 };
 
 #endif
\ No newline at end of file